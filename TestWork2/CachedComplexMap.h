@@ -0,0 +1,443 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include "ComplexMapIndex.h"
+#include "ComplexMapStorage.h"
+
+using namespace std;
+
+enum class EvictionReason {
+	Capacity,
+	Expired
+};
+
+struct CacheOptions {
+	// 0 means no limit
+	int MaxEntries = 0;
+	// Values count sizeof(TValue), arrays their elements, strings their characters with the terminator
+	size_t MaxBytes = 0;
+};
+
+// A bounded map for caching: when a limit is reached the CLOCK hand evicts entries that were not read
+// since it last passed them. A hit only sets the entry's reference flag, nothing is moved or relinked.
+// Entries added with a time to live expire lazily, on access or when the hand reaches them.
+// Pointers returned by array and string getters stay valid until the entry is removed or evicted,
+// and any add may evict. Like ComplexMap, the cache is not thread-safe.
+template <typename TKey, typename TValue, typename TIndex = FlatHashIndex>
+class CachedComplexMap {
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+	typedef chrono::steady_clock Clock;
+
+	struct Entry {
+		TKey Key;
+		ValueKind Kind;
+		bool Referenced;
+		int Size;
+		union {
+			TValue Value;
+			TValue* Values;
+			char* Line;
+		};
+		Clock::time_point Expiry;
+
+		Entry()
+			: Key{}, Kind{ ValueKind::None }, Referenced{ false }, Size{ 0 }, Values{ nullptr }, Expiry{ Clock::time_point::max() } {
+		}
+	};
+
+	typedef typename TIndex::template Type<TKey, int> Index;
+
+	Index slotsIndex;
+	// The CLOCK ring; slots of removed entries have Kind None and are reused from freeSlots
+	vector<Entry> entries;
+	vector<int> freeSlots;
+	size_t hand = 0;
+	size_t payloadBytes = 0;
+	CacheOptions options;
+	function<void(const TKey&, EvictionReason)> evictionCallback;
+
+	static Entry CreateValue(TValue value) {
+		Entry entry;
+		entry.Kind = ValueKind::Value;
+		entry.Value = value;
+		return entry;
+	}
+	static Entry CreateArray(const TValue* values, int size) {
+		Entry entry;
+		entry.Kind = ValueKind::Array;
+		entry.Size = size;
+		entry.Values = new TValue[size];
+		memcpy_s(entry.Values, size * sizeof(TValue), values, size * sizeof(TValue));
+		return entry;
+	}
+	static Entry CreateString(const char* line, int length) {
+		Entry entry;
+		entry.Kind = ValueKind::String;
+		entry.Size = length;
+		entry.Line = new char[length + 1];
+		memcpy_s(entry.Line, length + 1, line, length);
+		entry.Line[length] = '\0';
+		return entry;
+	}
+
+	static size_t GetPayloadBytes(const Entry& entry) {
+		switch (entry.Kind) {
+		case ValueKind::Value:
+			return sizeof(TValue);
+		case ValueKind::Array:
+			return entry.Size * sizeof(TValue);
+		case ValueKind::String:
+			return entry.Size + 1;
+		default:
+			return 0;
+		}
+	}
+
+	static void FreePayload(Entry& entry) {
+		if (entry.Kind == ValueKind::Array)
+			delete[] entry.Values;
+		else if (entry.Kind == ValueKind::String)
+			delete[] entry.Line;
+	}
+
+	static bool IsExpired(const Entry& entry) {
+		return entry.Expiry != Clock::time_point::max() && Clock::now() >= entry.Expiry;
+	}
+
+	static Clock::time_point GetExpiry(chrono::milliseconds timeToLive) {
+		return timeToLive <= chrono::milliseconds::zero() ? Clock::time_point::max() : Clock::now() + timeToLive;
+	}
+
+	void DestroyEntry(int slot) {
+		Entry& entry = entries[slot];
+		int erasedSlot;
+		slotsIndex.Erase(entry.Key, &erasedSlot);
+		payloadBytes -= GetPayloadBytes(entry);
+		FreePayload(entry);
+		entry = Entry();
+		freeSlots.push_back(slot);
+	}
+
+	void EvictEntry(int slot, EvictionReason reason) {
+		if (evictionCallback) {
+			TKey key = entries[slot].Key;
+			DestroyEntry(slot);
+			evictionCallback(key, reason);
+			return;
+		}
+
+		DestroyEntry(slot);
+	}
+
+	// Gives every entry one more pass of the hand if it was read since the last one
+	void EvictOne() {
+		while (true) {
+			if (hand >= entries.size())
+				hand = 0;
+
+			Entry& entry = entries[hand];
+			int slot = hand++;
+			if (entry.Kind == ValueKind::None)
+				continue;
+
+			if (IsExpired(entry)) {
+				EvictEntry(slot, EvictionReason::Expired);
+				return;
+			}
+			if (entry.Referenced) {
+				entry.Referenced = false;
+				continue;
+			}
+
+			EvictEntry(slot, EvictionReason::Capacity);
+			return;
+		}
+	}
+
+	void MakeRoom(size_t bytes) {
+		while (GetSize() > 0 && ((options.MaxEntries > 0 && GetSize() >= options.MaxEntries)
+			|| (options.MaxBytes > 0 && payloadBytes + bytes > options.MaxBytes)))
+			EvictOne();
+	}
+
+	// Returns the slot of a live entry, expired ones are evicted on the way
+	int* FindSlot(LookupKey key) {
+		int* slot = slotsIndex.Find(key);
+		if (slot == nullptr || !IsExpired(entries[*slot]))
+			return slot;
+
+		EvictEntry(*slot, EvictionReason::Expired);
+		return nullptr;
+	}
+
+	Entry* FindEntry(LookupKey key) {
+		int* slot = FindSlot(key);
+		if (slot == nullptr)
+			return nullptr;
+
+		Entry& entry = entries[*slot];
+		entry.Referenced = true;
+		return &entry;
+	}
+
+	Entry& GetEntry(LookupKey key) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr)
+			throw "Key not found";
+
+		return *entry;
+	}
+
+	template <typename TKeyArg>
+	Entry& PlaceEntry(TKeyArg&& key, Entry entry, chrono::milliseconds timeToLive) {
+		size_t bytes = GetPayloadBytes(entry);
+		int slot;
+		try {
+			MakeRoom(bytes);
+			entry.Key = TKey(LookupKey(key));
+			entry.Expiry = GetExpiry(timeToLive);
+			if (freeSlots.empty()) {
+				entries.emplace_back();
+				freeSlots.push_back(entries.size() - 1);
+			}
+			slot = freeSlots.back();
+			slotsIndex.Insert(forward<TKeyArg>(key), slot);
+		}
+		catch (...) {
+			FreePayload(entry);
+			throw;
+		}
+
+		freeSlots.pop_back();
+		payloadBytes += bytes;
+		entries[slot] = move(entry);
+		return entries[slot];
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	bool TryAddEntry(TKeyArg&& key, TCreateEntry createEntry, chrono::milliseconds timeToLive) {
+		if (FindSlot(key) != nullptr)
+			return false;
+
+		PlaceEntry(forward<TKeyArg>(key), createEntry(), timeToLive);
+		return true;
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	void AddEntry(TKeyArg&& key, TCreateEntry createEntry, chrono::milliseconds timeToLive) {
+		if (!TryAddEntry(forward<TKeyArg>(key), createEntry, timeToLive))
+			throw "Key already exists";
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	void AddEntryOrReplace(TKeyArg&& key, TCreateEntry createEntry, chrono::milliseconds timeToLive) {
+		Entry entry = createEntry();
+		int* slot = slotsIndex.Find(key);
+		if (slot != nullptr)
+			DestroyEntry(*slot);
+
+		PlaceEntry(forward<TKeyArg>(key), move(entry), timeToLive);
+	}
+
+	// The cache-fill primitive: createEntry runs only on a miss
+	template <typename TKeyArg, typename TCreateEntry>
+	Entry& GetOrAddEntry(TKeyArg&& key, TCreateEntry createEntry, chrono::milliseconds timeToLive) {
+		Entry* entry = FindEntry(key);
+		if (entry != nullptr)
+			return *entry;
+
+		return PlaceEntry(forward<TKeyArg>(key), createEntry(), timeToLive);
+	}
+
+	static TValue GetEntryValue(Entry& entry) {
+		if (entry.Kind != ValueKind::Value)
+			throw "Invalid value type";
+
+		return entry.Value;
+	}
+
+	static const TValue* GetEntryArray(Entry& entry, int* size) {
+		if (entry.Kind != ValueKind::Array)
+			throw "Invalid value type";
+
+		*size = entry.Size;
+		return entry.Values;
+	}
+
+	static const char* GetEntryString(Entry& entry) {
+		if (entry.Kind != ValueKind::String)
+			throw "Invalid value type";
+
+		return entry.Line;
+	}
+
+public:
+	CachedComplexMap(CacheOptions options = CacheOptions())
+		: options{ options } {
+	}
+
+	CachedComplexMap(const CachedComplexMap&) = delete;
+	CachedComplexMap& operator=(const CachedComplexMap&) = delete;
+
+	~CachedComplexMap() {
+		RemoveAll();
+	}
+
+	// Called after an entry is evicted for capacity or expiry, not for Remove or replacement. It must not modify the cache
+	void SetEvictionCallback(function<void(const TKey&, EvictionReason)> callback) {
+		evictionCallback = callback;
+	}
+
+	int GetSize() {
+		return slotsIndex.GetSize();
+	}
+
+	size_t GetPayloadBytes() {
+		return payloadBytes;
+	}
+
+	template <typename TKeyArg>
+	void AddValue(TKeyArg&& key, TValue value, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		AddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(value); }, timeToLive);
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, TValue* values, int size, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		AddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); }, timeToLive);
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, const char* line, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		AddEntry(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); }, timeToLive);
+	}
+
+	template <typename TKeyArg>
+	bool TryAddValue(TKeyArg&& key, TValue value, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return TryAddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(value); }, timeToLive);
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, TValue* values, int size, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return TryAddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); }, timeToLive);
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, const char* line, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return TryAddEntry(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); }, timeToLive);
+	}
+
+	template <typename TKeyArg>
+	void AddValueOrReplace(TKeyArg&& key, TValue value, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		AddEntryOrReplace(forward<TKeyArg>(key), [&]() { return CreateValue(value); }, timeToLive);
+	}
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, TValue* values, int size, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		AddEntryOrReplace(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); }, timeToLive);
+	}
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, const char* line, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		AddEntryOrReplace(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); }, timeToLive);
+	}
+
+	TValue GetValue(LookupKey key) {
+		return GetEntryValue(GetEntry(key));
+	}
+	const TValue* GetArray(LookupKey key, int* size) {
+		return GetEntryArray(GetEntry(key), size);
+	}
+	const char* GetString(LookupKey key) {
+		return GetEntryString(GetEntry(key));
+	}
+
+	bool TryGetValue(LookupKey key, TValue* value) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::Value)
+			return false;
+
+		*value = entry->Value;
+		return true;
+	}
+	bool TryGetArray(LookupKey key, const TValue** values, int* size) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::Array)
+			return false;
+
+		*values = entry->Values;
+		*size = entry->Size;
+		return true;
+	}
+	bool TryGetString(LookupKey key, const char** line) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::String)
+			return false;
+
+		*line = entry->Line;
+		return true;
+	}
+
+	template <typename TKeyArg>
+	TValue GetOrAddValue(TKeyArg&& key, TValue value, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return GetEntryValue(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(value); }, timeToLive));
+	}
+	template <typename TKeyArg>
+	const TValue* GetOrAddArray(TKeyArg&& key, int* resultSize, TValue* values, int size, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return GetEntryArray(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); }, timeToLive), resultSize);
+	}
+	template <typename TKeyArg>
+	const char* GetOrAddString(TKeyArg&& key, const char* line, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return GetEntryString(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); }, timeToLive));
+	}
+
+	// The producer is called only on a miss, for arrays it returns vector<TValue>, for strings string
+	template <typename TKeyArg, typename TProducer>
+	TValue GetOrAddValueWith(TKeyArg&& key, TProducer producer, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return GetEntryValue(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(producer()); }, timeToLive));
+	}
+	template <typename TKeyArg, typename TProducer>
+	const TValue* GetOrAddArrayWith(TKeyArg&& key, int* resultSize, TProducer producer, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return GetEntryArray(GetOrAddEntry(forward<TKeyArg>(key), [&]() {
+			vector<TValue> values = producer();
+			return CreateArray(values.data(), (int)values.size());
+		}, timeToLive), resultSize);
+	}
+	template <typename TKeyArg, typename TProducer>
+	const char* GetOrAddStringWith(TKeyArg&& key, TProducer producer, chrono::milliseconds timeToLive = chrono::milliseconds::zero()) {
+		return GetEntryString(GetOrAddEntry(forward<TKeyArg>(key), [&]() {
+			string line = producer();
+			return CreateString(line.c_str(), (int)line.size());
+		}, timeToLive));
+	}
+
+	void Remove(LookupKey key) {
+		if (!TryRemove(key))
+			throw "Key not found";
+	}
+	bool TryRemove(LookupKey key) {
+		int* slot = FindSlot(key);
+		if (slot == nullptr)
+			return false;
+
+		DestroyEntry(*slot);
+		return true;
+	}
+	void RemoveAll() {
+		for (size_t i = 0; i < entries.size(); i++)
+			FreePayload(entries[i]);
+
+		entries.clear();
+		freeSlots.clear();
+		slotsIndex.Clear();
+		hand = 0;
+		payloadBytes = 0;
+	}
+
+	// Evicts every expired entry now instead of waiting for an access or the hand, returns how many went
+	int RemoveExpired() {
+		int count = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+			if (entries[i].Kind != ValueKind::None && IsExpired(entries[i])) {
+				EvictEntry(i, EvictionReason::Expired);
+				count++;
+			}
+		return count;
+	}
+};
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include "ComplexMapIndex.h"
+#include "ComplexMapStorage.h"
+#include "ComplexMapSimd.h"
+
+using namespace std;
+
+// Values, arrays and strings live in separate dense columns with their keys alongside, so scans over one
+// kind never touch the others. The index maps a key to its column and position; removal moves the
+// last entry of the column into the hole and repoints that entry's key.
+template <typename TKey, typename TValue, typename TIndex = FlatHashIndex>
+class ColumnarComplexMap {
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+
+	struct Location {
+		ValueKind Kind;
+		int Position;
+	};
+
+	struct ArrayEntry {
+		TValue* Values;
+		int Size;
+	};
+
+	typedef typename TIndex::template Type<TKey, Location> Index;
+
+	Index valuesIndex;
+	vector<TKey> valueKeys;
+	vector<TValue> values;
+	vector<TKey> arrayKeys;
+	vector<ArrayEntry> arrays;
+	vector<TKey> stringKeys;
+	vector<char*> strings;
+
+	template <typename TEntry>
+	static int AppendEntry(vector<TKey>& keys, vector<TEntry>& entries, LookupKey key, TEntry entry) {
+		entries.push_back(entry);
+		try {
+			keys.emplace_back(key);
+		}
+		catch (...) {
+			entries.pop_back();
+			throw;
+		}
+		return entries.size() - 1;
+	}
+
+	template <typename TEntry>
+	void EraseEntry(vector<TKey>& keys, vector<TEntry>& entries, int position) {
+		int last = entries.size() - 1;
+		if (position != last) {
+			entries[position] = entries[last];
+			keys[position] = move(keys[last]);
+			valuesIndex.Find(keys[position])->Position = position;
+		}
+		entries.pop_back();
+		keys.pop_back();
+	}
+
+	Location CreateValue(LookupKey key, TValue value) {
+		return Location{ ValueKind::Value, AppendEntry(valueKeys, values, key, value) };
+	}
+	Location CreateArray(LookupKey key, const TValue* arrayValues, int size) {
+		ArrayEntry entry{ new TValue[size], size };
+		memcpy_s(entry.Values, size * sizeof(TValue), arrayValues, size * sizeof(TValue));
+		try {
+			return Location{ ValueKind::Array, AppendEntry(arrayKeys, arrays, key, entry) };
+		}
+		catch (...) {
+			delete[] entry.Values;
+			throw;
+		}
+	}
+	Location CreateString(LookupKey key, const char* line) {
+		int length = strlen(line);
+		char* stringValue = new char[length + 1];
+		memcpy_s(stringValue, length + 1, line, length + 1);
+		try {
+			return Location{ ValueKind::String, AppendEntry(stringKeys, strings, key, stringValue) };
+		}
+		catch (...) {
+			delete[] stringValue;
+			throw;
+		}
+	}
+
+	void DestroyEntry(Location location) {
+		switch (location.Kind) {
+		case ValueKind::Value:
+			EraseEntry(valueKeys, values, location.Position);
+			break;
+		case ValueKind::Array:
+			delete[] arrays[location.Position].Values;
+			EraseEntry(arrayKeys, arrays, location.Position);
+			break;
+		case ValueKind::String:
+			delete[] strings[location.Position];
+			EraseEntry(stringKeys, strings, location.Position);
+			break;
+		default:
+			break;
+		}
+	}
+
+	template <typename TKeyArg, typename TCreateLocation>
+	bool TryAddLocation(TKeyArg&& key, TCreateLocation createLocation) {
+		LookupKey lookupKey = key;
+		return valuesIndex.TryEmplace(forward<TKeyArg>(key), [&]() { return createLocation(lookupKey); }).second;
+	}
+
+	template <typename TKeyArg, typename TCreateLocation>
+	void AddLocation(TKeyArg&& key, TCreateLocation createLocation) {
+		if (!TryAddLocation(forward<TKeyArg>(key), createLocation))
+			throw "Key already exists";
+	}
+
+	template <typename TKeyArg, typename TCreateLocation>
+	void AddLocationOrReplace(TKeyArg&& key, TCreateLocation createLocation) {
+		LookupKey lookupKey = key;
+		pair<Location*, bool> inserted = valuesIndex.TryEmplace(forward<TKeyArg>(key), [&]() { return createLocation(lookupKey); });
+		if (inserted.second)
+			return;
+
+		// The new entry goes in first, so if the old one's hole is filled by it the index is already pointing at it
+		Location oldLocation = *inserted.first;
+		*inserted.first = createLocation(lookupKey);
+		DestroyEntry(oldLocation);
+	}
+
+	template <typename TKeyArg, typename TCreateLocation>
+	Location GetOrAddLocation(TKeyArg&& key, TCreateLocation createLocation) {
+		LookupKey lookupKey = key;
+		return *valuesIndex.TryEmplace(forward<TKeyArg>(key), [&]() { return createLocation(lookupKey); }).first;
+	}
+
+	Location GetLocation(LookupKey key) {
+		Location* location = valuesIndex.Find(key);
+		if (location == nullptr)
+			throw "Key not found";
+
+		return *location;
+	}
+
+	TValue GetLocationValue(Location location) {
+		if (location.Kind != ValueKind::Value)
+			throw "Invalid value type";
+
+		return values[location.Position];
+	}
+
+	const TValue* GetLocationArray(Location location, int* size) {
+		if (location.Kind != ValueKind::Array)
+			throw "Invalid value type";
+
+		*size = arrays[location.Position].Size;
+		return arrays[location.Position].Values;
+	}
+
+	const char* GetLocationString(Location location) {
+		if (location.Kind != ValueKind::String)
+			throw "Invalid value type";
+
+		return strings[location.Position];
+	}
+
+public:
+	typedef typename ValueKernels<TValue>::SumType SumType;
+
+	ColumnarComplexMap() {
+	}
+
+	ColumnarComplexMap(const ColumnarComplexMap&) = delete;
+	ColumnarComplexMap& operator=(const ColumnarComplexMap&) = delete;
+
+	~ColumnarComplexMap() {
+		RemoveAll();
+	}
+
+	int GetSize() {
+		return valuesIndex.GetSize();
+	}
+
+	template <typename TKeyArg>
+	void AddValue(TKeyArg&& key, TValue value) {
+		AddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateValue(lookupKey, value); });
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, TValue* values, int size) {
+		AddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateArray(lookupKey, values, size); });
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, const char* line) {
+		AddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateString(lookupKey, line); });
+	}
+
+	template <typename TKeyArg>
+	bool TryAddValue(TKeyArg&& key, TValue value) {
+		return TryAddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateValue(lookupKey, value); });
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, TValue* values, int size) {
+		return TryAddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateArray(lookupKey, values, size); });
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, const char* line) {
+		return TryAddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateString(lookupKey, line); });
+	}
+
+	template <typename TKeyArg>
+	void AddValueOrReplace(TKeyArg&& key, TValue value) {
+		AddLocationOrReplace(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateValue(lookupKey, value); });
+	}
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, TValue* values, int size) {
+		AddLocationOrReplace(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateArray(lookupKey, values, size); });
+	}
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, const char* line) {
+		AddLocationOrReplace(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateString(lookupKey, line); });
+	}
+
+	TValue GetValue(LookupKey key) {
+		return GetLocationValue(GetLocation(key));
+	}
+	const TValue* GetArray(LookupKey key, int* size) {
+		return GetLocationArray(GetLocation(key), size);
+	}
+	const char* GetString(LookupKey key) {
+		return GetLocationString(GetLocation(key));
+	}
+
+	bool TryGetValue(LookupKey key, TValue* value) {
+		Location* location = valuesIndex.Find(key);
+		if (location == nullptr || location->Kind != ValueKind::Value)
+			return false;
+
+		*value = values[location->Position];
+		return true;
+	}
+	bool TryGetArray(LookupKey key, const TValue** arrayValues, int* size) {
+		Location* location = valuesIndex.Find(key);
+		if (location == nullptr || location->Kind != ValueKind::Array)
+			return false;
+
+		*arrayValues = arrays[location->Position].Values;
+		*size = arrays[location->Position].Size;
+		return true;
+	}
+	bool TryGetString(LookupKey key, const char** line) {
+		Location* location = valuesIndex.Find(key);
+		if (location == nullptr || location->Kind != ValueKind::String)
+			return false;
+
+		*line = strings[location->Position];
+		return true;
+	}
+
+	template <typename TKeyArg>
+	TValue GetOrAddValue(TKeyArg&& key, TValue value) {
+		return GetLocationValue(GetOrAddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateValue(lookupKey, value); }));
+	}
+	template <typename TKeyArg>
+	const TValue* GetOrAddArray(TKeyArg&& key, int* resultSize, TValue* values, int size) {
+		return GetLocationArray(GetOrAddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateArray(lookupKey, values, size); }), resultSize);
+	}
+	template <typename TKeyArg>
+	const char* GetOrAddString(TKeyArg&& key, const char* line) {
+		return GetLocationString(GetOrAddLocation(forward<TKeyArg>(key), [&](LookupKey lookupKey) { return CreateString(lookupKey, line); }));
+	}
+
+	// Scans walk the dense columns, not the index, and visit entries in column order
+	template <typename TAction>
+	void ForEachValue(TAction action) {
+		for (size_t i = 0; i < values.size(); i++)
+			action(valueKeys[i], values[i]);
+	}
+	template <typename TAction>
+	void ForEachArray(TAction action) {
+		for (size_t i = 0; i < arrays.size(); i++)
+			action(arrayKeys[i], (const TValue*)arrays[i].Values, arrays[i].Size);
+	}
+	template <typename TAction>
+	void ForEachString(TAction action) {
+		for (size_t i = 0; i < strings.size(); i++)
+			action(stringKeys[i], (const char*)strings[i]);
+	}
+
+	// Aggregates over scalar values only; arrays and strings are not included
+	SumType SumValues() {
+		return ValueKernels<TValue>::Sum(values.data(), values.size());
+	}
+
+	bool MinMaxValues(TValue* minimum, TValue* maximum) {
+		if (values.empty())
+			return false;
+
+		ValueKernels<TValue>::MinMax(values.data(), values.size(), minimum, maximum);
+		return true;
+	}
+
+	size_t CountValuesWhere(ValueComparison comparison, TValue operand) {
+		return ValueKernels<TValue>::Count(values.data(), values.size(), comparison, operand);
+	}
+
+	// Arbitrary predicates run as a plain loop over the column, which the compiler can still vectorize
+	template <typename TPredicate>
+	size_t CountValuesWhere(TPredicate predicate) {
+		return ScalarCountWhere(values.data(), values.size(), predicate);
+	}
+
+	void Remove(LookupKey key) {
+		if (!TryRemove(key))
+			throw "Key not found";
+	}
+	bool TryRemove(LookupKey key) {
+		Location location;
+		if (!valuesIndex.Erase(key, &location))
+			return false;
+
+		DestroyEntry(location);
+		return true;
+	}
+	void RemoveAll() {
+		for (size_t i = 0; i < arrays.size(); i++)
+			delete[] arrays[i].Values;
+		for (size_t i = 0; i < strings.size(); i++)
+			delete[] strings[i];
+
+		valueKeys.clear();
+		values.clear();
+		arrayKeys.clear();
+		arrays.clear();
+		stringKeys.clear();
+		strings.clear();
+		valuesIndex.Clear();
+	}
+};
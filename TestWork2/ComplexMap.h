@@ -1,241 +1,1096 @@
 #pragma once
 
-#include <map>
-#include <algorithm>
+#include <functional>
+#include "ComplexMapIndex.h"
+#include "ComplexMapStorage.h"
+#include "ComplexMapAllocator.h"
+#include "ComplexMapSnapshot.h"
+#include "ComplexMapStats.h"
+#include "ComplexMapParallel.h"
+#include "ComplexMapReclaim.h"
 
 using namespace std;
 
+// A record for BulkLoad. Array and string records borrow their payload, it is copied during the load
 template <typename TKey, typename TValue>
+struct BulkRecord {
+	TKey Key;
+	ValueKind Kind;
+	TValue Value;
+	const TValue* Values;
+	int Size;
+	const char* Line;
+
+	static BulkRecord ForValue(TKey key, TValue value) {
+		return BulkRecord{ move(key), ValueKind::Value, value, nullptr, 0, nullptr };
+	}
+	static BulkRecord ForArray(TKey key, const TValue* values, int size) {
+		return BulkRecord{ move(key), ValueKind::Array, TValue(), values, size, nullptr };
+	}
+	static BulkRecord ForString(TKey key, const char* line) {
+		return BulkRecord{ move(key), ValueKind::String, TValue(), nullptr, 0, line };
+	}
+};
+
+// What BulkLoad does with a key that is already in the map or repeats in the records: throw like Add,
+// keep the first like TryAdd, or keep the last like AddOrReplace
+enum class DuplicatePolicy {
+	Throw,
+	Skip,
+	Replace
+};
+
+template <typename TKey, typename TValue, typename TIndex = OrderedIndex, typename TStorage = HeapStorage, typename TAllocator = HeapAllocator>
 class ComplexMap {
-	class ValueType {
-	public:
-		virtual ~ValueType() = 0;
-	};
+	typedef typename TStorage::template Type<TValue, TAllocator> Storage;
+	typedef typename Storage::Item Item;
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
 
-	class SingleValueType : public ValueType {
-	public:
-		TValue Value;
+	typedef typename TIndex::template Type<TKey, Item> Index;
 
-		SingleValueType(TValue value)
-			: Value{ value } {
-		}
+	Storage storage;
+	Index valuesIndex;
+	ReclaimMode reclaimMode = ReclaimMode::Immediate;
+	vector<Item> retiredItems;
+	vector<Index> retiredIndexes;
+	// Last, so it stops before the storage it frees into goes away
+	unique_ptr<ReclaimThread> reclaimThread;
 
-		virtual ~SingleValueType() {
-		}
-	};
+	explicit ComplexMap(Index&& index)
+		: valuesIndex(move(index)) {
+	}
+#ifdef COMPLEXMAP_STATS
+	StatsCounters stats;
 
-	class ArrayValueType : public ValueType {
-	public:
-		TValue* Values;
-		int Size;
+	void CountAllocation(Item& item) {
+		int size;
+		TValue* values;
+		ValueKind kind = storage.GetKind(item);
+		size_t bytes = sizeof(TValue);
+		if (storage.GetArray(item, &values, &size))
+			bytes = size * sizeof(TValue);
+		else if (kind == ValueKind::String)
+			bytes = strlen(storage.GetString(item)) + 1;
+		COMPLEXMAP_STATS_ADD(Allocations[(int)kind], 1);
+		COMPLEXMAP_STATS_ADD(AllocatedBytes[(int)kind], bytes);
+	}
+#endif
 
-		ArrayValueType(TValue* values, int size)
-			: Size{ size } {
-			Values = new TValue[size];
-			memcpy_s(Values, size * sizeof(TValue), values, size * sizeof(TValue));
-		}
+	template <typename TCreateItem>
+	auto CountingCreateItem(TCreateItem createItem) {
+#ifdef COMPLEXMAP_STATS
+		return [this, createItem]() {
+			Item item = createItem();
+			CountAllocation(item);
+			return item;
+		};
+#else
+		return createItem;
+#endif
+	}
 
-		virtual ~ArrayValueType() {
-			delete[] Values;
-		}
-	};
+	template <typename TKeyArg, typename TCreateItem>
+	bool TryAddItem(TKeyArg&& key, TCreateItem createItem) {
+		COMPLEXMAP_STATS_TIME(Insert);
+		bool isAdded = valuesIndex.TryEmplace(forward<TKeyArg>(key), CountingCreateItem(createItem)).second;
+		if (!isAdded)
+			COMPLEXMAP_STATS_ADD(DuplicateKeys, 1);
+		return isAdded;
+	}
 
-	class StringValueType : public ValueType {
-	public:
-		char* Line;
+	template <typename TKeyArg, typename TCreateItem>
+	void AddItem(TKeyArg&& key, TCreateItem createItem) {
+		if (!TryAddItem(forward<TKeyArg>(key), createItem))
+			throw "Key already exists";
+	}
 
-		StringValueType(const char* line) {
-			int length = strlen(line) + 1;
-			Line = new char[length];
-			strcpy_s(Line, length, line);
-		}
+	template <typename TKeyArg>
+	void AddItemOrReplace(TKeyArg&& key, Item item) {
+		COMPLEXMAP_STATS_TIME(Insert);
+#ifdef COMPLEXMAP_STATS
+		CountAllocation(item);
+#endif
+		pair<Item*, bool> inserted = valuesIndex.Insert(forward<TKeyArg>(key), item);
+		if (inserted.second)
+			return;
+
+		COMPLEXMAP_STATS_ADD(Replaces, 1);
+		RetireItem(*inserted.first);
+		*inserted.first = item;
+	}
 
-		virtual ~StringValueType() {
-			delete[] Line;
+	static const size_t ReclaimBatchSize = 64;
+
+	// Removed and replaced entries come here. Deferred frees them a full batch at a time, so no call frees more
+	// than ReclaimBatchSize; Background hands each batch to the reclaim thread
+	void RetireItem(Item& item) {
+		if (reclaimMode == ReclaimMode::Immediate) {
+			storage.Destroy(item);
+			return;
 		}
-	};
 
-	map<TKey, ValueType*> valuesMap;
+		retiredItems.push_back(item);
+		if (retiredItems.size() < ReclaimBatchSize)
+			return;
+
+		if (reclaimMode == ReclaimMode::Background)
+			PostRetiredItems();
+		else
+			DestroyRetiredItems();
+	}
 
-	bool TryAddValueType(TKey key, ValueType* valueType) {
-		pair<map<TKey, ValueType*>::iterator, bool> inserted = valuesMap.insert(pair<TKey, ValueType*>(key, valueType));
-		if (inserted.second)
-			return true;
+	void DestroyRetiredItems() {
+		for (size_t i = 0; i < retiredItems.size(); i++)
+			storage.Destroy(retiredItems[i]);
+		retiredItems.clear();
+	}
 
-		delete valueType;
-		return false;
+	void PostRetiredItems() {
+		shared_ptr<vector<Item>> items = make_shared<vector<Item>>(move(retiredItems));
+		retiredItems.clear();
+		reclaimThread->Post([this, items]() {
+			for (size_t i = 0; i < items->size(); i++)
+				storage.Destroy((*items)[i]);
+		});
 	}
 
-	void AddValueType(TKey key, ValueType* valueType) {
-		if (!TryAddValueType(key, valueType))
-			throw "Key already exists";
+	void DestroyIndexItems(Index& index) {
+		index.ForEachForUpdate(
+			[this](const TKey& key, Item& item) {
+				storage.Destroy(item);
+			});
+		index.Clear();
 	}
 
-	void AddValueTypeOrReplace(int key, ValueType* valueType) {
-		pair<map<int, ValueType*>::template iterator, bool> inserted = valuesMap.insert(pair<int, ValueType*>(key, valueType));
-		if (inserted.second)
-			return;
+	Item* GetItem(LookupKey key) {
+		Item* item = GetItemOrNullptr(key);
+		if (item == nullptr)
+			throw "Key not found";
 
-		delete inserted.first->second;
-		inserted.first->second = valueType;
+		return item;
 	}
 
-	template<typename TValueType>
-	TValueType* GetValueType(TKey key) {
-		map<TKey, ValueType*>::template iterator value = valuesMap.find(key);
-		if (value == valuesMap.end())
+	Item* GetItemForUpdate(LookupKey key) {
+		Item* item = valuesIndex.FindForUpdate(key);
+		if (item == nullptr)
 			throw "Key not found";
 
-		TValueType* valueType = dynamic_cast<TValueType*>(value->second);
-		if (valueType == nullptr)
+		return item;
+	}
+
+	Item* GetItemOrNullptr(LookupKey key) {
+		COMPLEXMAP_STATS_TIME(Lookup);
+		Item* item = valuesIndex.Find(key);
+		CountLookup(item);
+		return item;
+	}
+
+	void CountLookup(Item* item) {
+		if (item != nullptr)
+			COMPLEXMAP_STATS_ADD(Hits, 1);
+		else
+			COMPLEXMAP_STATS_ADD(Misses, 1);
+	}
+
+	template <typename TKeyArg, typename TCreateItem>
+	Item* GetOrAddItem(TKeyArg&& key, TCreateItem createItem) {
+		COMPLEXMAP_STATS_TIME(Insert);
+		pair<Item*, bool> inserted = valuesIndex.TryEmplace(forward<TKeyArg>(key), CountingCreateItem(createItem));
+		CountLookup(inserted.second ? nullptr : inserted.first);
+		return inserted.first;
+	}
+
+	template <typename TResult>
+	TResult* CountTypeMismatch(TResult* result) {
+		if (result == nullptr)
+			COMPLEXMAP_STATS_ADD(TypeMismatches, 1);
+		return result;
+	}
+
+	TValue GetItemValue(Item& item) {
+		TValue* value = CountTypeMismatch(storage.GetValue(item));
+		if (value == nullptr)
 			throw "Invalid value type";
 
-		return valueType;
+		return *value;
 	}
 
-	template<typename TValueType>
-	TValueType* GetValueTypeOrNullptr(TKey key) {
-		map<TKey, ValueType*>::template iterator value = valuesMap.find(key);
-		if (value == valuesMap.end())
-			return nullptr;
+	const TValue* GetItemArray(Item& item, int* size) {
+		TValue* values;
+		if (!storage.GetArray(item, &values, size)) {
+			COMPLEXMAP_STATS_ADD(TypeMismatches, 1);
+			throw "Invalid value type";
+		}
 
-		TValueType* valueType = dynamic_cast<TValueType*>(value->second);
-		if (valueType == nullptr)
-			return nullptr;
+		return values;
+	}
 
-		return valueType;
+	const char* GetItemString(Item& item) {
+		char* line = CountTypeMismatch(storage.GetString(item));
+		if (line == nullptr)
+			throw "Invalid value type";
+
+		return line;
 	}
 
-	template<typename TValueType>
-	TValueType* GetOrAddValueType(TKey key, TValueType* valueType) {
-		pair<map<int, ValueType*>::template iterator, bool> inserted = valuesMap.insert(pair<int, ValueType*>(key, valueType));
-		if (inserted.second)
-			return valueType;
+	bool TryGetItemArray(Item* item, const TValue** values, int* size) {
+		if (item == nullptr)
+			return false;
+
+		TValue* arrayValues;
+		if (!storage.GetArray(*item, &arrayValues, size)) {
+			COMPLEXMAP_STATS_ADD(TypeMismatches, 1);
+			return false;
+		}
+
+		*values = arrayValues;
+		return true;
+	}
+
+	bool TryGetItemString(Item* item, const char** line) {
+		if (item == nullptr)
+			return false;
 
-		delete valueType;
-		valueType = dynamic_cast<TValueType*>(inserted.first->second);
-		if (valueType == nullptr)
+		char* stringValue = CountTypeMismatch(storage.GetString(*item));
+		if (stringValue == nullptr)
+			return false;
+
+		*line = stringValue;
+		return true;
+	}
+
+	vector<TValue>& GetItemGrowableArray(Item& item) {
+		vector<TValue>* values = CountTypeMismatch(storage.GetGrowableArray(item));
+		if (values == nullptr)
 			throw "Invalid value type";
 
-		return valueType;
+		return *values;
+	}
+
+	string& GetItemGrowableString(Item& item) {
+		string* line = CountTypeMismatch(storage.GetGrowableString(item));
+		if (line == nullptr)
+			throw "Invalid value type";
+
+		return *line;
+	}
+
+	void AppendToItemArray(Item& item, const TValue* values, int count) {
+		// Appending part of the array to itself copies the source first, growing would free it
+		TValue* currentValues;
+		int currentSize;
+		if (storage.GetArray(item, &currentValues, &currentSize) && count > 0 &&
+			!less<const TValue*>()(values, currentValues) && less<const TValue*>()(values, currentValues + currentSize)) {
+			vector<TValue> copy(values, values + count);
+			AppendToItemArray(item, copy.data(), count);
+			return;
+		}
+
+		// Refused before growing, so the entry keeps its old contents
+		vector<TValue>& arrayValues = GetItemGrowableArray(item);
+		if ((size_t)count > (size_t)INT_MAX - arrayValues.size())
+			throw "Payload is too large";
+		arrayValues.insert(arrayValues.end(), values, values + count);
+		storage.UpdateArray(item);
+	}
+
+	void AppendToItemString(Item& item, const char* text, int length) {
+		char* currentLine = storage.GetString(item);
+		if (currentLine != nullptr && length > 0 && !less<const char*>()(text, currentLine) && less<const char*>()(text, currentLine + strlen(currentLine))) {
+			string copy(text, length);
+			AppendToItemString(item, copy.c_str(), length);
+			return;
+		}
+
+		string& line = GetItemGrowableString(item);
+		if ((size_t)length > (size_t)INT_MAX - line.size())
+			throw "Payload is too large";
+		line.append(text, length);
+		storage.UpdateString(item);
+	}
+
+	int ReadItemArray(Item& item, int begin, TValue* buffer, int count) {
+		const CompressedArray<TValue>* compressed = storage.GetCompressedArray(item);
+		int size;
+		const TValue* values = nullptr;
+		if (compressed != nullptr)
+			size = compressed->GetSize();
+		else
+			values = GetItemArray(item, &size);
+		if (begin < 0 || begin > size || count < 0)
+			throw "Index out of range";
+
+		int readCount = size - begin < count ? size - begin : count;
+		if (compressed != nullptr)
+			compressed->Decode(begin, readCount, buffer);
+		else
+			copy(values + begin, values + begin + readCount, buffer);
+		return readCount;
+	}
+
+	Item CreateRecordItem(const BulkRecord<TKey, TValue>& record) {
+		switch (record.Kind) {
+		case ValueKind::Array:
+			return storage.CreateArray(record.Values, record.Size);
+		case ValueKind::String:
+			return storage.CreateString(record.Line);
+		default:
+			return storage.CreateValue(record.Value);
+		}
+	}
+
+	static const size_t BatchGroupSize = 16;
+
+	// Resolves keys a group at a time: prefetch every index slot, then find every item and prefetch its node,
+	// then read the results, so the cache misses of a group overlap instead of running one after another.
+	// Only indexes that measured faster that way take it, and only for batches of at least a group,
+	// everything else is the single-key lookup in a loop
+	template <typename TResolve>
+	int ResolveBatch(const TKey* keys, size_t count, TResolve resolve) {
+		int foundCount = 0;
+		if (!Index::PrefetchesBatches || count < BatchGroupSize) {
+			for (size_t i = 0; i < count; i++)
+				if (resolve(i, GetItemOrNullptr(keys[i])))
+					foundCount++;
+			return foundCount;
+		}
+
+		Item* items[BatchGroupSize];
+		for (size_t group = 0; group < count; group += BatchGroupSize) {
+			size_t groupSize = count - group < BatchGroupSize ? count - group : BatchGroupSize;
+			for (size_t i = 0; i < groupSize; i++)
+				valuesIndex.Prefetch(keys[group + i]);
+			for (size_t i = 0; i < groupSize; i++) {
+				items[i] = valuesIndex.Find(keys[group + i]);
+				CountLookup(items[i]);
+				if (items[i] != nullptr)
+					storage.Prefetch(*items[i]);
+			}
+			for (size_t i = 0; i < groupSize; i++)
+				if (resolve(group + i, items[i]))
+					foundCount++;
+		}
+		return foundCount;
 	}
 
 public:
+	// Walks an ordered index in key order. Removing the current key invalidates the cursor, resume with GetCursorAfter(lastKey)
+	template <typename TIndexCursor>
+	class CursorType {
+		ComplexMap* complexMap;
+		TIndexCursor cursor;
+
+	public:
+		CursorType(ComplexMap* complexMap, TIndexCursor cursor)
+			: complexMap{ complexMap }, cursor{ cursor } {
+		}
+
+		bool IsValid() {
+			return cursor.IsValid();
+		}
+
+		void MoveNext() {
+			cursor.MoveNext();
+		}
+
+		const TKey& GetKey() {
+			return cursor.GetKey();
+		}
+
+		ValueKind GetKind() {
+			return complexMap->storage.GetKind(cursor.GetItem());
+		}
+
+		TValue GetValue() {
+			return complexMap->GetItemValue(cursor.GetItem());
+		}
+		const TValue* GetArray(int* size) {
+			return complexMap->GetItemArray(cursor.GetItem(), size);
+		}
+		const char* GetString() {
+			return complexMap->GetItemString(cursor.GetItem());
+		}
+	};
+
+	// A read-only fork of the map. The arrays and strings it returns stay in place for as long as it lives,
+	// and it can be read on other threads while the map goes on changing
+	class View {
+		friend class ComplexMap;
+
+		unique_ptr<ComplexMap> complexMap;
+
+		View(unique_ptr<ComplexMap> complexMap)
+			: complexMap(move(complexMap)) {
+		}
+
+	public:
+		int GetSize() {
+			return complexMap->GetSize();
+		}
+
+		TValue GetValue(LookupKey key) {
+			return complexMap->GetValue(key);
+		}
+		const TValue* GetArray(LookupKey key, int* size) {
+			return complexMap->GetArray(key, size);
+		}
+		const char* GetString(LookupKey key) {
+			return complexMap->GetString(key);
+		}
+
+		bool TryGetValue(LookupKey key, TValue* value) {
+			return complexMap->TryGetValue(key, value);
+		}
+		bool TryGetArray(LookupKey key, const TValue** values, int* size) {
+			return complexMap->TryGetArray(key, values, size);
+		}
+		bool TryGetString(LookupKey key, const char** line) {
+			return complexMap->TryGetString(key, line);
+		}
+
+		template <typename TAction>
+		void ForEachValue(TAction action) {
+			complexMap->ForEachValue(action);
+		}
+		template <typename TAction>
+		void ForEachArray(TAction action) {
+			complexMap->ForEachArray(action);
+		}
+		template <typename TAction>
+		void ForEachString(TAction action) {
+			complexMap->ForEachString(action);
+		}
+	};
+
+	ComplexMap() {
+	}
+
+	// Copies would free the same entries twice, Fork shares them instead
+	ComplexMap(const ComplexMap&) = delete;
+	ComplexMap& operator=(const ComplexMap&) = delete;
+
 	~ComplexMap() {
 		RemoveAll();
+		Reclaim();
+	}
+
+	// Constant time: the fork shares the index chunks and entries, and either map copies a chunk or an entry the
+	// first time it changes one the other still holds. Needs ChunkedIndex and SharedStorage
+	ComplexMap Fork() {
+		static_assert(Storage::SharesItems, "Fork needs SharedStorage");
+		return ComplexMap(valuesIndex.Fork());
+	}
+
+	View Snapshot() {
+		static_assert(Storage::SharesItems, "Snapshot needs SharedStorage");
+		return View(unique_ptr<ComplexMap>(new ComplexMap(valuesIndex.Fork())));
 	}
 
 	int GetSize() {
-		return valuesMap.size();
+		return valuesIndex.GetSize();
+	}
+
+	template <typename TKeyArg>
+	void AddValue(TKeyArg&& key, TValue value) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateValue(value); });
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, TValue* values, int size) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(values, size); });
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, vector<TValue>&& values) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(move(values)); });
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, unique_ptr<TValue[]> values, int size) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(move(values), size); });
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, const char* line) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(line); });
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, const char* line, int length) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(line, length); });
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, string&& line) {
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(move(line)); });
+	}
+
+	template <typename TKeyArg>
+	bool TryAddValue(TKeyArg&& key, TValue value) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateValue(value); });
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, TValue* values, int size) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(values, size); });
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, vector<TValue>&& values) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(move(values)); });
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, unique_ptr<TValue[]> values, int size) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(move(values), size); });
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, const char* line) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(line); });
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, const char* line, int length) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(line, length); });
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, string&& line) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(move(line)); });
 	}
 
-	void AddValue(TKey key, TValue value) {
-		AddValueType(key, new SingleValueType(value));
+	template <typename TKeyArg, typename TProducer>
+	bool TryAddValueWith(TKeyArg&& key, TProducer producer) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateValue(producer()); });
 	}
-	void AddArray(TKey key, TValue* values, int size) {
-		AddValueType(key, new ArrayValueType(values, size));
+	template <typename TKeyArg, typename TProducer>
+	bool TryAddArrayWith(TKeyArg&& key, TProducer producer) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(producer()); });
 	}
-	void AddString(TKey key, const char* line) {
-		AddValueType(key, new StringValueType(line));
+	template <typename TKeyArg, typename TProducer>
+	bool TryAddStringWith(TKeyArg&& key, TProducer producer) {
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(producer()); });
 	}
 
-	bool TryAddValue(TKey key, TValue value) {
-		return TryAddValueType(key, new SingleValueType(value));
+	// Integral arrays kept as delta-encoded bit-packed blocks, needs HeapStorage. Arrays that would not shrink are kept
+	// plain. Reads leave an array compressed, only appending or resizing turns it plain. GetArray on a compressed array
+	// returns a decoded copy that stays valid until the thread decodes a few other arrays; GetArrayElement and ReadArray
+	// decode only the blocks they need
+	template <typename TKeyArg>
+	void AddCompressedArray(TKeyArg&& key, const TValue* values, int size) {
+		static_assert(Storage::CompressesArrays, "Compressed arrays need HeapStorage");
+		AddItem(forward<TKeyArg>(key), [&]() { return storage.CreateCompressedArray(values, size); });
 	}
-	bool TryAddArray(TKey key, TValue* values, int size) {
-		return TryAddValueType(key, new ArrayValueType(values, size));
+	template <typename TKeyArg>
+	bool TryAddCompressedArray(TKeyArg&& key, const TValue* values, int size) {
+		static_assert(Storage::CompressesArrays, "Compressed arrays need HeapStorage");
+		return TryAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateCompressedArray(values, size); });
 	}
-	bool TryAddString(TKey key, const char* line) {
-		return TryAddValueType(key, new StringValueType(line));
+	template <typename TKeyArg>
+	void AddCompressedArrayOrReplace(TKeyArg&& key, const TValue* values, int size) {
+		static_assert(Storage::CompressesArrays, "Compressed arrays need HeapStorage");
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateCompressedArray(values, size));
 	}
 
-	void AddValueOrReplace(TKey key, TValue value) {
-		AddValueTypeOrReplace(key, new SingleValueType(value));
+	template <typename TKeyArg>
+	void AddValueOrReplace(TKeyArg&& key, TValue value) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateValue(value));
+	}
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, TValue* values, int size) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateArray(values, size));
+	}
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, vector<TValue>&& values) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateArray(move(values)));
 	}
-	void AddArrayOrReplace(TKey key, TValue* values, int size) {
-		AddValueTypeOrReplace(key, new ArrayValueType(values, size));
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, unique_ptr<TValue[]> values, int size) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateArray(move(values), size));
 	}
-	void AddStringOrReplace(TKey key, const char* line) {
-		AddValueTypeOrReplace(key, new StringValueType(line));
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, const char* line) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateString(line));
+	}
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, const char* line, int length) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateString(line, length));
+	}
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, string&& line) {
+		AddItemOrReplace(forward<TKeyArg>(key), storage.CreateString(move(line)));
+	}
+
+	TValue GetValue(LookupKey key) {
+		return GetItemValue(*GetItem(key));
+	}
+	// The pointers are read-only, a fork or snapshot may share the entry. Change entries through the Add, Append and
+	// Resize methods. A pointer stays valid until its entry is changed, replaced or removed, except the decoded copy of
+	// a compressed array, see AddCompressedArray
+	const TValue* GetArray(LookupKey key, int* size) {
+		return GetItemArray(*GetItem(key), size);
+	}
+	const char* GetString(LookupKey key) {
+		return GetItemString(*GetItem(key));
 	}
 
-	TValue GetValue(TKey key) {
-		SingleValueType* singleValue = GetValueType<SingleValueType>(key);
-		return singleValue->Value;
+	// Both work on plain and compressed arrays and throw "Index out of range" for a start outside the array
+	TValue GetArrayElement(LookupKey key, int index) {
+		TValue value;
+		if (ReadItemArray(*GetItem(key), index, &value, 1) != 1)
+			throw "Index out of range";
+
+		return value;
+	}
+	// Copies up to count elements from begin into buffer and returns how many there were
+	int ReadArray(LookupKey key, int begin, TValue* buffer, int count) {
+		return ReadItemArray(*GetItem(key), begin, buffer, count);
 	}
-	TValue* GetArray(TKey key, int* size) {
-		ArrayValueType* arrayValue = GetValueType<ArrayValueType>(key);
-		*size = arrayValue->Size;
-		return arrayValue->Values;
+
+	// Interned entries compare by pointer, the others by contents. Both throw like GetString and GetArray
+	bool AreStringsEqual(LookupKey first, LookupKey second) {
+		Item& firstItem = *GetItem(first);
+		Item& secondItem = *GetItem(second);
+		const char* firstLine = GetItemString(firstItem);
+		const char* secondLine = GetItemString(secondItem);
+		if (storage.IsInterned(firstItem) && storage.IsInterned(secondItem))
+			return firstLine == secondLine;
+
+		return strcmp(firstLine, secondLine) == 0;
 	}
-	char* GetString(TKey key) {
-		StringValueType* stringValue = GetValueType<StringValueType>(key);
-		return stringValue->Line;
+	bool AreArraysEqual(LookupKey first, LookupKey second) {
+		Item& firstItem = *GetItem(first);
+		Item& secondItem = *GetItem(second);
+		int firstSize;
+		int secondSize;
+		const TValue* firstValues = GetItemArray(firstItem, &firstSize);
+		const TValue* secondValues = GetItemArray(secondItem, &secondSize);
+		if (storage.IsInterned(firstItem) && storage.IsInterned(secondItem))
+			return firstValues == secondValues;
+
+		return firstSize == secondSize && equal(firstValues, firstValues + firstSize, secondValues);
 	}
 
-	bool TryGetValue(TKey key, TValue* value) {
-		SingleValueType* singleValue = GetValueTypeOrNullptr<SingleValueType>(key);
+	bool TryGetValue(LookupKey key, TValue* value) {
+		Item* item = GetItemOrNullptr(key);
+		if (item == nullptr)
+			return false;
+
+		TValue* singleValue = CountTypeMismatch(storage.GetValue(*item));
 		if (singleValue == nullptr)
 			return false;
 
-		*value = singleValue->Value;
+		*value = *singleValue;
 		return true;
 	}
-	bool TryGetArray(TKey key, TValue** values, int* size) {
-		ArrayValueType* arrayValue = GetValueTypeOrNullptr<ArrayValueType>(key);
-		if (arrayValue == nullptr)
-			return false;
+	bool TryGetArray(LookupKey key, const TValue** values, int* size) {
+		return TryGetItemArray(GetItemOrNullptr(key), values, size);
+	}
+	bool TryGetString(LookupKey key, const char** line) {
+		return TryGetItemString(GetItemOrNullptr(key), line);
+	}
 
-		*values = arrayValue->Values;
-		*size = arrayValue->Size;
-		return true;
+	// Batch lookups fill found[i] for every key and return how many were found with the requested type
+	int TryGetValues(const TKey* keys, TValue* values, bool* found, size_t count) {
+		return ResolveBatch(keys, count, [&](size_t i, Item* item) {
+			TValue* singleValue = item == nullptr ? nullptr : storage.GetValue(*item);
+			found[i] = singleValue != nullptr;
+			if (found[i])
+				values[i] = *singleValue;
+			return found[i];
+		});
+	}
+	int TryGetArrays(const TKey* keys, const TValue** values, int* sizes, bool* found, size_t count) {
+		return ResolveBatch(keys, count, [&](size_t i, Item* item) {
+			TValue* arrayValues;
+			found[i] = item != nullptr && storage.GetArray(*item, &arrayValues, &sizes[i]);
+			if (found[i])
+				values[i] = arrayValues;
+			return found[i];
+		});
+	}
+	int TryGetStrings(const TKey* keys, const char** lines, bool* found, size_t count) {
+		return ResolveBatch(keys, count, [&](size_t i, Item* item) {
+			char* stringValue = item == nullptr ? nullptr : storage.GetString(*item);
+			found[i] = stringValue != nullptr;
+			if (found[i])
+				lines[i] = stringValue;
+			return found[i];
+		});
 	}
-	bool TryGetString(TKey key, char** line) {
-		StringValueType* stringValue = GetValueTypeOrNullptr<StringValueType>(key);
-		if (stringValue == nullptr)
-			return false;
 
-		*line = stringValue->Line;
-		return true;
+	// Same as AddValue in a loop: throws on the first duplicate, keys before it stay added
+	void AddValues(const TKey* keys, const TValue* values, size_t count) {
+		for (size_t group = 0; group < count; group += BatchGroupSize) {
+			size_t groupSize = count - group < BatchGroupSize ? count - group : BatchGroupSize;
+			for (size_t i = 0; i < groupSize; i++)
+				valuesIndex.Prefetch(keys[group + i]);
+			for (size_t i = 0; i < groupSize; i++)
+				AddValue(keys[group + i], values[group + i]);
+		}
+	}
+
+	// Unsorted records are sorted on worker threads first, sorted ones are detected and go straight in. Payloads are
+	// copied on workers when the allocator is thread-safe, then the keys enter the index in ascending order.
+	// Unlike Add, Throw checks every key before anything is added. Returns the number of keys added
+	int BulkLoad(const BulkRecord<TKey, TValue>* records, size_t count, DuplicatePolicy policy = DuplicatePolicy::Throw) {
+		auto keyLess = [records](size_t first, size_t second) { return records[first].Key < records[second].Key; };
+		vector<size_t> order(count);
+		for (size_t i = 0; i < count; i++)
+			order[i] = i;
+		if (!is_sorted(order.begin(), order.end(), keyLess))
+			ParallelStableSort(order, keyLess);
+
+		// The sort is stable, so the first record of a run is the first one given
+		vector<size_t> selected;
+		selected.reserve(count);
+		for (size_t i = 0; i < count; i++) {
+			if (i == 0 || keyLess(order[i - 1], order[i]))
+				selected.push_back(order[i]);
+			else if (policy == DuplicatePolicy::Throw)
+				throw "Key already exists";
+			else if (policy == DuplicatePolicy::Replace)
+				selected.back() = order[i];
+			else
+				COMPLEXMAP_STATS_ADD(DuplicateKeys, 1);
+		}
+
+		if (policy != DuplicatePolicy::Replace) {
+			size_t keptCount = 0;
+			for (size_t i = 0; i < selected.size(); i++) {
+				if (valuesIndex.Find(records[selected[i]].Key) == nullptr)
+					selected[keptCount++] = selected[i];
+				else if (policy == DuplicatePolicy::Throw)
+					throw "Key already exists";
+				else
+					COMPLEXMAP_STATS_ADD(DuplicateKeys, 1);
+			}
+			selected.resize(keptCount);
+		}
+
+		vector<Item> items(selected.size());
+		vector<char> isCreated(selected.size());
+		size_t insertedCount = 0;
+		try {
+			size_t workerCount = IsThreadSafeAllocator<TAllocator>::value ? GetWorkerCount(selected.size()) : 1;
+			ParallelFor(selected.size(), workerCount, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					items[i] = CreateRecordItem(records[selected[i]]);
+					isCreated[i] = true;
+				}
+			});
+
+			int addedCount = 0;
+			valuesIndex.InsertSorted(selected.size(),
+				[&](size_t i) -> const TKey& {
+					return records[selected[i]].Key;
+				},
+				[&](size_t i) {
+					insertedCount = i + 1;
+					addedCount++;
+#ifdef COMPLEXMAP_STATS
+					CountAllocation(items[i]);
+#endif
+					return items[i];
+				},
+				[&](size_t i, Item& item) {
+					insertedCount = i + 1;
+					COMPLEXMAP_STATS_ADD(Replaces, 1);
+					RetireItem(item);
+					item = items[i];
+				});
+			return addedCount;
+		}
+		catch (...) {
+			for (size_t i = insertedCount; i < items.size(); i++)
+				if (isCreated[i])
+					storage.Destroy(items[i]);
+			throw;
+		}
 	}
 
-	TValue GetOrAddValue(TKey key, TValue value) {
-		SingleValueType* singleValue = GetOrAddValueType(key, new SingleValueType(value));
-		return singleValue->Value;
+	template <typename TKeyArg>
+	TValue GetOrAddValue(TKeyArg&& key, TValue value) {
+		return GetItemValue(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateValue(value); }));
 	}
-	TValue* GetOrAddArray(TKey key, int* resultSize, TValue* values, int size) {
-		ArrayValueType* arrayValue = GetOrAddValueType<ArrayValueType>(key, new ArrayValueType(values, size));
-		*resultSize = arrayValue->Size;
-		return arrayValue->Values;
+	template <typename TKeyArg>
+	const TValue* GetOrAddArray(TKeyArg&& key, int* resultSize, TValue* values, int size) {
+		return GetItemArray(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(values, size); }), resultSize);
 	}
-	char* GetOrAddString(TKey key, const char* line) {
-		StringValueType* stringValue = GetOrAddValueType<StringValueType>(key, new StringValueType(line));
-		return stringValue->Line;
+	template <typename TKeyArg>
+	const char* GetOrAddString(TKeyArg&& key, const char* line) {
+		return GetItemString(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(line); }));
 	}
 
-	void Remove(TKey key) {
-		map<TKey, ValueType*>::template iterator value = valuesMap.find(key);
-		if (value == valuesMap.end())
-			throw "Key not found";
+	template <typename TKeyArg, typename TProducer>
+	TValue GetOrAddValueWith(TKeyArg&& key, TProducer producer) {
+		return GetItemValue(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateValue(producer()); }));
+	}
+	template <typename TKeyArg, typename TProducer>
+	const TValue* GetOrAddArrayWith(TKeyArg&& key, int* resultSize, TProducer producer) {
+		return GetItemArray(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(producer()); }), resultSize);
+	}
+	template <typename TKeyArg, typename TProducer>
+	const char* GetOrAddStringWith(TKeyArg&& key, TProducer producer) {
+		return GetItemString(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(producer()); }));
+	}
 
-		valuesMap.erase(value);
+	// Appending to a missing key adds an empty array or string first, like GetOrAdd; appending to another kind throws.
+	// The first append moves the payload into a growable buffer that doubles as needed, ShrinkToFit compacts it again
+	template <typename TKeyArg>
+	void AppendToArray(TKeyArg&& key, const TValue* values, int count) {
+		AppendToItemArray(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateArray(vector<TValue>()); }), values, count);
 	}
-	bool TryRemove(TKey key) {
-		map<TKey, ValueType*>::template iterator value = valuesMap.find(key);
-		if (value == valuesMap.end())
+	template <typename TKeyArg>
+	void AppendToString(TKeyArg&& key, const char* text) {
+		AppendToString(forward<TKeyArg>(key), text, strlen(text));
+	}
+	template <typename TKeyArg>
+	void AppendToString(TKeyArg&& key, const char* text, int length) {
+		AppendToItemString(*GetOrAddItem(forward<TKeyArg>(key), [&]() { return storage.CreateString(string()); }), text, length);
+	}
+
+	// Reserving and resizing work on existing arrays only, like Get. New elements of a resized array are value-initialized
+	void ReserveArray(LookupKey key, int capacity) {
+		if (capacity < 0)
+			throw "Index out of range";
+
+		Item& item = *GetItemForUpdate(key);
+		GetItemGrowableArray(item).reserve(capacity);
+		storage.UpdateArray(item);
+	}
+	void ResizeArray(LookupKey key, int size) {
+		if (size < 0)
+			throw "Index out of range";
+
+		Item& item = *GetItemForUpdate(key);
+		GetItemGrowableArray(item).resize(size);
+		storage.UpdateArray(item);
+	}
+
+	void ShrinkToFit(LookupKey key) {
+		if (!storage.ShrinkToFit(*GetItemForUpdate(key)))
+			throw "Invalid value type";
+	}
+
+	template <typename TAction>
+	void ForEachValue(TAction action) {
+		valuesIndex.ForEach(
+			[&](const TKey& key, Item& item) {
+				if (storage.GetKind(item) == ValueKind::Value)
+					action(key, *storage.GetValue(item));
+			});
+	}
+	template <typename TAction>
+	void ForEachArray(TAction action) {
+		valuesIndex.ForEach(
+			[&](const TKey& key, Item& item) {
+				int size;
+				TValue* values;
+				if (storage.GetArray(item, &values, &size))
+					action(key, (const TValue*)values, size);
+			});
+	}
+	template <typename TAction>
+	void ForEachString(TAction action) {
+		valuesIndex.ForEach(
+			[&](const TKey& key, Item& item) {
+				if (storage.GetKind(item) == ValueKind::String)
+					action(key, (const char*)storage.GetString(item));
+			});
+	}
+
+	// Cursors and ranges need an ordered index
+	auto GetCursor() {
+		static_assert(Index::IsOrdered, "Cursors need an ordered index");
+		return CursorType<typename Index::Cursor>(this, valuesIndex.GetCursor());
+	}
+	auto GetCursor(LookupKey from) {
+		static_assert(Index::IsOrdered, "Cursors need an ordered index");
+		return CursorType<typename Index::Cursor>(this, valuesIndex.GetCursor(from));
+	}
+	auto GetCursorAfter(LookupKey key) {
+		static_assert(Index::IsOrdered, "Cursors need an ordered index");
+		return CursorType<typename Index::Cursor>(this, valuesIndex.GetCursorAfter(key));
+	}
+
+	auto GetReverseCursor() {
+		static_assert(Index::IsOrdered, "Cursors need an ordered index");
+		return CursorType<typename Index::ReverseCursor>(this, valuesIndex.GetReverseCursor());
+	}
+	auto GetReverseCursor(LookupKey from) {
+		static_assert(Index::IsOrdered, "Cursors need an ordered index");
+		return CursorType<typename Index::ReverseCursor>(this, valuesIndex.GetReverseCursor(from));
+	}
+	auto GetReverseCursorBefore(LookupKey key) {
+		static_assert(Index::IsOrdered, "Cursors need an ordered index");
+		return CursorType<typename Index::ReverseCursor>(this, valuesIndex.GetReverseCursorBefore(key));
+	}
+
+	// Calls action(cursor) for every key in [from, to)
+	template <typename TAction>
+	void ForEachInRange(LookupKey from, LookupKey to, TAction action) {
+		for (auto cursor = GetCursor(from); cursor.IsValid() && cursor.GetKey() < to; cursor.MoveNext())
+			action(cursor);
+	}
+
+	void Remove(LookupKey key) {
+		if (!TryRemove(key))
+			throw "Key not found";
+	}
+	bool TryRemove(LookupKey key) {
+		COMPLEXMAP_STATS_TIME(Remove);
+		Item item;
+		if (!valuesIndex.Erase(key, &item))
 			return false;
 
-		valuesMap.erase(value);
+		COMPLEXMAP_STATS_ADD(Removes, 1);
+		RetireItem(item);
 		return true;
 	}
-	void RemoveAll() {
-		for_each(valuesMap.begin(), valuesMap.end(),
-			[](pair<TKey, ValueType*> value) {
-				delete value.second;
+
+	// Background needs an allocator that can free on another thread. Whatever is still retired is freed first
+	void SetReclaimMode(ReclaimMode mode) {
+		if (mode == ReclaimMode::Background && !IsThreadSafeAllocator<TAllocator>::value)
+			throw "Background reclamation needs a thread-safe allocator";
+
+		Reclaim();
+		reclaimThread.reset(mode == ReclaimMode::Background ? new ReclaimThread() : nullptr);
+		reclaimMode = mode;
+	}
+
+	ReclaimMode GetReclaimMode() {
+		return reclaimMode;
+	}
+
+	// Entries and indexes waiting on this thread; those already handed to the reclaim thread are not counted
+	size_t GetRetiredCount() {
+		size_t count = retiredItems.size();
+		for (size_t i = 0; i < retiredIndexes.size(); i++)
+			count += retiredIndexes[i].GetSize();
+		return count;
+	}
+
+	// Frees everything retired so far, including indexes left by RemoveAll; with Background, waits for the reclaim thread
+	void Reclaim() {
+		if (reclaimThread != nullptr) {
+			if (!retiredItems.empty())
+				PostRetiredItems();
+			reclaimThread->Wait();
+		}
+		DestroyRetiredItems();
+		for (size_t i = 0; i < retiredIndexes.size(); i++)
+			DestroyIndexItems(retiredIndexes[i]);
+		retiredIndexes.clear();
+	}
+
+	// Sizes as the map sees them, without allocator rounding or heap bookkeeping. Walks every entry
+	MemoryUsage GetMemoryUsage() {
+		MemoryUsage usage = {};
+		valuesIndex.AddMemoryUsage(usage);
+		valuesIndex.ForEach(
+			[&](const TKey& key, Item& item) {
+				storage.AddMemoryUsage(item, usage);
 			});
-		valuesMap.clear();
+		storage.AddPoolMemoryUsage(usage);
+		return usage;
 	}
-};
 
-template <typename TKey, typename TValue>
-ComplexMap<TKey, TValue>::ValueType::~ValueType() {}
+	// Plain over compressed size of the compressed arrays, 1 when there are none. Walks every entry
+	double GetCompressionRatio() {
+		size_t rawBytes = 0;
+		size_t compressedBytes = 0;
+		valuesIndex.ForEach(
+			[&](const TKey& key, Item& item) {
+				const CompressedArray<TValue>* compressed = storage.GetCompressedArray(item);
+				if (compressed != nullptr) {
+					rawBytes += compressed->GetRawBytes();
+					compressedBytes += compressed->GetCompressedBytes();
+				}
+			});
+		return compressedBytes == 0 ? 1 : (double)rawBytes / compressedBytes;
+	}
+
+	// Strings, and with StringsAndArrays arrays, copied in from now on share one pooled buffer with every equal
+	// payload, needs HeapStorage. GetString and GetArray then return the pooled buffer, which must not be written
+	// through; appending gives the entry its own copy first. Entries added before keep their own payloads
+	void SetInterning(InterningMode mode) {
+		static_assert(Storage::InternsPayloads, "Interning needs HeapStorage");
+		storage.SetInterning(mode);
+	}
+
+	// Sizes the index for count keys up front, so a bulk load does not rehash on the way
+	void Reserve(int count) {
+		valuesIndex.Reserve(count);
+	}
+
+	// Gives back index slots left by removals and compacts arrays and strings that were grown in place
+	void ShrinkToFit() {
+		valuesIndex.ForEachForUpdate(
+			[this](const TKey& key, Item& item) {
+				storage.ShrinkToFit(item);
+			});
+		valuesIndex.ShrinkToFit();
+	}
+
+	// Counters compile in with COMPLEXMAP_STATS, without it the stats are always zero
+	ComplexMapStats GetStats() {
+#ifdef COMPLEXMAP_STATS
+		return stats.Read();
+#else
+		return ComplexMapStats();
+#endif
+	}
+	void ResetStats() {
+#ifdef COMPLEXMAP_STATS
+		stats.Reset();
+#endif
+	}
+	// Snapshots need trivially copyable keys and values. The snapshot is written to path.tmp and renamed over path once
+	// it is complete and synced, a failed save leaves the previous snapshot in place
+	void SaveSnapshot(const char* path) {
+		// Keys are copied, an index may hand ForEach a key that lives only for the call
+		vector<pair<TKey, Item*>> items;
+		items.reserve(GetSize());
+		valuesIndex.ForEach(
+			[&](const TKey& key, Item& item) {
+				items.push_back(pair<TKey, Item*>(key, &item));
+			});
+		sort(items.begin(), items.end(), [](const pair<TKey, Item*>& first, const pair<TKey, Item*>& second) { return first.first < second.first; });
+
+		SnapshotWriter<TKey, TValue> writer(path, items.size());
+		for (size_t i = 0; i < items.size(); i++) {
+			int size;
+			TValue* values;
+			TValue* value = storage.GetValue(*items[i].second);
+			if (value != nullptr)
+				writer.AddValue(items[i].first, *value);
+			else if (storage.GetArray(*items[i].second, &values, &size))
+				writer.AddArray(items[i].first, values, size);
+			else
+				writer.AddString(items[i].first, storage.GetString(*items[i].second), storage.GetStringLength(*items[i].second));
+		}
+		writer.Finish();
+	}
+
+	// Replaces the contents of the map, use MappedComplexMap to read a snapshot without copying. The whole snapshot is
+	// validated first, a corrupted one throws and leaves the map as it was
+	void LoadSnapshot(const char* path) {
+		MappedComplexMap<TKey, TValue> snapshot(path);
+		snapshot.Validate();
+		RemoveAll();
+		snapshot.ForEachValue([this](const TKey& key, TValue value) { AddValue(key, value); });
+		snapshot.ForEachArray([this](const TKey& key, const TValue* values, int size) { AddItem(key, [&]() { return storage.CreateArray(values, size); }); });
+		snapshot.ForEachStringWithLength([this](const TKey& key, const char* line, int length) { AddString(key, line, length); });
+	}
+
+	// Unless the mode is Immediate, the index is swapped for an empty one in constant time and its entries are freed
+	// by Reclaim or the reclaim thread. Storage that releases everything at once still does so here
+	void RemoveAll() {
+		if (reclaimMode == ReclaimMode::Immediate || storage.ReleasesAll()) {
+			Reclaim();
+			if (!storage.ReleasesAll())
+				DestroyIndexItems(valuesIndex);
+			valuesIndex.Clear();
+			storage.Release();
+			return;
+		}
+
+		if (reclaimMode == ReclaimMode::Background) {
+			shared_ptr<Index> removedIndex = make_shared<Index>(move(valuesIndex));
+			reclaimThread->Post([this, removedIndex]() { DestroyIndexItems(*removedIndex); });
+		}
+		else
+			retiredIndexes.push_back(move(valuesIndex));
+		valuesIndex = Index();
+	}
+};
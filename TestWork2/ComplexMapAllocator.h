@@ -0,0 +1,172 @@
+#pragma once
+
+#include <new>
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+
+using namespace std;
+
+// Bytes a map holds, filled in by its index and storage. Index counts slots or nodes in use, Headers the entry nodes
+// outside the index, the payloads the buffers of arrays and strings that do not fit in a node, and Slack the reserved
+// but unused part of all of them
+struct MemoryUsage {
+	size_t Index;
+	size_t Headers;
+	size_t ArrayPayloads;
+	size_t StringPayloads;
+	size_t Slack;
+
+	size_t GetTotal() const {
+		return Index + Headers + ArrayPayloads + StringPayloads + Slack;
+	}
+};
+
+// Allocators that may be called from several threads at once declare IsThreadSafe; others are used from one thread
+template <typename TAllocator, typename = void>
+struct IsThreadSafeAllocator : false_type {
+};
+
+template <typename TAllocator>
+struct IsThreadSafeAllocator<TAllocator, void_t<decltype(TAllocator::IsThreadSafe)>> : integral_constant<bool, TAllocator::IsThreadSafe> {
+};
+
+class HeapAllocator {
+public:
+	static const bool ReleasesAll = false;
+	static const bool IsThreadSafe = true;
+
+	void* Allocate(size_t size) {
+		return operator new(size);
+	}
+
+	void Free(void* memory, size_t size) {
+		operator delete(memory);
+	}
+
+	void Release() {
+	}
+};
+
+class ArenaAllocator {
+	static const size_t Alignment = 16;
+	static const size_t SmallClassLimit = 256;
+	static const size_t MaxClassSize = 4096;
+	static const int ClassCount = SmallClassLimit / Alignment + 4;
+	static const size_t ChunkSize = 64 * 1024;
+
+	struct FreeBlock {
+		FreeBlock* Next;
+	};
+
+	struct LargeBlock {
+		LargeBlock* Previous;
+		LargeBlock* Next;
+	};
+
+	static const size_t LargeHeaderSize = (sizeof(LargeBlock) + Alignment - 1) / Alignment * Alignment;
+
+	FreeBlock* freeBlocks[ClassCount] = {};
+	LargeBlock* largeBlocks = nullptr;
+	vector<char*> chunks;
+	char* chunkPosition = nullptr;
+	char* chunkEnd = nullptr;
+
+	static int GetClass(size_t size) {
+		if (size <= SmallClassLimit)
+			return size == 0 ? 0 : (int)((size + Alignment - 1) / Alignment) - 1;
+
+		int sizeClass = SmallClassLimit / Alignment;
+		for (size_t classSize = SmallClassLimit * 2; classSize < size; classSize *= 2)
+			sizeClass++;
+		return sizeClass;
+	}
+
+	static size_t GetClassSize(int sizeClass) {
+		if (sizeClass < (int)(SmallClassLimit / Alignment))
+			return (sizeClass + 1) * Alignment;
+
+		return SmallClassLimit << (sizeClass - SmallClassLimit / Alignment + 1);
+	}
+
+	char* AllocateFromChunk(size_t size) {
+		if ((size_t)(chunkEnd - chunkPosition) < size) {
+			chunkPosition = (char*)operator new(ChunkSize);
+			chunkEnd = chunkPosition + ChunkSize;
+			chunks.push_back(chunkPosition);
+		}
+
+		char* memory = chunkPosition;
+		chunkPosition += size;
+		return memory;
+	}
+
+public:
+	static const bool ReleasesAll = true;
+	static const bool IsThreadSafe = false;
+
+	ArenaAllocator() = default;
+	ArenaAllocator(const ArenaAllocator&) = delete;
+	ArenaAllocator& operator=(const ArenaAllocator&) = delete;
+
+	~ArenaAllocator() {
+		Release();
+	}
+
+	void* Allocate(size_t size) {
+		if (size > MaxClassSize) {
+			LargeBlock* block = (LargeBlock*)operator new(LargeHeaderSize + size);
+			block->Previous = nullptr;
+			block->Next = largeBlocks;
+			if (largeBlocks != nullptr)
+				largeBlocks->Previous = block;
+			largeBlocks = block;
+			return (char*)block + LargeHeaderSize;
+		}
+
+		int sizeClass = GetClass(size);
+		FreeBlock* block = freeBlocks[sizeClass];
+		if (block != nullptr) {
+			freeBlocks[sizeClass] = block->Next;
+			return block;
+		}
+
+		return AllocateFromChunk(GetClassSize(sizeClass));
+	}
+
+	void Free(void* memory, size_t size) {
+		if (size > MaxClassSize) {
+			LargeBlock* block = (LargeBlock*)((char*)memory - LargeHeaderSize);
+			if (block->Previous != nullptr)
+				block->Previous->Next = block->Next;
+			else
+				largeBlocks = block->Next;
+			if (block->Next != nullptr)
+				block->Next->Previous = block->Previous;
+			operator delete(block);
+			return;
+		}
+
+		int sizeClass = GetClass(size);
+		FreeBlock* block = (FreeBlock*)memory;
+		block->Next = freeBlocks[sizeClass];
+		freeBlocks[sizeClass] = block;
+	}
+
+	void Release() {
+		while (largeBlocks != nullptr) {
+			LargeBlock* next = largeBlocks->Next;
+			operator delete(largeBlocks);
+			largeBlocks = next;
+		}
+
+		for (size_t i = 0; i < chunks.size(); i++)
+			operator delete(chunks[i]);
+		chunks.clear();
+		chunkPosition = nullptr;
+		chunkEnd = nullptr;
+
+		for (int i = 0; i < ClassCount; i++)
+			freeBlocks[i] = nullptr;
+	}
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <type_traits>
+#include "ComplexMapSimd.h"
+
+using namespace std;
+
+template <typename TValue>
+struct IsCompressible : integral_constant<bool, is_integral<TValue>::value && !is_same<TValue, bool>::value> {
+};
+
+// Deltas are taken in the unsigned type of the same width, so they wrap instead of overflowing
+template <typename TValue, bool = IsCompressible<TValue>::value>
+struct DeltaType {
+	typedef unsigned long long Type;
+};
+
+template <typename TValue>
+struct DeltaType<TValue, true> {
+	typedef typename make_unsigned<TValue>::type Type;
+};
+
+// An integral array cut into blocks of BlockSize values. A block keeps its first value as is and the zigzagged
+// differences between neighbours bit-packed at the narrowest width that fits them all, so mostly increasing
+// sequences take a few bits per value. Blocks decode independently, an element costs at most one block
+template <typename TValue>
+class CompressedArray {
+	typedef typename DeltaType<TValue>::Type Unsigned;
+
+	static const int UnsignedBits = sizeof(Unsigned) * 8;
+	static const int DecodeCacheSize = 8;
+
+	struct Block {
+		Unsigned First;
+		unsigned int WordOffset;
+		unsigned char Width;
+	};
+
+	vector<Block> blocks;
+	vector<unsigned long long> words;
+	int size;
+	unsigned long long id;
+
+	static unsigned long long GetNextId() {
+		static atomic<unsigned long long> lastId(0);
+		return ++lastId;
+	}
+
+	static Unsigned ZigZag(Unsigned delta) {
+		return (Unsigned)((Unsigned)(delta << 1) ^ (Unsigned)(0 - (delta >> (UnsignedBits - 1))));
+	}
+
+	static Unsigned UnZigZag(Unsigned bits) {
+		return (Unsigned)((bits >> 1) ^ (Unsigned)(0 - (bits & 1)));
+	}
+
+	// The delta between values i and i + 1 of the block, still zigzagged
+	Unsigned ReadDelta(const Block& block, int i) const {
+		if (block.Width == 0)
+			return 0;
+
+		size_t position = (size_t)i * block.Width;
+		size_t word = block.WordOffset + position / 64;
+		int shift = position % 64;
+		unsigned long long bits = words[word] >> shift;
+		if (shift + block.Width > 64)
+			bits |= words[word + 1] << (64 - shift);
+		return (Unsigned)(block.Width == 64 ? bits : bits & ((1ULL << block.Width) - 1));
+	}
+
+	int GetBlockSize(size_t block) const {
+		int begin = (int)block * BlockSize;
+		return size - begin < BlockSize ? size - begin : BlockSize;
+	}
+
+	void DecodeBlock(size_t block, Unsigned* output) const {
+		int count = GetBlockSize(block);
+		output[0] = blocks[block].First;
+		for (int i = 1; i < count; i++)
+			output[i] = ReadDelta(blocks[block], i - 1);
+		DeltaKernels<Unsigned>::Decode(output + 1, count - 1, output[0]);
+	}
+
+public:
+	static const int BlockSize = 128;
+
+	CompressedArray(const TValue* values, int size)
+		: size{ size }, id{ GetNextId() } {
+		static_assert(IsCompressible<TValue>::value, "Compressed arrays need an integral value type");
+
+		blocks.resize((size + BlockSize - 1) / BlockSize);
+		Unsigned deltas[BlockSize];
+		for (size_t block = 0; block < blocks.size(); block++) {
+			const TValue* blockValues = values + block * BlockSize;
+			int count = GetBlockSize(block);
+			Unsigned allBits = 0;
+			for (int i = 1; i < count; i++) {
+				deltas[i - 1] = ZigZag((Unsigned)((Unsigned)blockValues[i] - (Unsigned)blockValues[i - 1]));
+				allBits |= deltas[i - 1];
+			}
+
+			int width = 0;
+			while (width < UnsignedBits && (allBits >> width) != 0)
+				width++;
+			blocks[block].First = (Unsigned)blockValues[0];
+			blocks[block].WordOffset = (unsigned int)words.size();
+			blocks[block].Width = width;
+
+			words.resize(words.size() + ((size_t)(count - 1) * width + 63) / 64);
+			for (int i = 0; i + 1 < count && width != 0; i++) {
+				size_t position = (size_t)i * width;
+				size_t word = blocks[block].WordOffset + position / 64;
+				int shift = position % 64;
+				words[word] |= (unsigned long long)deltas[i] << shift;
+				if (shift + width > 64)
+					words[word + 1] |= (unsigned long long)deltas[i] >> (64 - shift);
+			}
+		}
+		words.shrink_to_fit();
+	}
+
+	int GetSize() const {
+		return size;
+	}
+
+	size_t GetRawBytes() const {
+		return size * sizeof(TValue);
+	}
+
+	size_t GetCompressedBytes() const {
+		return blocks.size() * sizeof(Block) + words.size() * sizeof(unsigned long long);
+	}
+
+	// index must be in range
+	TValue Get(int index) const {
+		const Block& block = blocks[index / BlockSize];
+		Unsigned value = block.First;
+		for (int i = 0; i < index % BlockSize; i++)
+			value = (Unsigned)(value + UnZigZag(ReadDelta(block, i)));
+		return (TValue)value;
+	}
+
+	// Decodes [begin, begin + count) into output, which must fit count values
+	void Decode(int begin, int count, TValue* output) const {
+		Unsigned decoded[BlockSize];
+		int end = begin + count;
+		for (int index = begin; index < end;) {
+			size_t block = index / BlockSize;
+			int blockBegin = (int)block * BlockSize;
+			int blockEnd = blockBegin + GetBlockSize(block);
+			DecodeBlock(block, decoded);
+			for (; index < end && index < blockEnd; index++)
+				*output++ = (TValue)decoded[index - blockBegin];
+		}
+	}
+
+	// Decodes the whole array into a small cache of recently read arrays. The cache is per thread, so readers
+	// sharing a map never overwrite each other's arrays; the pointer stays valid until this thread decodes
+	// DecodeCacheSize other arrays
+	TValue* DecodeCached() const {
+		struct DecodedArray {
+			unsigned long long Id;
+			vector<TValue> Values;
+		};
+		static thread_local DecodedArray cache[DecodeCacheSize];
+		static thread_local int nextSlot = 0;
+
+		for (int i = 0; i < DecodeCacheSize; i++)
+			if (cache[i].Id == id)
+				return cache[i].Values.data();
+
+		DecodedArray& slot = cache[nextSlot];
+		nextSlot = (nextSlot + 1) % DecodeCacheSize;
+		slot.Id = id;
+		slot.Values.resize(size);
+		Decode(0, size, slot.Values.data());
+		return slot.Values.data();
+	}
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+class EpochDomain {
+public:
+	static const int MaxThreads = 256;
+
+private:
+	class ThreadId {
+		int id;
+
+		static mutex& GetMutex() {
+			static mutex idsMutex;
+			return idsMutex;
+		}
+
+		static vector<int>& GetFreeIds() {
+			static vector<int> freeIds;
+			return freeIds;
+		}
+
+		static int& GetNextId() {
+			static int nextId = 0;
+			return nextId;
+		}
+
+	public:
+		ThreadId() {
+			lock_guard<mutex> lock(GetMutex());
+			if (!GetFreeIds().empty()) {
+				id = GetFreeIds().back();
+				GetFreeIds().pop_back();
+				return;
+			}
+
+			if (GetNextId() == MaxThreads)
+				throw "Too many threads";
+			id = GetNextId()++;
+		}
+
+		~ThreadId() {
+			lock_guard<mutex> lock(GetMutex());
+			GetFreeIds().push_back(id);
+		}
+
+		int GetId() {
+			return id;
+		}
+	};
+
+	struct alignas(64) ThreadSlot {
+		// 0 while the thread is outside of a read section
+		atomic<unsigned long long> Epoch;
+		int Depth;
+
+		ThreadSlot()
+			: Epoch{ 0 }, Depth{ 0 } {
+		}
+	};
+
+	struct RetiredItem {
+		unsigned long long Epoch;
+		void* Memory;
+		void (*Deleter)(void*);
+	};
+
+	static const size_t ReclaimThreshold = 64;
+
+	atomic<unsigned long long> globalEpoch;
+	// Set once, Enter then needs only a compiler barrier and Reclaim pays for the fence instead
+	bool hasProcessFence;
+	ThreadSlot threadSlots[MaxThreads];
+	vector<RetiredItem> retiredItems;
+
+	// The id is cached in a plain thread_local, so only a thread's first Enter pays for registering it
+	static int RegisterThread(int& cachedId) {
+		thread_local ThreadId threadId;
+		cachedId = threadId.GetId();
+		return cachedId;
+	}
+
+	static int GetThreadId() {
+		static thread_local int cachedId = -1;
+		return cachedId >= 0 ? cachedId : RegisterThread(cachedId);
+	}
+
+	static bool RegisterProcessFence() {
+#ifdef _WIN32
+		return true;
+#else
+		static bool isRegistered = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+		return isRegistered;
+#endif
+	}
+
+	// Runs a full fence on every thread of the process, so an epoch a reader announced before it is visible here
+	static void ProcessFence() {
+#ifdef _WIN32
+		FlushProcessWriteBuffers();
+#else
+		if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0)
+			throw "Process-wide fence failed";
+#endif
+	}
+
+public:
+	EpochDomain()
+		: globalEpoch{ 1 }, hasProcessFence{ RegisterProcessFence() } {
+	}
+
+	EpochDomain(const EpochDomain&) = delete;
+	EpochDomain& operator=(const EpochDomain&) = delete;
+
+	~EpochDomain() {
+		for (size_t i = 0; i < retiredItems.size(); i++)
+			retiredItems[i].Deleter(retiredItems[i].Memory);
+	}
+
+	// Returns the thread id that must be passed to Exit
+	int Enter() {
+		int threadId = GetThreadId();
+		ThreadSlot& slot = threadSlots[threadId];
+		if (slot.Depth++ != 0)
+			return threadId;
+
+		slot.Epoch.store(globalEpoch.load(memory_order_acquire), memory_order_relaxed);
+		if (hasProcessFence)
+			atomic_signal_fence(memory_order_seq_cst);
+		else
+			atomic_thread_fence(memory_order_seq_cst);
+		return threadId;
+	}
+
+	void Exit(int threadId) {
+		ThreadSlot& slot = threadSlots[threadId];
+		if (--slot.Depth == 0)
+			slot.Epoch.store(0, memory_order_release);
+	}
+
+	// Retire and Reclaim must be serialized by the caller
+	void Retire(void* memory, void (*deleter)(void*)) {
+		RetiredItem item;
+		item.Epoch = globalEpoch.load(memory_order_relaxed);
+		item.Memory = memory;
+		item.Deleter = deleter;
+		retiredItems.push_back(item);
+
+		if (retiredItems.size() >= ReclaimThreshold)
+			Reclaim();
+	}
+
+	void Reclaim() {
+		if (hasProcessFence)
+			ProcessFence();
+		else
+			atomic_thread_fence(memory_order_seq_cst);
+		unsigned long long minimumEpoch = globalEpoch.fetch_add(1, memory_order_acq_rel) + 1;
+		for (int i = 0; i < MaxThreads; i++) {
+			unsigned long long epoch = threadSlots[i].Epoch.load(memory_order_acquire);
+			if (epoch != 0 && epoch < minimumEpoch)
+				minimumEpoch = epoch;
+		}
+
+		size_t keptItems = 0;
+		for (size_t i = 0; i < retiredItems.size(); i++)
+			if (retiredItems[i].Epoch < minimumEpoch)
+				retiredItems[i].Deleter(retiredItems[i].Memory);
+			else
+				retiredItems[keptItems++] = retiredItems[i];
+		retiredItems.resize(keptItems);
+	}
+
+	size_t GetRetiredCount() {
+		return retiredItems.size();
+	}
+};
@@ -0,0 +1,820 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <memory>
+#include "ComplexMapSimd.h"
+#include "ComplexMapAllocator.h"
+
+using namespace std;
+
+// Lookups take LookupKey, so string keys can be found by string_view or const char* without building a string
+template <typename TKey>
+struct KeyTraits {
+	typedef const TKey& LookupKey;
+
+	static size_t GetHash(const TKey& key) {
+		return hash<TKey>()(key);
+	}
+};
+
+template <>
+struct KeyTraits<string> {
+	typedef string_view LookupKey;
+
+	static size_t GetHash(string_view key) {
+		return hash<string_view>()(key);
+	}
+};
+
+struct OrderedIndex {
+	template <typename TKey, typename TItem>
+	class Type {
+		typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+		typedef map<TKey, TItem, less<>> Items;
+
+		Items items;
+
+		// A tree node holds three links and a color ahead of the key and item
+		static const size_t NodeSize = sizeof(typename Items::value_type) + 4 * sizeof(void*);
+
+	public:
+		template <typename TIterator>
+		class CursorType {
+			TIterator position;
+			TIterator end;
+
+		public:
+			CursorType(TIterator position, TIterator end)
+				: position{ position }, end{ end } {
+			}
+
+			bool IsValid() {
+				return position != end;
+			}
+
+			void MoveNext() {
+				++position;
+			}
+
+			const TKey& GetKey() {
+				return position->first;
+			}
+
+			TItem& GetItem() {
+				return position->second;
+			}
+		};
+
+		typedef CursorType<typename Items::iterator> Cursor;
+		typedef CursorType<typename Items::reverse_iterator> ReverseCursor;
+
+		static const bool IsOrdered = true;
+		static const bool PrefetchesBatches = false;
+
+		int GetSize() {
+			return items.size();
+		}
+
+		TItem* Find(LookupKey key) {
+			typename Items::iterator item = items.find(key);
+			if (item == items.end())
+				return nullptr;
+
+			return &item->second;
+		}
+
+		// A tree lookup is a chain of dependent loads, there is nothing to fetch ahead of it
+		void Prefetch(LookupKey key) {
+		}
+
+		// Find for a caller that changes the item. Indexes that share chunks with a fork copy the chunk first
+		TItem* FindForUpdate(LookupKey key) {
+			return Find(key);
+		}
+
+		template <typename TKeyArg>
+		pair<TItem*, bool> Insert(TKeyArg&& key, const TItem& item) {
+			return TryEmplace(forward<TKeyArg>(key), [&]() { return item; });
+		}
+
+		// createItem runs only when the key is missing, before anything is inserted
+		template <typename TKeyArg, typename TCreateItem>
+		pair<TItem*, bool> TryEmplace(TKeyArg&& key, TCreateItem createItem) {
+			LookupKey lookupKey = key;
+			typename Items::iterator item = items.lower_bound(lookupKey);
+			if (item != items.end() && !(items.key_comp()(lookupKey, item->first)))
+				return pair<TItem*, bool>(&item->second, false);
+
+			item = items.emplace_hint(item, forward<TKeyArg>(key), createItem());
+			return pair<TItem*, bool>(&item->second, true);
+		}
+
+		bool Erase(LookupKey key, TItem* erasedItem) {
+			typename Items::iterator item = items.find(key);
+			if (item == items.end())
+				return false;
+
+			*erasedItem = item->second;
+			items.erase(item);
+			return true;
+		}
+
+		template <typename TAction>
+		void ForEach(TAction action) {
+			for (typename Items::iterator item = items.begin(); item != items.end(); ++item)
+				action(item->first, item->second);
+		}
+
+		template <typename TAction>
+		void ForEachForUpdate(TAction action) {
+			ForEach(action);
+		}
+
+		void Clear() {
+			items.clear();
+		}
+
+		// Keys come in strictly ascending order. A key past the current last one is appended in constant time, others
+		// are placed by a search. Missing keys get createItem(i), present ones are passed to existing(i, item)
+		template <typename TGetKey, typename TCreateItem, typename TExisting>
+		void InsertSorted(size_t count, TGetKey getKey, TCreateItem createItem, TExisting existing) {
+			for (size_t i = 0; i < count; i++) {
+				const TKey& key = getKey(i);
+				if (items.empty() || items.key_comp()(prev(items.end())->first, key)) {
+					items.emplace_hint(items.end(), key, createItem(i));
+					continue;
+				}
+
+				typename Items::iterator item = items.lower_bound(key);
+				if (item != items.end() && !items.key_comp()(key, item->first))
+					existing(i, item->second);
+				else
+					items.emplace_hint(item, key, createItem(i));
+			}
+		}
+
+		// Nodes are allocated one per key, there is nothing to reserve or give back
+		void Reserve(int count) {
+		}
+		void ShrinkToFit() {
+		}
+
+		void AddMemoryUsage(MemoryUsage& usage) {
+			usage.Index += items.size() * NodeSize;
+		}
+
+		Cursor GetCursor() {
+			return Cursor(items.begin(), items.end());
+		}
+		Cursor GetCursor(LookupKey from) {
+			return Cursor(items.lower_bound(from), items.end());
+		}
+		Cursor GetCursorAfter(LookupKey key) {
+			return Cursor(items.upper_bound(key), items.end());
+		}
+
+		ReverseCursor GetReverseCursor() {
+			return ReverseCursor(items.rbegin(), items.rend());
+		}
+		ReverseCursor GetReverseCursor(LookupKey from) {
+			return ReverseCursor(typename Items::reverse_iterator(items.upper_bound(from)), items.rend());
+		}
+		ReverseCursor GetReverseCursorBefore(LookupKey key) {
+			return ReverseCursor(typename Items::reverse_iterator(items.lower_bound(key)), items.rend());
+		}
+	};
+};
+
+struct FlatHashIndex {
+	template <typename TKey, typename TItem>
+	class Type {
+		typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+
+		struct Slot {
+			TKey Key;
+			TItem Item;
+			// 0 marks an empty slot, otherwise the distance from the home slot plus one
+			unsigned int Distance;
+
+			Slot()
+				: Key{}, Item{}, Distance{ 0 } {
+			}
+		};
+
+		vector<Slot> slots;
+		size_t mask = 0;
+		int shift = 64;
+		int size = 0;
+
+		size_t GetHomeSlot(LookupKey key) {
+			unsigned long long hashCode = KeyTraits<TKey>::GetHash(key);
+			return (size_t)((hashCode * 11400714819323198485ull) >> shift);
+		}
+
+		size_t FindSlot(LookupKey key) {
+			if (size == 0)
+				return slots.size();
+
+			size_t slot = GetHomeSlot(key);
+			for (unsigned int distance = 1; slots[slot].Distance >= distance; distance++) {
+				if (slots[slot].Key == key)
+					return slot;
+				slot = (slot + 1) & mask;
+			}
+
+			return slots.size();
+		}
+
+		size_t PlaceSlot(Slot slot) {
+			size_t position = GetHomeSlot(slot.Key);
+			size_t placedPosition = slots.size();
+			slot.Distance = 1;
+
+			while (true) {
+				if (slots[position].Distance == 0) {
+					slots[position] = move(slot);
+					return placedPosition == slots.size() ? position : placedPosition;
+				}
+
+				if (slots[position].Distance < slot.Distance) {
+					swap(slots[position], slot);
+					if (placedPosition == slots.size())
+						placedPosition = position;
+				}
+
+				position = (position + 1) & mask;
+				slot.Distance++;
+			}
+		}
+
+		void Rehash(size_t capacity) {
+			vector<Slot> oldSlots(capacity);
+			oldSlots.swap(slots);
+			mask = capacity - 1;
+			shift = 64;
+			for (size_t bits = capacity; bits > 1; bits >>= 1)
+				shift--;
+
+			for (size_t i = 0; i < oldSlots.size(); i++)
+				if (oldSlots[i].Distance != 0)
+					PlaceSlot(move(oldSlots[i]));
+		}
+
+		// Smallest power of two that holds count keys within the 7/8 load limit
+		static size_t GetCapacity(size_t count) {
+			size_t capacity = 8;
+			while (count * 8 > capacity * 7)
+				capacity *= 2;
+			return capacity;
+		}
+
+	public:
+		static const bool IsOrdered = false;
+		// One probe per key: out-of-order execution already overlaps the misses of a plain lookup loop
+		static const bool PrefetchesBatches = false;
+
+		int GetSize() {
+			return size;
+		}
+
+		TItem* Find(LookupKey key) {
+			size_t slot = FindSlot(key);
+			if (slot == slots.size())
+				return nullptr;
+
+			return &slots[slot].Item;
+		}
+
+		// Pulls in the home slot, a later Find for the same key usually probes only that cache line
+		void Prefetch(LookupKey key) {
+			if (size != 0)
+				PrefetchMemory(&slots[GetHomeSlot(key)]);
+		}
+
+		TItem* FindForUpdate(LookupKey key) {
+			return Find(key);
+		}
+
+		template <typename TKeyArg>
+		pair<TItem*, bool> Insert(TKeyArg&& key, const TItem& item) {
+			return TryEmplace(forward<TKeyArg>(key), [&]() { return item; });
+		}
+
+		// createItem runs only when the key is missing, before anything is inserted
+		template <typename TKeyArg, typename TCreateItem>
+		pair<TItem*, bool> TryEmplace(TKeyArg&& key, TCreateItem createItem) {
+			size_t slot = FindSlot(key);
+			if (slot != slots.size())
+				return pair<TItem*, bool>(&slots[slot].Item, false);
+
+			if ((size_t)(size + 1) * 8 > slots.size() * 7)
+				Rehash(slots.empty() ? 8 : slots.size() * 2);
+
+			Slot newSlot;
+			newSlot.Item = createItem();
+			newSlot.Key = forward<TKeyArg>(key);
+			slot = PlaceSlot(move(newSlot));
+			size++;
+			return pair<TItem*, bool>(&slots[slot].Item, true);
+		}
+
+		bool Erase(LookupKey key, TItem* erasedItem) {
+			size_t slot = FindSlot(key);
+			if (slot == slots.size())
+				return false;
+
+			*erasedItem = slots[slot].Item;
+
+			size_t next = (slot + 1) & mask;
+			while (slots[next].Distance > 1) {
+				slots[slot] = move(slots[next]);
+				slots[slot].Distance--;
+				slot = next;
+				next = (next + 1) & mask;
+			}
+
+			slots[slot] = Slot();
+			size--;
+			return true;
+		}
+
+		template <typename TAction>
+		void ForEach(TAction action) {
+			for (size_t i = 0; i < slots.size(); i++)
+				if (slots[i].Distance != 0)
+					action(slots[i].Key, slots[i].Item);
+		}
+
+		template <typename TAction>
+		void ForEachForUpdate(TAction action) {
+			ForEach(action);
+		}
+
+		void Clear() {
+			slots.clear();
+			mask = 0;
+			shift = 64;
+			size = 0;
+		}
+
+		// Order does not help a hash table, but the table is sized once for all the keys
+		template <typename TGetKey, typename TCreateItem, typename TExisting>
+		void InsertSorted(size_t count, TGetKey getKey, TCreateItem createItem, TExisting existing) {
+			Reserve(size + (int)count);
+			for (size_t i = 0; i < count; i++) {
+				pair<TItem*, bool> inserted = TryEmplace(getKey(i), [&]() { return createItem(i); });
+				if (!inserted.second)
+					existing(i, *inserted.first);
+			}
+		}
+
+		void Reserve(int count) {
+			size_t capacity = GetCapacity(count);
+			if (capacity > slots.size())
+				Rehash(capacity);
+		}
+
+		void ShrinkToFit() {
+			if (size == 0) {
+				vector<Slot>().swap(slots);
+				Clear();
+				return;
+			}
+
+			size_t capacity = GetCapacity(size);
+			if (capacity < slots.size())
+				Rehash(capacity);
+		}
+
+		void AddMemoryUsage(MemoryUsage& usage) {
+			usage.Index += size * sizeof(Slot);
+			usage.Slack += (slots.capacity() - size) * sizeof(Slot);
+		}
+	};
+};
+
+// Integral keys from a compact range go straight to a slot: no hashing and no comparisons, the occupancy
+// bitmap says which slots hold items. The range grows to cover new keys; once keys spread so thin that
+// the slots would be mostly empty, the index moves everything to a FlatHashIndex until it is cleared.
+struct DenseIndex {
+	template <typename TKey, typename TItem, bool IsIntegral = is_integral<TKey>::value>
+	class Type : public FlatHashIndex::Type<TKey, TItem> {
+	};
+
+	template <typename TKey, typename TItem>
+	class Type<TKey, TItem, true> {
+		typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+		typedef FlatHashIndex::Type<TKey, TItem> SparseIndex;
+
+		static const size_t MinimumRange = 256;
+		// Dense slots are kept while the range is at most this many times the number of keys
+		static const size_t SparseFactor = 8;
+
+		vector<TItem> items;
+		vector<unsigned long long> occupied;
+		// Keys are shifted to unsigned ordinals, so signed keys keep their order and offsets never overflow
+		unsigned long long base = 0;
+		// Bounds of the added keys, removals do not narrow them
+		unsigned long long lowest = 0;
+		unsigned long long highest = 0;
+		int size = 0;
+		bool isSparse = false;
+		SparseIndex sparseItems;
+
+		static unsigned long long GetOrdinal(TKey key) {
+			return (unsigned long long)key - (unsigned long long)numeric_limits<TKey>::min();
+		}
+
+		static TKey GetKey(unsigned long long ordinal) {
+			return (TKey)(ordinal + (unsigned long long)numeric_limits<TKey>::min());
+		}
+
+		bool IsOccupied(size_t offset) {
+			return (occupied[offset >> 6] >> (offset & 63)) & 1;
+		}
+
+		template <typename TAction>
+		void ForEachOccupied(TAction action) {
+			for (size_t word = 0; word < occupied.size(); word++)
+				for (unsigned long long bits = occupied[word]; bits != 0; bits &= bits - 1)
+					action(word * 64 + CountTrailingZeros(bits));
+		}
+
+		void Relocate(unsigned long long newBase, size_t capacity) {
+			vector<TItem> newItems(capacity);
+			vector<unsigned long long> newOccupied((capacity + 63) / 64);
+			ForEachOccupied([&](size_t offset) {
+				size_t newOffset = (size_t)(base + offset - newBase);
+				newItems[newOffset] = move(items[offset]);
+				newOccupied[newOffset >> 6] |= 1ull << (newOffset & 63);
+			});
+			items.swap(newItems);
+			occupied.swap(newOccupied);
+			base = newBase;
+		}
+
+		void MakeSparse() {
+			ForEachOccupied([&](size_t offset) { sparseItems.Insert(GetKey(base + offset), items[offset]); });
+			vector<TItem>().swap(items);
+			vector<unsigned long long>().swap(occupied);
+			isSparse = true;
+		}
+
+		// The last slot must not pass the largest ordinal, or offsets of small keys would wrap into the range
+		static unsigned long long ClampBase(unsigned long long newBase, size_t capacity) {
+			unsigned long long highestBase = numeric_limits<unsigned long long>::max() - (capacity - 1);
+			return newBase > highestBase ? highestBase : newBase;
+		}
+
+		// Makes the slots cover ordinal, or switches to the sparse index; returns false in the latter case
+		bool Cover(unsigned long long ordinal) {
+			unsigned long long low = size == 0 || ordinal < lowest ? ordinal : lowest;
+			unsigned long long high = size == 0 || ordinal > highest ? ordinal : highest;
+			size_t sparseLimit = SparseFactor * (size_t)(size + 1);
+			if (high - low >= (sparseLimit > MinimumRange ? sparseLimit : MinimumRange)) {
+				MakeSparse();
+				return false;
+			}
+
+			size_t capacity = items.empty() ? MinimumRange : size == 0 ? items.size() : items.size() * 2;
+			if (capacity < high - low + 1)
+				capacity = (size_t)(high - low + 1);
+			// Growing down leaves the spare slots below, so keys added in falling order do not regrow every time
+			unsigned long long newBase = size == 0 || ordinal > low ? low : high + 1 >= capacity ? high + 1 - capacity : 0;
+			Relocate(ClampBase(newBase, capacity), capacity);
+			return true;
+		}
+
+	public:
+		static const bool IsOrdered = false;
+		static const bool PrefetchesBatches = false;
+
+		int GetSize() {
+			return isSparse ? sparseItems.GetSize() : size;
+		}
+
+		TItem* Find(LookupKey key) {
+			if (isSparse)
+				return sparseItems.Find(key);
+
+			size_t offset = (size_t)(GetOrdinal(key) - base);
+			if (offset >= items.size() || !IsOccupied(offset))
+				return nullptr;
+
+			return &items[offset];
+		}
+
+		TItem* FindForUpdate(LookupKey key) {
+			return Find(key);
+		}
+
+		void Prefetch(LookupKey key) {
+			if (isSparse) {
+				sparseItems.Prefetch(key);
+				return;
+			}
+
+			size_t offset = (size_t)(GetOrdinal(key) - base);
+			if (offset < items.size())
+				PrefetchMemory(&items[offset]);
+		}
+
+		template <typename TKeyArg>
+		pair<TItem*, bool> Insert(TKeyArg&& key, const TItem& item) {
+			return TryEmplace(forward<TKeyArg>(key), [&]() { return item; });
+		}
+
+		// createItem runs only when the key is missing, before anything is inserted
+		template <typename TKeyArg, typename TCreateItem>
+		pair<TItem*, bool> TryEmplace(TKeyArg&& key, TCreateItem createItem) {
+			if (isSparse)
+				return sparseItems.TryEmplace(forward<TKeyArg>(key), createItem);
+
+			unsigned long long ordinal = GetOrdinal(key);
+			size_t offset = (size_t)(ordinal - base);
+			if (offset < items.size() && IsOccupied(offset))
+				return pair<TItem*, bool>(&items[offset], false);
+
+			if (offset >= items.size()) {
+				if (!Cover(ordinal))
+					return sparseItems.TryEmplace(forward<TKeyArg>(key), createItem);
+				offset = (size_t)(ordinal - base);
+			}
+
+			items[offset] = createItem();
+			occupied[offset >> 6] |= 1ull << (offset & 63);
+			lowest = size == 0 || ordinal < lowest ? ordinal : lowest;
+			highest = size == 0 || ordinal > highest ? ordinal : highest;
+			size++;
+			return pair<TItem*, bool>(&items[offset], true);
+		}
+
+		bool Erase(LookupKey key, TItem* erasedItem) {
+			if (isSparse)
+				return sparseItems.Erase(key, erasedItem);
+
+			size_t offset = (size_t)(GetOrdinal(key) - base);
+			if (offset >= items.size() || !IsOccupied(offset))
+				return false;
+
+			*erasedItem = items[offset];
+			items[offset] = TItem();
+			occupied[offset >> 6] &= ~(1ull << (offset & 63));
+			size--;
+			return true;
+		}
+
+		// Dense slots are visited in key order; the key reference is only valid during the call
+		template <typename TAction>
+		void ForEach(TAction action) {
+			if (isSparse) {
+				sparseItems.ForEach(action);
+				return;
+			}
+
+			ForEachOccupied([&](size_t offset) {
+				const TKey key = GetKey(base + offset);
+				action(key, items[offset]);
+			});
+		}
+
+		template <typename TAction>
+		void ForEachForUpdate(TAction action) {
+			ForEach(action);
+		}
+
+		// Keeps the dense range, so a map that is refilled with the same keys does not grow again
+		void Clear() {
+			fill(items.begin(), items.end(), TItem());
+			fill(occupied.begin(), occupied.end(), 0ull);
+			size = 0;
+			isSparse = false;
+			sparseItems.Clear();
+		}
+
+		bool IsSparse() {
+			return isSparse;
+		}
+
+		// Ascending keys grow the range upward, so it doubles only a logarithmic number of times
+		template <typename TGetKey, typename TCreateItem, typename TExisting>
+		void InsertSorted(size_t count, TGetKey getKey, TCreateItem createItem, TExisting existing) {
+			for (size_t i = 0; i < count; i++) {
+				pair<TItem*, bool> inserted = TryEmplace(getKey(i), [&]() { return createItem(i); });
+				if (!inserted.second)
+					existing(i, *inserted.first);
+			}
+		}
+
+		// The range follows the keys, not a count, so reserving does nothing until keys arrive
+		void Reserve(int count) {
+		}
+
+		// Narrows the slots to the keys still present, dropping them entirely when none are left
+		void ShrinkToFit() {
+			if (isSparse) {
+				sparseItems.ShrinkToFit();
+				return;
+			}
+			if (size == 0) {
+				vector<TItem>().swap(items);
+				vector<unsigned long long>().swap(occupied);
+				return;
+			}
+
+			size_t first = items.size();
+			size_t last = 0;
+			ForEachOccupied([&](size_t offset) {
+				first = offset < first ? offset : first;
+				last = offset;
+			});
+			size_t capacity = last - first + 1 > MinimumRange ? last - first + 1 : MinimumRange;
+			if (capacity >= items.size())
+				return;
+
+			lowest = base + first;
+			highest = base + last;
+			Relocate(ClampBase(base + first, capacity), capacity);
+		}
+
+		void AddMemoryUsage(MemoryUsage& usage) {
+			if (isSparse) {
+				sparseItems.AddMemoryUsage(usage);
+				return;
+			}
+
+			usage.Index += size * sizeof(TItem) + occupied.capacity() * sizeof(unsigned long long);
+			usage.Slack += (items.capacity() - size) * sizeof(TItem);
+		}
+	};
+};
+
+// Hash chunks behind a shared root, so Fork copies one pointer. A map copies the root and then a chunk the first
+// time it changes that chunk while a fork still holds it; chunks nobody changes stay shared
+struct ChunkedIndex {
+	template <typename TKey, typename TItem>
+	class Type {
+		typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+		typedef FlatHashIndex::Type<TKey, TItem> Chunk;
+
+		static const size_t ChunkCount = 256;
+
+		struct Root {
+			shared_ptr<Chunk> Chunks[ChunkCount];
+		};
+
+		shared_ptr<Root> root;
+		int size = 0;
+
+		// Middle bits of the hash, the chunks place keys by the top bits
+		static size_t GetChunkIndex(LookupKey key) {
+			unsigned long long hashCode = KeyTraits<TKey>::GetHash(key);
+			return (size_t)((hashCode * 11400714819323198485ull) >> 32) & (ChunkCount - 1);
+		}
+
+		Chunk* GetChunk(size_t chunkIndex) {
+			return root == nullptr ? nullptr : root->Chunks[chunkIndex].get();
+		}
+
+		// Only this map can add owners to its root and chunks, so a count of one stays one while it writes
+		Chunk& GetChunkForUpdate(size_t chunkIndex) {
+			if (root == nullptr)
+				root = make_shared<Root>();
+			else if (root.use_count() > 1)
+				root = make_shared<Root>(*root);
+
+			shared_ptr<Chunk>& chunk = root->Chunks[chunkIndex];
+			if (chunk == nullptr)
+				chunk = make_shared<Chunk>();
+			else if (chunk.use_count() > 1)
+				chunk = make_shared<Chunk>(*chunk);
+			return *chunk;
+		}
+
+	public:
+		static const bool IsOrdered = false;
+		// The chunk table and the chunk are two dependent misses per key, prefetching a group overlaps them
+		static const bool PrefetchesBatches = true;
+
+		Type Fork() {
+			Type fork;
+			fork.root = root;
+			fork.size = size;
+			return fork;
+		}
+
+		int GetSize() {
+			return size;
+		}
+
+		TItem* Find(LookupKey key) {
+			Chunk* chunk = GetChunk(GetChunkIndex(key));
+			return chunk == nullptr ? nullptr : chunk->Find(key);
+		}
+
+		TItem* FindForUpdate(LookupKey key) {
+			size_t chunkIndex = GetChunkIndex(key);
+			if (Find(key) == nullptr)
+				return nullptr;
+
+			return GetChunkForUpdate(chunkIndex).Find(key);
+		}
+
+		void Prefetch(LookupKey key) {
+			Chunk* chunk = GetChunk(GetChunkIndex(key));
+			if (chunk != nullptr)
+				chunk->Prefetch(key);
+		}
+
+		template <typename TKeyArg>
+		pair<TItem*, bool> Insert(TKeyArg&& key, const TItem& item) {
+			return TryEmplace(forward<TKeyArg>(key), [&]() { return item; });
+		}
+
+		template <typename TKeyArg, typename TCreateItem>
+		pair<TItem*, bool> TryEmplace(TKeyArg&& key, TCreateItem createItem) {
+			pair<TItem*, bool> inserted = GetChunkForUpdate(GetChunkIndex(key)).TryEmplace(forward<TKeyArg>(key), createItem);
+			if (inserted.second)
+				size++;
+			return inserted;
+		}
+
+		template <typename TGetKey, typename TCreateItem, typename TExisting>
+		void InsertSorted(size_t count, TGetKey getKey, TCreateItem createItem, TExisting existing) {
+			for (size_t i = 0; i < count; i++) {
+				pair<TItem*, bool> inserted = TryEmplace(getKey(i), [&]() { return createItem(i); });
+				if (!inserted.second)
+					existing(i, *inserted.first);
+			}
+		}
+
+		bool Erase(LookupKey key, TItem* erasedItem) {
+			size_t chunkIndex = GetChunkIndex(key);
+			if (Find(key) == nullptr || !GetChunkForUpdate(chunkIndex).Erase(key, erasedItem))
+				return false;
+
+			size--;
+			return true;
+		}
+
+		template <typename TAction>
+		void ForEach(TAction action) {
+			for (size_t i = 0; i < ChunkCount; i++) {
+				Chunk* chunk = GetChunk(i);
+				if (chunk != nullptr)
+					chunk->ForEach(action);
+			}
+		}
+
+		template <typename TAction>
+		void ForEachForUpdate(TAction action) {
+			for (size_t i = 0; i < ChunkCount; i++)
+				if (GetChunk(i) != nullptr)
+					GetChunkForUpdate(i).ForEach(action);
+		}
+
+		// Drops this map's hold on the chunks, a fork keeps its own
+		void Clear() {
+			root.reset();
+			size = 0;
+		}
+
+		// Keys spread over all chunks, each grows on its own
+		void Reserve(int count) {
+		}
+
+		// Empty chunks are dropped
+		void ShrinkToFit() {
+			for (size_t i = 0; i < ChunkCount; i++) {
+				if (GetChunk(i) == nullptr)
+					continue;
+
+				Chunk& chunk = GetChunkForUpdate(i);
+				if (chunk.GetSize() == 0)
+					root->Chunks[i].reset();
+				else
+					chunk.ShrinkToFit();
+			}
+		}
+
+		// Chunks shared with a fork are counted by both maps
+		void AddMemoryUsage(MemoryUsage& usage) {
+			if (root == nullptr)
+				return;
+
+			usage.Index += sizeof(Root);
+			for (size_t i = 0; i < ChunkCount; i++) {
+				Chunk* chunk = GetChunk(i);
+				if (chunk != nullptr)
+					chunk->AddMemoryUsage(usage);
+			}
+		}
+	};
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+using namespace std;
+
+// Which copied payloads SetInterning pools from then on
+enum class InterningMode {
+	None,
+	Strings,
+	StringsAndArrays
+};
+
+// Equal payloads share one buffer, freed when the last entry holding it releases it. Buffers end with a terminator,
+// so pooled strings are C strings. Locked, entries may be released on a reclaim thread
+class InternPool {
+	mutex poolMutex;
+	// Keys view the pooled buffers themselves
+	unordered_map<string_view, int> references;
+	size_t bytes = 0;
+
+public:
+	InternPool() {
+	}
+
+	InternPool(const InternPool&) = delete;
+	InternPool& operator=(const InternPool&) = delete;
+
+	~InternPool() {
+		for (auto i = references.begin(); i != references.end(); ++i)
+			delete[] i->first.data();
+	}
+
+	// Returns the pooled copy of [data, data + length), equal payloads get the same pointer
+	const char* Acquire(const char* data, size_t length) {
+		lock_guard<mutex> lock(poolMutex);
+		auto found = references.find(string_view(data, length));
+		if (found != references.end()) {
+			found->second++;
+			return found->first.data();
+		}
+
+		unique_ptr<char[]> buffer(new char[length + 1]);
+		memcpy(buffer.get(), data, length);
+		buffer[length] = 0;
+		references.emplace(string_view(buffer.get(), length), 1);
+		bytes += length + 1;
+		return buffer.release();
+	}
+
+	// buffer must come from Acquire with the same length
+	void Release(const char* buffer, size_t length) {
+		lock_guard<mutex> lock(poolMutex);
+		auto found = references.find(string_view(buffer, length));
+		if (--found->second != 0)
+			return;
+
+		references.erase(found);
+		bytes -= length + 1;
+		delete[] buffer;
+	}
+
+	size_t GetBufferCount() {
+		lock_guard<mutex> lock(poolMutex);
+		return references.size();
+	}
+
+	// Pooled bytes with terminators, each buffer counted once however many entries share it
+	size_t GetBytes() {
+		lock_guard<mutex> lock(poolMutex);
+		return bytes;
+	}
+};
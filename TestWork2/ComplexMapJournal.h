@@ -0,0 +1,510 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include "ComplexMap.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+class JournalFile {
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+#endif
+	unsigned long long size = 0;
+
+public:
+	JournalFile(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER fileSize;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize)) {
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			throw "Cannot open journal";
+		}
+		size = fileSize.QuadPart;
+#else
+		file = open(path, O_RDWR | O_CREAT, 0644);
+		struct stat fileStat;
+		if (file == -1 || fstat(file, &fileStat) != 0) {
+			if (file != -1)
+				close(file);
+			throw "Cannot open journal";
+		}
+		size = fileStat.st_size;
+#endif
+	}
+
+	JournalFile(const JournalFile&) = delete;
+	JournalFile& operator=(const JournalFile&) = delete;
+
+	~JournalFile() {
+#ifdef _WIN32
+		CloseHandle(file);
+#else
+		close(file);
+#endif
+	}
+
+	unsigned long long GetSize() {
+		return size;
+	}
+
+	void ReadAll(vector<char>* content) {
+		content->resize((size_t)size);
+		size_t position = 0;
+		while (position < content->size()) {
+#ifdef _WIN32
+			LARGE_INTEGER offset;
+			offset.QuadPart = position;
+			DWORD read = 0;
+			if (!SetFilePointerEx(file, offset, nullptr, FILE_BEGIN) || !ReadFile(file, content->data() + position, (DWORD)min(content->size() - position, (size_t)1 << 30), &read, nullptr) || read == 0)
+				throw "Cannot read journal";
+#else
+			ssize_t read = pread(file, content->data() + position, content->size() - position, position);
+			if (read <= 0)
+				throw "Cannot read journal";
+#endif
+			position += read;
+		}
+	}
+
+	// Drops everything after newSize and moves the write position to the end
+	void Truncate(unsigned long long newSize) {
+#ifdef _WIN32
+		LARGE_INTEGER offset;
+		offset.QuadPart = newSize;
+		if (!SetFilePointerEx(file, offset, nullptr, FILE_BEGIN) || !SetEndOfFile(file))
+			throw "Cannot truncate journal";
+#else
+		if (ftruncate(file, newSize) != 0 || lseek(file, newSize, SEEK_SET) == -1)
+			throw "Cannot truncate journal";
+#endif
+		size = newSize;
+	}
+
+	void Append(const char* data, size_t length) {
+		while (length > 0) {
+#ifdef _WIN32
+			DWORD written = 0;
+			if (!WriteFile(file, data, (DWORD)min(length, (size_t)1 << 30), &written, nullptr))
+				throw "Cannot write journal";
+#else
+			ssize_t written = write(file, data, length);
+			if (written < 0)
+				throw "Cannot write journal";
+#endif
+			data += written;
+			length -= written;
+			size += written;
+		}
+	}
+
+	void Sync() {
+#ifdef _WIN32
+		if (!FlushFileBuffers(file))
+#else
+		if (fsync(file) != 0)
+#endif
+			throw "Cannot sync journal";
+	}
+};
+
+struct JournalOptions {
+	// Group commit: buffered records are written and synced once SyncRecords accumulate, or by a sync thread once
+	// SyncMilliseconds pass after the first of them was buffered. 0 milliseconds leaves only the record count
+	int SyncRecords = 64;
+	int SyncMilliseconds = 10;
+	size_t BufferSize = 64 * 1024;
+	// Journal size that triggers folding the journal into the snapshot
+	unsigned long long CompactionSize = 64ull * 1024 * 1024;
+};
+
+// Mutations are applied to the map first and journaled only if they succeed.
+// Records still in the buffer are lost on a crash, call Sync to make them durable. The map itself is not thread-safe,
+// the sync thread only touches the buffer and the journal file.
+template <typename TKey, typename TValue, typename TIndex = OrderedIndex, typename TStorage = HeapStorage, typename TAllocator = HeapAllocator>
+class JournaledComplexMap {
+	static_assert(is_trivially_copyable<TKey>::value && is_trivially_copyable<TValue>::value, "Journals need trivially copyable keys and values");
+
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+
+	enum class Operation : unsigned char {
+		AddValue = 1,
+		AddArray,
+		AddString,
+		Remove,
+		RemoveAll
+	};
+
+	// Record: body size, checksum, then body of operation, key, size and payload
+	static const size_t RecordHeaderSize = 2 * sizeof(unsigned int);
+	static const size_t BodyHeaderSize = 1 + sizeof(TKey) + sizeof(int);
+
+	ComplexMap<TKey, TValue, TIndex, TStorage, TAllocator> complexMap;
+	string snapshotPath;
+	JournalFile journal;
+	JournalOptions options;
+	// Guards the buffer and the journal file, the sync thread takes it too
+	mutex journalMutex;
+	condition_variable recordsBuffered;
+	vector<char> buffer;
+	int bufferedRecords = 0;
+	chrono::steady_clock::time_point firstBufferedTime;
+	long long syncCount = 0;
+	const char* syncError = nullptr;
+	bool isStopping = false;
+	thread syncThread;
+
+	static unsigned int GetChecksum(const char* data, size_t size) {
+		unsigned int checksum = 2166136261u;
+		for (size_t i = 0; i < size; i++)
+			checksum = (checksum ^ (unsigned char)data[i]) * 16777619u;
+		return checksum;
+	}
+
+	void AppendRecord(Operation operation, const TKey& key, int size, const void* payload, size_t payloadSize) {
+		lock_guard<mutex> lock(journalMutex);
+		ThrowSyncError();
+		size_t recordStart = buffer.size();
+		unsigned int bodySize = (unsigned int)(BodyHeaderSize + payloadSize);
+		buffer.resize(recordStart + RecordHeaderSize + bodySize);
+
+		char* body = buffer.data() + recordStart + RecordHeaderSize;
+		body[0] = (char)operation;
+		memcpy_s(body + 1, sizeof(TKey), &key, sizeof(TKey));
+		memcpy_s(body + 1 + sizeof(TKey), sizeof(int), &size, sizeof(int));
+		if (payloadSize != 0)
+			memcpy_s(body + BodyHeaderSize, payloadSize, payload, payloadSize);
+
+		unsigned int checksum = GetChecksum(body, bodySize);
+		memcpy_s(buffer.data() + recordStart, sizeof(unsigned int), &bodySize, sizeof(unsigned int));
+		memcpy_s(buffer.data() + recordStart + sizeof(unsigned int), sizeof(unsigned int), &checksum, sizeof(unsigned int));
+
+		if (bufferedRecords++ == 0) {
+			firstBufferedTime = chrono::steady_clock::now();
+			recordsBuffered.notify_one();
+		}
+		if (bufferedRecords >= options.SyncRecords)
+			SyncJournal();
+		else if (buffer.size() >= options.BufferSize)
+			Flush();
+		if (journal.GetSize() >= options.CompactionSize)
+			CompactJournal();
+	}
+
+	// The helpers below are called with journalMutex held
+	void ThrowSyncError() {
+		if (syncError != nullptr)
+			throw syncError;
+	}
+
+	void Flush() {
+		journal.Append(buffer.data(), buffer.size());
+		buffer.clear();
+	}
+
+	void SyncJournal() {
+		if (!buffer.empty())
+			Flush();
+		if (bufferedRecords != 0) {
+			journal.Sync();
+			syncCount++;
+		}
+		bufferedRecords = 0;
+	}
+
+	// Buffered records are already in the snapshot, so they are dropped rather than written
+	void CompactJournal() {
+		complexMap.SaveSnapshot(snapshotPath.c_str());
+		buffer.clear();
+		bufferedRecords = 0;
+		journal.Truncate(0);
+		journal.Sync();
+	}
+
+	// A failed sync stops the thread, the next call on the map throws its error
+	void RunSyncThread() {
+		unique_lock<mutex> lock(journalMutex);
+		while (!isStopping) {
+			if (bufferedRecords == 0) {
+				recordsBuffered.wait(lock);
+				continue;
+			}
+
+			chrono::steady_clock::time_point deadline = firstBufferedTime + chrono::milliseconds(options.SyncMilliseconds);
+			if (chrono::steady_clock::now() < deadline) {
+				recordsBuffered.wait_until(lock, deadline);
+				continue;
+			}
+
+			try {
+				SyncJournal();
+			}
+			catch (const char* error) {
+				syncError = error;
+				return;
+			}
+		}
+	}
+
+	bool ApplyRecord(const char* body, size_t bodySize, vector<TValue>* values) {
+		if (bodySize < BodyHeaderSize)
+			return false;
+
+		TKey key;
+		int size;
+		memcpy_s(&key, sizeof(TKey), body + 1, sizeof(TKey));
+		memcpy_s(&size, sizeof(int), body + 1 + sizeof(TKey), sizeof(int));
+		const char* payload = body + BodyHeaderSize;
+		size_t payloadSize = bodySize - BodyHeaderSize;
+
+		switch ((Operation)body[0]) {
+		case Operation::AddValue: {
+			if (payloadSize != sizeof(TValue))
+				return false;
+			TValue value;
+			memcpy_s(&value, sizeof(TValue), payload, sizeof(TValue));
+			complexMap.AddValueOrReplace(key, value);
+			return true;
+		}
+		case Operation::AddArray:
+			if (size < 0 || payloadSize != size * sizeof(TValue))
+				return false;
+			values->resize(size);
+			if (size != 0)
+				memcpy_s(values->data(), payloadSize, payload, payloadSize);
+			complexMap.AddArrayOrReplace(key, values->data(), size);
+			return true;
+		case Operation::AddString:
+			if (size < 0 || payloadSize != (size_t)size)
+				return false;
+			complexMap.AddStringOrReplace(key, payload, size);
+			return true;
+		case Operation::Remove:
+			if (payloadSize != 0)
+				return false;
+			complexMap.TryRemove(key);
+			return true;
+		case Operation::RemoveAll:
+			if (payloadSize != 0)
+				return false;
+			complexMap.RemoveAll();
+			return true;
+		}
+		return false;
+	}
+
+	// Stops at the first torn or corrupted record and cuts the journal there
+	void Replay() {
+		vector<char> content;
+		vector<TValue> values;
+		journal.ReadAll(&content);
+
+		size_t position = 0;
+		while (content.size() - position >= RecordHeaderSize) {
+			unsigned int bodySize;
+			unsigned int checksum;
+			memcpy_s(&bodySize, sizeof(unsigned int), content.data() + position, sizeof(unsigned int));
+			memcpy_s(&checksum, sizeof(unsigned int), content.data() + position + sizeof(unsigned int), sizeof(unsigned int));
+			const char* body = content.data() + position + RecordHeaderSize;
+			if (bodySize > content.size() - position - RecordHeaderSize || GetChecksum(body, bodySize) != checksum || !ApplyRecord(body, bodySize, &values))
+				break;
+
+			position += RecordHeaderSize + bodySize;
+		}
+
+		journal.Truncate(position);
+	}
+
+public:
+	JournaledComplexMap(const char* snapshotPath, const char* journalPath, JournalOptions options = JournalOptions())
+		: snapshotPath{ snapshotPath }, journal{ journalPath }, options{ options } {
+		if (ifstream(snapshotPath).good())
+			complexMap.LoadSnapshot(snapshotPath);
+		Replay();
+		if (options.SyncMilliseconds > 0)
+			syncThread = thread([this]() { RunSyncThread(); });
+	}
+
+	JournaledComplexMap(const JournaledComplexMap&) = delete;
+	JournaledComplexMap& operator=(const JournaledComplexMap&) = delete;
+
+	~JournaledComplexMap() {
+		if (syncThread.joinable()) {
+			{
+				lock_guard<mutex> lock(journalMutex);
+				isStopping = true;
+			}
+			recordsBuffered.notify_one();
+			syncThread.join();
+		}
+		try {
+			Sync();
+		}
+		catch (...) {
+		}
+	}
+
+	// Writes buffered records and waits until they reach the disk
+	void Sync() {
+		lock_guard<mutex> lock(journalMutex);
+		ThrowSyncError();
+		SyncJournal();
+		if (journal.GetSize() >= options.CompactionSize)
+			CompactJournal();
+	}
+
+	// Folds the journal into the snapshot, a crash at any point leaves a snapshot and journal that replay to the same map
+	void Compact() {
+		lock_guard<mutex> lock(journalMutex);
+		ThrowSyncError();
+		CompactJournal();
+	}
+
+	long long GetSyncCount() {
+		lock_guard<mutex> lock(journalMutex);
+		return syncCount;
+	}
+
+	unsigned long long GetJournalSize() {
+		lock_guard<mutex> lock(journalMutex);
+		return journal.GetSize() + buffer.size();
+	}
+
+	int GetSize() {
+		return complexMap.GetSize();
+	}
+
+	void AddValue(const TKey& key, TValue value) {
+		complexMap.AddValue(key, value);
+		AppendRecord(Operation::AddValue, key, 1, &value, sizeof(TValue));
+	}
+	void AddArray(const TKey& key, TValue* values, int size) {
+		complexMap.AddArray(key, values, size);
+		AppendRecord(Operation::AddArray, key, size, values, size * sizeof(TValue));
+	}
+	void AddString(const TKey& key, const char* line) {
+		complexMap.AddString(key, line);
+		AppendRecord(Operation::AddString, key, strlen(line), line, strlen(line));
+	}
+
+	bool TryAddValue(const TKey& key, TValue value) {
+		if (!complexMap.TryAddValue(key, value))
+			return false;
+
+		AppendRecord(Operation::AddValue, key, 1, &value, sizeof(TValue));
+		return true;
+	}
+	bool TryAddArray(const TKey& key, TValue* values, int size) {
+		if (!complexMap.TryAddArray(key, values, size))
+			return false;
+
+		AppendRecord(Operation::AddArray, key, size, values, size * sizeof(TValue));
+		return true;
+	}
+	bool TryAddString(const TKey& key, const char* line) {
+		if (!complexMap.TryAddString(key, line))
+			return false;
+
+		AppendRecord(Operation::AddString, key, strlen(line), line, strlen(line));
+		return true;
+	}
+
+	void AddValueOrReplace(const TKey& key, TValue value) {
+		complexMap.AddValueOrReplace(key, value);
+		AppendRecord(Operation::AddValue, key, 1, &value, sizeof(TValue));
+	}
+	void AddArrayOrReplace(const TKey& key, TValue* values, int size) {
+		complexMap.AddArrayOrReplace(key, values, size);
+		AppendRecord(Operation::AddArray, key, size, values, size * sizeof(TValue));
+	}
+	void AddStringOrReplace(const TKey& key, const char* line) {
+		complexMap.AddStringOrReplace(key, line);
+		AppendRecord(Operation::AddString, key, strlen(line), line, strlen(line));
+	}
+
+	TValue GetValue(LookupKey key) {
+		return complexMap.GetValue(key);
+	}
+	// Array and string pointers are read-only, a change made through them would bypass the journal
+	const TValue* GetArray(LookupKey key, int* size) {
+		return complexMap.GetArray(key, size);
+	}
+	const char* GetString(LookupKey key) {
+		return complexMap.GetString(key);
+	}
+
+	bool TryGetValue(LookupKey key, TValue* value) {
+		return complexMap.TryGetValue(key, value);
+	}
+	bool TryGetArray(LookupKey key, const TValue** values, int* size) {
+		return complexMap.TryGetArray(key, values, size);
+	}
+	bool TryGetString(LookupKey key, const char** line) {
+		return complexMap.TryGetString(key, line);
+	}
+
+	TValue GetOrAddValue(const TKey& key, TValue value) {
+		int oldSize = complexMap.GetSize();
+		TValue result = complexMap.GetOrAddValue(key, value);
+		if (complexMap.GetSize() != oldSize)
+			AppendRecord(Operation::AddValue, key, 1, &value, sizeof(TValue));
+		return result;
+	}
+	const TValue* GetOrAddArray(const TKey& key, int* resultSize, TValue* values, int size) {
+		int oldSize = complexMap.GetSize();
+		const TValue* result = complexMap.GetOrAddArray(key, resultSize, values, size);
+		if (complexMap.GetSize() != oldSize)
+			AppendRecord(Operation::AddArray, key, size, values, size * sizeof(TValue));
+		return result;
+	}
+	const char* GetOrAddString(const TKey& key, const char* line) {
+		int oldSize = complexMap.GetSize();
+		const char* result = complexMap.GetOrAddString(key, line);
+		if (complexMap.GetSize() != oldSize)
+			AppendRecord(Operation::AddString, key, strlen(line), line, strlen(line));
+		return result;
+	}
+
+	void Remove(const TKey& key) {
+		complexMap.Remove(key);
+		AppendRecord(Operation::Remove, key, 0, nullptr, 0);
+	}
+	bool TryRemove(const TKey& key) {
+		if (!complexMap.TryRemove(key))
+			return false;
+
+		AppendRecord(Operation::Remove, key, 0, nullptr, 0);
+		return true;
+	}
+	void RemoveAll() {
+		complexMap.RemoveAll();
+		AppendRecord(Operation::RemoveAll, TKey(), 0, nullptr, 0);
+	}
+};
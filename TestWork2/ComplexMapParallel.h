@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <exception>
+#include <algorithm>
+
+using namespace std;
+
+// Slices smaller than this are not worth a thread
+const size_t MinimumParallelSlice = 4096;
+
+inline size_t GetWorkerCount(size_t count) {
+	size_t workerCount = thread::hardware_concurrency();
+	size_t sliceLimit = count / MinimumParallelSlice;
+	if (workerCount > sliceLimit)
+		workerCount = sliceLimit;
+	return workerCount == 0 ? 1 : workerCount;
+}
+
+// Runs action(begin, end) over workerCount slices of [0, count), the calling thread takes the last slice.
+// Waits for every worker before rethrowing the first exception
+template <typename TAction>
+void ParallelFor(size_t count, size_t workerCount, TAction action) {
+	if (workerCount <= 1 || count <= 1) {
+		action((size_t)0, count);
+		return;
+	}
+
+	vector<thread> workers;
+	vector<exception_ptr> errors(workerCount);
+	auto runSlice = [&action, &errors, count, workerCount](size_t worker) {
+		try {
+			action(count * worker / workerCount, count * (worker + 1) / workerCount);
+		}
+		catch (...) {
+			errors[worker] = current_exception();
+		}
+	};
+	workers.reserve(workerCount - 1);
+	for (size_t worker = 0; worker + 1 < workerCount; worker++) {
+		try {
+			workers.emplace_back(runSlice, worker);
+		}
+		catch (...) {
+			// No thread to spare, the slice runs here
+			runSlice(worker);
+		}
+	}
+	runSlice(workerCount - 1);
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	for (size_t i = 0; i < errors.size(); i++)
+		if (errors[i] != nullptr)
+			rethrow_exception(errors[i]);
+}
+
+// Stable sorts slices on workers, then merges neighbouring runs pairwise until one is left
+template <typename TItem, typename TLess>
+void ParallelStableSort(vector<TItem>& items, TLess less) {
+	size_t sliceCount = GetWorkerCount(items.size());
+	if (sliceCount <= 1) {
+		stable_sort(items.begin(), items.end(), less);
+		return;
+	}
+
+	vector<size_t> bounds(sliceCount + 1);
+	for (size_t i = 0; i <= sliceCount; i++)
+		bounds[i] = items.size() * i / sliceCount;
+
+	ParallelFor(sliceCount, sliceCount, [&](size_t begin, size_t end) {
+		for (size_t slice = begin; slice < end; slice++)
+			stable_sort(items.begin() + bounds[slice], items.begin() + bounds[slice + 1], less);
+	});
+
+	for (size_t width = 1; width < sliceCount; width *= 2) {
+		size_t pairCount = (sliceCount + 2 * width - 1) / (2 * width);
+		ParallelFor(pairCount, pairCount, [&](size_t begin, size_t end) {
+			for (size_t run = begin; run < end; run++) {
+				size_t first = run * 2 * width;
+				size_t middle = first + width < sliceCount ? first + width : sliceCount;
+				size_t last = first + 2 * width < sliceCount ? first + 2 * width : sliceCount;
+				inplace_merge(items.begin() + bounds[first], items.begin() + bounds[middle], items.begin() + bounds[last], less);
+			}
+		});
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+using namespace std;
+
+// When removed and replaced entries are freed: at once, in batches on the map's thread, or on a background thread.
+// Outside Immediate, RemoveAll hands the whole index over instead of freeing it on the caller's thread
+enum class ReclaimMode {
+	Immediate,
+	Deferred,
+	Background
+};
+
+// A worker that runs reclamation tasks in the order they were posted, and finishes them all before it stops
+class ReclaimThread {
+	mutex tasksMutex;
+	condition_variable tasksChanged;
+	deque<function<void()>> tasks;
+	bool isBusy = false;
+	bool isStopping = false;
+	thread worker;
+
+	void Run() {
+		unique_lock<mutex> lock(tasksMutex);
+		while (true) {
+			tasksChanged.wait(lock, [this]() { return isStopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+
+			function<void()> task = move(tasks.front());
+			tasks.pop_front();
+			isBusy = true;
+			lock.unlock();
+			task();
+			lock.lock();
+			isBusy = false;
+			tasksChanged.notify_all();
+		}
+	}
+
+public:
+	ReclaimThread()
+		: worker([this]() { Run(); }) {
+	}
+
+	ReclaimThread(const ReclaimThread&) = delete;
+	ReclaimThread& operator=(const ReclaimThread&) = delete;
+
+	~ReclaimThread() {
+		{
+			lock_guard<mutex> lock(tasksMutex);
+			isStopping = true;
+		}
+		tasksChanged.notify_all();
+		worker.join();
+	}
+
+	void Post(function<void()> task) {
+		{
+			lock_guard<mutex> lock(tasksMutex);
+			tasks.push_back(move(task));
+		}
+		tasksChanged.notify_all();
+	}
+
+	// Returns once every task posted so far has run
+	void Wait() {
+		unique_lock<mutex> lock(tasksMutex);
+		tasksChanged.wait(lock, [this]() { return tasks.empty() && !isBusy; });
+	}
+};
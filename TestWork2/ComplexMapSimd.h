@@ -0,0 +1,499 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+
+// AVX2 kernels need /arch:AVX2 (or -mavx2), otherwise SSE2 is used where the target guarantees it
+#if defined(__AVX2__)
+#define COMPLEXMAP_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COMPLEXMAP_SSE2
+#endif
+#ifdef COMPLEXMAP_SSE2
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_IX86)
+#include <xmmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// A hint only, compiles to nothing where no prefetch instruction is available
+inline void PrefetchMemory(const void* address) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_prefetch((const char*)address, _MM_HINT_T0);
+#elif defined(__GNUC__)
+	__builtin_prefetch(address);
+#endif
+}
+
+// bits must not be 0
+inline int CountTrailingZeros(unsigned long long bits) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#elif defined(__GNUC__)
+	return __builtin_ctzll(bits);
+#else
+	int count = 0;
+	for (; (bits & 1) == 0; bits >>= 1)
+		count++;
+	return count;
+#endif
+}
+
+enum class ValueComparison {
+	Less,
+	LessOrEqual,
+	Greater,
+	GreaterOrEqual,
+	Equal,
+	NotEqual
+};
+
+template <typename TValue>
+void ScalarMinMax(const TValue* values, size_t count, TValue* minimum, TValue* maximum) {
+	for (size_t i = 0; i < count; i++) {
+		if (values[i] < *minimum)
+			*minimum = values[i];
+		if (*maximum < values[i])
+			*maximum = values[i];
+	}
+}
+
+template <typename TValue, typename TPredicate>
+size_t ScalarCountWhere(const TValue* values, size_t count, TPredicate predicate) {
+	size_t result = 0;
+	for (size_t i = 0; i < count; i++)
+		result += predicate(values[i]) ? 1 : 0;
+	return result;
+}
+
+template <typename TValue>
+size_t ScalarCount(const TValue* values, size_t count, ValueComparison comparison, TValue operand) {
+	switch (comparison) {
+	case ValueComparison::Less:
+		return ScalarCountWhere(values, count, [operand](TValue value) { return value < operand; });
+	case ValueComparison::LessOrEqual:
+		return ScalarCountWhere(values, count, [operand](TValue value) { return value <= operand; });
+	case ValueComparison::Greater:
+		return ScalarCountWhere(values, count, [operand](TValue value) { return value > operand; });
+	case ValueComparison::GreaterOrEqual:
+		return ScalarCountWhere(values, count, [operand](TValue value) { return value >= operand; });
+	case ValueComparison::Equal:
+		return ScalarCountWhere(values, count, [operand](TValue value) { return value == operand; });
+	default:
+		return ScalarCountWhere(values, count, [operand](TValue value) { return value != operand; });
+	}
+}
+
+// Aggregates over a dense column; the generic version is scalar, int, float and double have vector specializations
+template <typename TValue>
+struct ValueKernels {
+	typedef typename conditional<is_floating_point<TValue>::value, double,
+		typename conditional<is_signed<TValue>::value, long long, unsigned long long>::type>::type SumType;
+
+	static SumType Sum(const TValue* values, size_t count) {
+		SumType sum = 0;
+		for (size_t i = 0; i < count; i++)
+			sum += values[i];
+		return sum;
+	}
+
+	// count must not be 0
+	static void MinMax(const TValue* values, size_t count, TValue* minimum, TValue* maximum) {
+		*minimum = values[0];
+		*maximum = values[0];
+		ScalarMinMax(values + 1, count - 1, minimum, maximum);
+	}
+
+	static size_t Count(const TValue* values, size_t count, ValueComparison comparison, TValue operand) {
+		return ScalarCount(values, count, comparison, operand);
+	}
+};
+
+#ifdef COMPLEXMAP_SSE2
+
+inline size_t CountMaskBits(unsigned int mask) {
+	mask = mask - ((mask >> 1) & 0x55555555u);
+	mask = (mask & 0x33333333u) + ((mask >> 2) & 0x33333333u);
+	return (((mask + (mask >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+template <>
+struct ValueKernels<int> {
+	typedef long long SumType;
+
+#ifndef COMPLEXMAP_AVX2
+	// SSE2 has no pminsd/pmaxsd, so blend on a compare
+	static __m128i Minimum(__m128i first, __m128i second) {
+		__m128i greater = _mm_cmpgt_epi32(first, second);
+		return _mm_or_si128(_mm_and_si128(greater, second), _mm_andnot_si128(greater, first));
+	}
+
+	static __m128i Maximum(__m128i first, __m128i second) {
+		__m128i greater = _mm_cmpgt_epi32(first, second);
+		return _mm_or_si128(_mm_and_si128(greater, first), _mm_andnot_si128(greater, second));
+	}
+#endif
+
+	static long long Sum(const int* values, size_t count) {
+		size_t i = 0;
+		long long lanes[4];
+#ifdef COMPLEXMAP_AVX2
+		__m256i lowSum = _mm256_setzero_si256();
+		__m256i highSum = _mm256_setzero_si256();
+		for (; i + 8 <= count; i += 8) {
+			__m256i block = _mm256_loadu_si256((const __m256i*)(values + i));
+			lowSum = _mm256_add_epi64(lowSum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(block)));
+			highSum = _mm256_add_epi64(highSum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(block, 1)));
+		}
+		_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(lowSum, highSum));
+#else
+		// Widen to 64 bits by interleaving with the sign, so large columns cannot overflow
+		__m128i lowSum = _mm_setzero_si128();
+		__m128i highSum = _mm_setzero_si128();
+		for (; i + 4 <= count; i += 4) {
+			__m128i block = _mm_loadu_si128((const __m128i*)(values + i));
+			__m128i sign = _mm_srai_epi32(block, 31);
+			lowSum = _mm_add_epi64(lowSum, _mm_unpacklo_epi32(block, sign));
+			highSum = _mm_add_epi64(highSum, _mm_unpackhi_epi32(block, sign));
+		}
+		_mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(lowSum, highSum));
+		lanes[2] = lanes[3] = 0;
+#endif
+		long long sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for (; i < count; i++)
+			sum += values[i];
+		return sum;
+	}
+
+	static void MinMax(const int* values, size_t count, int* minimum, int* maximum) {
+		size_t i = 0;
+		int minimumLanes[8];
+		int maximumLanes[8];
+		int laneCount = 0;
+#ifdef COMPLEXMAP_AVX2
+		if (count >= 8) {
+			__m256i minimumBlock = _mm256_loadu_si256((const __m256i*)values);
+			__m256i maximumBlock = minimumBlock;
+			for (i = 8; i + 8 <= count; i += 8) {
+				__m256i block = _mm256_loadu_si256((const __m256i*)(values + i));
+				minimumBlock = _mm256_min_epi32(minimumBlock, block);
+				maximumBlock = _mm256_max_epi32(maximumBlock, block);
+			}
+			_mm256_storeu_si256((__m256i*)minimumLanes, minimumBlock);
+			_mm256_storeu_si256((__m256i*)maximumLanes, maximumBlock);
+			laneCount = 8;
+		}
+#else
+		if (count >= 4) {
+			__m128i minimumBlock = _mm_loadu_si128((const __m128i*)values);
+			__m128i maximumBlock = minimumBlock;
+			for (i = 4; i + 4 <= count; i += 4) {
+				__m128i block = _mm_loadu_si128((const __m128i*)(values + i));
+				minimumBlock = Minimum(minimumBlock, block);
+				maximumBlock = Maximum(maximumBlock, block);
+			}
+			_mm_storeu_si128((__m128i*)minimumLanes, minimumBlock);
+			_mm_storeu_si128((__m128i*)maximumLanes, maximumBlock);
+			laneCount = 4;
+		}
+#endif
+		*minimum = values[0];
+		*maximum = values[0];
+		ScalarMinMax(minimumLanes, laneCount, minimum, maximum);
+		ScalarMinMax(maximumLanes, laneCount, minimum, maximum);
+		ScalarMinMax(values + i, count - i, minimum, maximum);
+	}
+
+	static size_t Count(const int* values, size_t count, ValueComparison comparison, int operand) {
+		// Integers are totally ordered, so the inclusive and inequality forms are complements
+		switch (comparison) {
+		case ValueComparison::LessOrEqual:
+			return count - Count(values, count, ValueComparison::Greater, operand);
+		case ValueComparison::GreaterOrEqual:
+			return count - Count(values, count, ValueComparison::Less, operand);
+		case ValueComparison::NotEqual:
+			return count - Count(values, count, ValueComparison::Equal, operand);
+		default:
+			break;
+		}
+
+		size_t i = 0;
+		size_t result = 0;
+#ifdef COMPLEXMAP_AVX2
+		__m256i operandBlock = _mm256_set1_epi32(operand);
+		for (; i + 8 <= count; i += 8) {
+			__m256i block = _mm256_loadu_si256((const __m256i*)(values + i));
+			__m256i mask = comparison == ValueComparison::Less ? _mm256_cmpgt_epi32(operandBlock, block)
+				: comparison == ValueComparison::Greater ? _mm256_cmpgt_epi32(block, operandBlock)
+				: _mm256_cmpeq_epi32(block, operandBlock);
+			result += CountMaskBits((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+		}
+#else
+		__m128i operandBlock = _mm_set1_epi32(operand);
+		for (; i + 4 <= count; i += 4) {
+			__m128i block = _mm_loadu_si128((const __m128i*)(values + i));
+			__m128i mask = comparison == ValueComparison::Less ? _mm_cmplt_epi32(block, operandBlock)
+				: comparison == ValueComparison::Greater ? _mm_cmpgt_epi32(block, operandBlock)
+				: _mm_cmpeq_epi32(block, operandBlock);
+			result += CountMaskBits((unsigned int)_mm_movemask_ps(_mm_castsi128_ps(mask)));
+		}
+#endif
+		return result + ScalarCount(values + i, count - i, comparison, operand);
+	}
+};
+
+template <>
+struct ValueKernels<double> {
+	typedef double SumType;
+
+	static double Sum(const double* values, size_t count) {
+		size_t i = 0;
+		double lanes[4];
+#ifdef COMPLEXMAP_AVX2
+		__m256d blockSum = _mm256_setzero_pd();
+		for (; i + 4 <= count; i += 4)
+			blockSum = _mm256_add_pd(blockSum, _mm256_loadu_pd(values + i));
+		_mm256_storeu_pd(lanes, blockSum);
+#else
+		__m128d firstSum = _mm_setzero_pd();
+		__m128d secondSum = _mm_setzero_pd();
+		for (; i + 4 <= count; i += 4) {
+			firstSum = _mm_add_pd(firstSum, _mm_loadu_pd(values + i));
+			secondSum = _mm_add_pd(secondSum, _mm_loadu_pd(values + i + 2));
+		}
+		_mm_storeu_pd(lanes, firstSum);
+		_mm_storeu_pd(lanes + 2, secondSum);
+#endif
+		double sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for (; i < count; i++)
+			sum += values[i];
+		return sum;
+	}
+
+	static void MinMax(const double* values, size_t count, double* minimum, double* maximum) {
+		size_t i = 0;
+		double minimumLanes[4];
+		double maximumLanes[4];
+#ifdef COMPLEXMAP_AVX2
+		__m256d minimumBlock = _mm256_set1_pd(values[0]);
+		__m256d maximumBlock = minimumBlock;
+		for (; i + 4 <= count; i += 4) {
+			__m256d block = _mm256_loadu_pd(values + i);
+			minimumBlock = _mm256_min_pd(minimumBlock, block);
+			maximumBlock = _mm256_max_pd(maximumBlock, block);
+		}
+		_mm256_storeu_pd(minimumLanes, minimumBlock);
+		_mm256_storeu_pd(maximumLanes, maximumBlock);
+		int laneCount = 4;
+#else
+		__m128d minimumBlock = _mm_set1_pd(values[0]);
+		__m128d maximumBlock = minimumBlock;
+		for (; i + 2 <= count; i += 2) {
+			__m128d block = _mm_loadu_pd(values + i);
+			minimumBlock = _mm_min_pd(minimumBlock, block);
+			maximumBlock = _mm_max_pd(maximumBlock, block);
+		}
+		_mm_storeu_pd(minimumLanes, minimumBlock);
+		_mm_storeu_pd(maximumLanes, maximumBlock);
+		int laneCount = 2;
+#endif
+		*minimum = values[0];
+		*maximum = values[0];
+		ScalarMinMax(minimumLanes, laneCount, minimum, maximum);
+		ScalarMinMax(maximumLanes, laneCount, minimum, maximum);
+		ScalarMinMax(values + i, count - i, minimum, maximum);
+	}
+
+	static size_t Count(const double* values, size_t count, ValueComparison comparison, double operand) {
+		size_t i = 0;
+		size_t result = 0;
+		// NaN compares false except for NotEqual, same as the scalar operators
+#ifdef COMPLEXMAP_AVX2
+		__m256d operandBlock = _mm256_set1_pd(operand);
+		for (; i + 4 <= count; i += 4) {
+			__m256d block = _mm256_loadu_pd(values + i);
+			__m256d mask;
+			switch (comparison) {
+			case ValueComparison::Less: mask = _mm256_cmp_pd(block, operandBlock, _CMP_LT_OQ); break;
+			case ValueComparison::LessOrEqual: mask = _mm256_cmp_pd(block, operandBlock, _CMP_LE_OQ); break;
+			case ValueComparison::Greater: mask = _mm256_cmp_pd(block, operandBlock, _CMP_GT_OQ); break;
+			case ValueComparison::GreaterOrEqual: mask = _mm256_cmp_pd(block, operandBlock, _CMP_GE_OQ); break;
+			case ValueComparison::Equal: mask = _mm256_cmp_pd(block, operandBlock, _CMP_EQ_OQ); break;
+			default: mask = _mm256_cmp_pd(block, operandBlock, _CMP_NEQ_UQ); break;
+			}
+			result += CountMaskBits((unsigned int)_mm256_movemask_pd(mask));
+		}
+#else
+		__m128d operandBlock = _mm_set1_pd(operand);
+		for (; i + 2 <= count; i += 2) {
+			__m128d block = _mm_loadu_pd(values + i);
+			__m128d mask;
+			switch (comparison) {
+			case ValueComparison::Less: mask = _mm_cmplt_pd(block, operandBlock); break;
+			case ValueComparison::LessOrEqual: mask = _mm_cmple_pd(block, operandBlock); break;
+			case ValueComparison::Greater: mask = _mm_cmpgt_pd(block, operandBlock); break;
+			case ValueComparison::GreaterOrEqual: mask = _mm_cmpge_pd(block, operandBlock); break;
+			case ValueComparison::Equal: mask = _mm_cmpeq_pd(block, operandBlock); break;
+			default: mask = _mm_cmpneq_pd(block, operandBlock); break;
+			}
+			result += CountMaskBits((unsigned int)_mm_movemask_pd(mask));
+		}
+#endif
+		return result + ScalarCount(values + i, count - i, comparison, operand);
+	}
+};
+
+template <>
+struct ValueKernels<float> {
+	typedef double SumType;
+
+	static double Sum(const float* values, size_t count) {
+		size_t i = 0;
+		double lanes[4];
+		// Accumulate in double, like the scalar SumType
+#ifdef COMPLEXMAP_AVX2
+		__m256d lowSum = _mm256_setzero_pd();
+		__m256d highSum = _mm256_setzero_pd();
+		for (; i + 8 <= count; i += 8) {
+			__m256 block = _mm256_loadu_ps(values + i);
+			lowSum = _mm256_add_pd(lowSum, _mm256_cvtps_pd(_mm256_castps256_ps128(block)));
+			highSum = _mm256_add_pd(highSum, _mm256_cvtps_pd(_mm256_extractf128_ps(block, 1)));
+		}
+		_mm256_storeu_pd(lanes, _mm256_add_pd(lowSum, highSum));
+#else
+		__m128d lowSum = _mm_setzero_pd();
+		__m128d highSum = _mm_setzero_pd();
+		for (; i + 4 <= count; i += 4) {
+			__m128 block = _mm_loadu_ps(values + i);
+			lowSum = _mm_add_pd(lowSum, _mm_cvtps_pd(block));
+			highSum = _mm_add_pd(highSum, _mm_cvtps_pd(_mm_movehl_ps(block, block)));
+		}
+		_mm_storeu_pd(lanes, lowSum);
+		_mm_storeu_pd(lanes + 2, highSum);
+#endif
+		double sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for (; i < count; i++)
+			sum += values[i];
+		return sum;
+	}
+
+	static void MinMax(const float* values, size_t count, float* minimum, float* maximum) {
+		size_t i = 0;
+		float minimumLanes[8];
+		float maximumLanes[8];
+#ifdef COMPLEXMAP_AVX2
+		__m256 minimumBlock = _mm256_set1_ps(values[0]);
+		__m256 maximumBlock = minimumBlock;
+		for (; i + 8 <= count; i += 8) {
+			__m256 block = _mm256_loadu_ps(values + i);
+			minimumBlock = _mm256_min_ps(minimumBlock, block);
+			maximumBlock = _mm256_max_ps(maximumBlock, block);
+		}
+		_mm256_storeu_ps(minimumLanes, minimumBlock);
+		_mm256_storeu_ps(maximumLanes, maximumBlock);
+		int laneCount = 8;
+#else
+		__m128 minimumBlock = _mm_set1_ps(values[0]);
+		__m128 maximumBlock = minimumBlock;
+		for (; i + 4 <= count; i += 4) {
+			__m128 block = _mm_loadu_ps(values + i);
+			minimumBlock = _mm_min_ps(minimumBlock, block);
+			maximumBlock = _mm_max_ps(maximumBlock, block);
+		}
+		_mm_storeu_ps(minimumLanes, minimumBlock);
+		_mm_storeu_ps(maximumLanes, maximumBlock);
+		int laneCount = 4;
+#endif
+		*minimum = values[0];
+		*maximum = values[0];
+		ScalarMinMax(minimumLanes, laneCount, minimum, maximum);
+		ScalarMinMax(maximumLanes, laneCount, minimum, maximum);
+		ScalarMinMax(values + i, count - i, minimum, maximum);
+	}
+
+	static size_t Count(const float* values, size_t count, ValueComparison comparison, float operand) {
+		size_t i = 0;
+		size_t result = 0;
+#ifdef COMPLEXMAP_AVX2
+		__m256 operandBlock = _mm256_set1_ps(operand);
+		for (; i + 8 <= count; i += 8) {
+			__m256 block = _mm256_loadu_ps(values + i);
+			__m256 mask;
+			switch (comparison) {
+			case ValueComparison::Less: mask = _mm256_cmp_ps(block, operandBlock, _CMP_LT_OQ); break;
+			case ValueComparison::LessOrEqual: mask = _mm256_cmp_ps(block, operandBlock, _CMP_LE_OQ); break;
+			case ValueComparison::Greater: mask = _mm256_cmp_ps(block, operandBlock, _CMP_GT_OQ); break;
+			case ValueComparison::GreaterOrEqual: mask = _mm256_cmp_ps(block, operandBlock, _CMP_GE_OQ); break;
+			case ValueComparison::Equal: mask = _mm256_cmp_ps(block, operandBlock, _CMP_EQ_OQ); break;
+			default: mask = _mm256_cmp_ps(block, operandBlock, _CMP_NEQ_UQ); break;
+			}
+			result += CountMaskBits((unsigned int)_mm256_movemask_ps(mask));
+		}
+#else
+		__m128 operandBlock = _mm_set1_ps(operand);
+		for (; i + 4 <= count; i += 4) {
+			__m128 block = _mm_loadu_ps(values + i);
+			__m128 mask;
+			switch (comparison) {
+			case ValueComparison::Less: mask = _mm_cmplt_ps(block, operandBlock); break;
+			case ValueComparison::LessOrEqual: mask = _mm_cmple_ps(block, operandBlock); break;
+			case ValueComparison::Greater: mask = _mm_cmpgt_ps(block, operandBlock); break;
+			case ValueComparison::GreaterOrEqual: mask = _mm_cmpge_ps(block, operandBlock); break;
+			case ValueComparison::Equal: mask = _mm_cmpeq_ps(block, operandBlock); break;
+			default: mask = _mm_cmpneq_ps(block, operandBlock); break;
+			}
+			result += CountMaskBits((unsigned int)_mm_movemask_ps(mask));
+		}
+#endif
+		return result + ScalarCount(values + i, count - i, comparison, operand);
+	}
+};
+
+#endif
+
+// Turns zigzagged deltas back into values in place, starting from first. The generic version is scalar,
+// 32-bit deltas are decoded four at a time with an SSE2 prefix sum
+template <typename TUnsigned>
+struct DeltaKernels {
+	static void Decode(TUnsigned* deltas, size_t count, TUnsigned first) {
+		TUnsigned value = first;
+		for (size_t i = 0; i < count; i++) {
+			value = (TUnsigned)(value + ((deltas[i] >> 1) ^ (TUnsigned)(0 - (deltas[i] & 1))));
+			deltas[i] = value;
+		}
+	}
+};
+
+#ifdef COMPLEXMAP_SSE2
+
+template <>
+struct DeltaKernels<unsigned int> {
+	static void Decode(unsigned int* deltas, size_t count, unsigned int first) {
+		__m128i one = _mm_set1_epi32(1);
+		__m128i carry = _mm_set1_epi32((int)first);
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i block = _mm_loadu_si128((const __m128i*)(deltas + i));
+			block = _mm_xor_si128(_mm_srli_epi32(block, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(block, one)));
+			block = _mm_add_epi32(block, _mm_slli_si128(block, 4));
+			block = _mm_add_epi32(block, _mm_slli_si128(block, 8));
+			block = _mm_add_epi32(block, carry);
+			_mm_storeu_si128((__m128i*)(deltas + i), block);
+			carry = _mm_shuffle_epi32(block, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+		unsigned int value = i == 0 ? first : deltas[i - 1];
+		for (; i < count; i++) {
+			value += (deltas[i] >> 1) ^ (0u - (deltas[i] & 1));
+			deltas[i] = value;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,448 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "ComplexMapStorage.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// File layout: SnapshotHeader, payload region, index of SnapshotEntry sorted by key
+struct SnapshotHeader {
+	static const unsigned int CurrentVersion = 1;
+	static const size_t Alignment = 16;
+
+	char Magic[8];
+	unsigned int Version;
+	unsigned int KeySize;
+	unsigned int ValueSize;
+	unsigned int EntrySize;
+	unsigned long long EntryCount;
+	unsigned long long PayloadOffset;
+	unsigned long long PayloadSize;
+	unsigned long long IndexOffset;
+
+	static const char* GetMagic() {
+		return "CMAPSNAP";
+	}
+
+	static unsigned long long Align(unsigned long long offset) {
+		return (offset + Alignment - 1) / Alignment * Alignment;
+	}
+};
+
+template <typename TKey, typename TValue>
+struct SnapshotEntry {
+	TKey Key;
+	ValueKind Kind;
+	// Array length or string length without the terminator
+	int Size;
+	union {
+		TValue Value;
+		// Payload position relative to PayloadOffset
+		unsigned long long Offset;
+	};
+};
+
+// A file is written next to its target and renamed over it once complete, so a crash mid-write keeps the old file
+struct DurableFile {
+	static void Sync(const char* path) {
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		bool isSynced = file != INVALID_HANDLE_VALUE && FlushFileBuffers(file);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		int file = open(path, O_RDONLY);
+		bool isSynced = file != -1 && fsync(file) == 0;
+		if (file != -1)
+			close(file);
+#endif
+		if (!isSynced)
+			throw "Cannot sync file";
+	}
+
+	// On POSIX the rename itself reaches the disk only once the directory holding to is synced
+	static void RenameOver(const char* from, const char* to) {
+#ifdef _WIN32
+		if (!MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			throw "Cannot replace file";
+#else
+		if (rename(from, to) != 0)
+			throw "Cannot replace file";
+
+		string directory(to);
+		size_t separator = directory.find_last_of('/');
+		directory = separator == string::npos ? "." : directory.substr(0, separator == 0 ? 1 : separator);
+		int file = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+		bool isSynced = file != -1 && fsync(file) == 0;
+		if (file != -1)
+			close(file);
+		if (!isSynced)
+			throw "Cannot sync directory";
+#endif
+	}
+};
+
+template <typename TKey, typename TValue>
+class SnapshotWriter {
+	static_assert(is_trivially_copyable<TKey>::value && is_trivially_copyable<TValue>::value, "Snapshots need trivially copyable keys and values");
+
+	typedef SnapshotEntry<TKey, TValue> Entry;
+
+	string path;
+	string temporaryPath;
+	ofstream file;
+	vector<Entry> entries;
+	unsigned long long payloadSize = 0;
+	bool isFinished = false;
+
+	Entry& AddEntry(const TKey& key, ValueKind kind, int size) {
+		entries.emplace_back();
+		Entry& entry = entries.back();
+		memset(&entry, 0, sizeof(Entry));
+		entry.Key = key;
+		entry.Kind = kind;
+		entry.Size = size;
+		return entry;
+	}
+
+	void WritePadding(unsigned long long alignedSize) {
+		static const char padding[SnapshotHeader::Alignment] = {};
+		file.write(padding, alignedSize - payloadSize);
+		payloadSize = alignedSize;
+	}
+
+	unsigned long long WritePayload(const void* payload, size_t size) {
+		WritePadding(SnapshotHeader::Align(payloadSize));
+		unsigned long long offset = payloadSize;
+		file.write((const char*)payload, size);
+		payloadSize += size;
+		return offset;
+	}
+
+public:
+	// Writes to path.tmp, the file at path is replaced only by Finish
+	SnapshotWriter(const char* path, size_t entryCount)
+		: path{ path }, temporaryPath{ string(path) + ".tmp" }, file{ temporaryPath, ios::binary | ios::trunc } {
+		if (!file)
+			throw "Cannot create snapshot";
+
+		entries.reserve(entryCount);
+		// The header is written by Finish, payloads start at the aligned offset after it
+		static const char headerSpace[(sizeof(SnapshotHeader) + SnapshotHeader::Alignment - 1) / SnapshotHeader::Alignment * SnapshotHeader::Alignment] = {};
+		file.write(headerSpace, sizeof(headerSpace));
+	}
+
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+	// An unfinished snapshot leaves the file at path as it was
+	~SnapshotWriter() {
+		if (isFinished)
+			return;
+
+		file.close();
+		remove(temporaryPath.c_str());
+	}
+
+	void AddValue(const TKey& key, TValue value) {
+		AddEntry(key, ValueKind::Value, 1).Value = value;
+	}
+	void AddArray(const TKey& key, const TValue* values, int size) {
+		Entry& entry = AddEntry(key, ValueKind::Array, size);
+		entry.Offset = WritePayload(values, size * sizeof(TValue));
+	}
+	void AddString(const TKey& key, const char* line, int length) {
+		Entry& entry = AddEntry(key, ValueKind::String, length);
+		entry.Offset = WritePayload(line, length + 1);
+	}
+
+	// Entries must be added in ascending key order
+	void Finish() {
+		WritePadding(SnapshotHeader::Align(payloadSize));
+		file.write((const char*)entries.data(), entries.size() * sizeof(Entry));
+
+		SnapshotHeader header = {};
+		memcpy_s(header.Magic, sizeof(header.Magic), SnapshotHeader::GetMagic(), sizeof(header.Magic));
+		header.Version = SnapshotHeader::CurrentVersion;
+		header.KeySize = sizeof(TKey);
+		header.ValueSize = sizeof(TValue);
+		header.EntrySize = sizeof(Entry);
+		header.EntryCount = entries.size();
+		header.PayloadOffset = SnapshotHeader::Align(sizeof(SnapshotHeader));
+		header.PayloadSize = payloadSize;
+		header.IndexOffset = header.PayloadOffset + payloadSize;
+		file.seekp(0);
+		file.write((const char*)&header, sizeof(header));
+		file.close();
+		if (!file)
+			throw "Cannot write snapshot";
+
+		DurableFile::Sync(temporaryPath.c_str());
+		DurableFile::RenameOver(temporaryPath.c_str(), path.c_str());
+		isFinished = true;
+	}
+};
+
+class MappedFile {
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int file = -1;
+#endif
+	const char* data = nullptr;
+	size_t size = 0;
+
+	void Close() {
+#ifdef _WIN32
+		if (data != nullptr)
+			UnmapViewOfFile(data);
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if (data != nullptr)
+			munmap((void*)data, size);
+		if (file != -1)
+			close(file);
+#endif
+	}
+
+public:
+	MappedFile(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER fileSize;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			Close();
+			throw "Cannot open snapshot";
+		}
+
+		size = (size_t)fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping != nullptr)
+			data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		file = open(path, O_RDONLY);
+		struct stat fileStat;
+		if (file == -1 || fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+			Close();
+			throw "Cannot open snapshot";
+		}
+
+		size = (size_t)fileStat.st_size;
+		void* memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (memory != MAP_FAILED)
+			data = (const char*)memory;
+#endif
+		if (data == nullptr) {
+			Close();
+			throw "Cannot map snapshot";
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		Close();
+	}
+
+	const char* GetData() {
+		return data;
+	}
+
+	size_t GetSize() {
+		return size;
+	}
+};
+
+// Read-only map over a snapshot file, GetArray/GetString point into the mapping and stay valid for the map lifetime
+template <typename TKey, typename TValue>
+class MappedComplexMap {
+	static_assert(is_trivially_copyable<TKey>::value && is_trivially_copyable<TValue>::value, "Snapshots need trivially copyable keys and values");
+
+	typedef SnapshotEntry<TKey, TValue> Entry;
+
+	MappedFile file;
+	const SnapshotHeader* header;
+	const Entry* entries;
+	const char* payload;
+
+	// Entries are validated on access, so opening a snapshot does not touch the whole file
+	const Entry& ValidateEntry(const Entry& entry) {
+		if (entry.Kind == ValueKind::Value)
+			return entry;
+
+		if ((entry.Kind != ValueKind::Array && entry.Kind != ValueKind::String) || entry.Size < 0)
+			throw "Corrupted snapshot";
+
+		unsigned long long payloadSize = entry.Kind == ValueKind::Array ? (unsigned long long)entry.Size * sizeof(TValue) : (unsigned long long)entry.Size + 1;
+		if (entry.Offset > header->PayloadSize || payloadSize > header->PayloadSize - entry.Offset)
+			throw "Corrupted snapshot";
+		if (entry.Kind == ValueKind::String && payload[entry.Offset + entry.Size] != 0)
+			throw "Corrupted snapshot";
+
+		return entry;
+	}
+
+	const Entry* FindEntry(const TKey& key) {
+		const Entry* end = entries + header->EntryCount;
+		const Entry* entry = lower_bound(entries, end, key, [](const Entry& first, const TKey& second) { return first.Key < second; });
+		if (entry == end || key < entry->Key)
+			return nullptr;
+
+		return &ValidateEntry(*entry);
+	}
+
+	const Entry& GetEntry(const TKey& key) {
+		const Entry* entry = FindEntry(key);
+		if (entry == nullptr)
+			throw "Key not found";
+
+		return *entry;
+	}
+
+	const TValue* GetEntryArray(const Entry& entry, int* size) {
+		if (entry.Kind != ValueKind::Array)
+			throw "Invalid value type";
+
+		*size = entry.Size;
+		return (const TValue*)(payload + entry.Offset);
+	}
+
+	const char* GetEntryString(const Entry& entry) {
+		if (entry.Kind != ValueKind::String)
+			throw "Invalid value type";
+
+		return payload + entry.Offset;
+	}
+
+public:
+	MappedComplexMap(const char* path)
+		: file{ path } {
+		if (file.GetSize() < sizeof(SnapshotHeader))
+			throw "Invalid snapshot";
+
+		header = (const SnapshotHeader*)file.GetData();
+		if (memcmp(header->Magic, SnapshotHeader::GetMagic(), sizeof(header->Magic)) != 0 || header->Version != SnapshotHeader::CurrentVersion)
+			throw "Invalid snapshot";
+		if (header->KeySize != sizeof(TKey) || header->ValueSize != sizeof(TValue) || header->EntrySize != sizeof(Entry))
+			throw "Snapshot types mismatch";
+		if (header->PayloadOffset % SnapshotHeader::Alignment != 0 || header->IndexOffset % SnapshotHeader::Alignment != 0
+			|| header->PayloadOffset > file.GetSize() || header->PayloadSize > file.GetSize() - header->PayloadOffset
+			|| header->IndexOffset > file.GetSize() || header->EntryCount > (file.GetSize() - header->IndexOffset) / sizeof(Entry))
+			throw "Corrupted snapshot";
+
+		entries = (const Entry*)(file.GetData() + header->IndexOffset);
+		payload = file.GetData() + header->PayloadOffset;
+	}
+
+	MappedComplexMap(const MappedComplexMap&) = delete;
+	MappedComplexMap& operator=(const MappedComplexMap&) = delete;
+
+	int GetSize() {
+		return (int)header->EntryCount;
+	}
+
+	// Checks every entry and the key order up front, for callers that must not stop halfway through the entries
+	void Validate() {
+		for (unsigned long long i = 0; i < header->EntryCount; i++) {
+			ValidateEntry(entries[i]);
+			if (i != 0 && !(entries[i - 1].Key < entries[i].Key))
+				throw "Corrupted snapshot";
+		}
+	}
+
+	TValue GetValue(const TKey& key) {
+		const Entry& entry = GetEntry(key);
+		if (entry.Kind != ValueKind::Value)
+			throw "Invalid value type";
+
+		return entry.Value;
+	}
+	const TValue* GetArray(const TKey& key, int* size) {
+		return GetEntryArray(GetEntry(key), size);
+	}
+	const char* GetString(const TKey& key) {
+		return GetEntryString(GetEntry(key));
+	}
+	// Strings may hold zeros, length is the stored one
+	const char* GetString(const TKey& key, int* length) {
+		const Entry& entry = GetEntry(key);
+		const char* line = GetEntryString(entry);
+		*length = entry.Size;
+		return line;
+	}
+
+	bool TryGetValue(const TKey& key, TValue* value) {
+		const Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::Value)
+			return false;
+
+		*value = entry->Value;
+		return true;
+	}
+	bool TryGetArray(const TKey& key, const TValue** values, int* size) {
+		const Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::Array)
+			return false;
+
+		*values = GetEntryArray(*entry, size);
+		return true;
+	}
+	bool TryGetString(const TKey& key, const char** line) {
+		const Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::String)
+			return false;
+
+		*line = GetEntryString(*entry);
+		return true;
+	}
+
+	template <typename TAction>
+	void ForEachValue(TAction action) {
+		for (unsigned long long i = 0; i < header->EntryCount; i++)
+			if (ValidateEntry(entries[i]).Kind == ValueKind::Value)
+				action(entries[i].Key, entries[i].Value);
+	}
+	template <typename TAction>
+	void ForEachArray(TAction action) {
+		int size;
+		for (unsigned long long i = 0; i < header->EntryCount; i++)
+			if (ValidateEntry(entries[i]).Kind == ValueKind::Array)
+				action(entries[i].Key, GetEntryArray(entries[i], &size), entries[i].Size);
+	}
+	template <typename TAction>
+	void ForEachString(TAction action) {
+		ForEachStringWithLength([&](const TKey& key, const char* line, int length) { action(key, line); });
+	}
+	template <typename TAction>
+	void ForEachStringWithLength(TAction action) {
+		for (unsigned long long i = 0; i < header->EntryCount; i++)
+			if (ValidateEntry(entries[i]).Kind == ValueKind::String)
+				action(entries[i].Key, GetEntryString(entries[i]), entries[i].Size);
+	}
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include "ComplexMapStorage.h"
+
+using namespace std;
+
+enum class StatsOperation {
+	Lookup,
+	Insert,
+	Remove
+};
+
+// A copy of a map's counters. Allocations count created entries and AllocatedBytes their payload bytes, both indexed by ValueKind.
+// Latencies are sampled: bucket i counts operations that took from 2^i up to 2^(i+1) nanoseconds
+struct ComplexMapStats {
+	static const int KindCount = 4;
+	static const int OperationCount = 3;
+	static const int LatencyBucketCount = 32;
+
+	unsigned long long Hits;
+	unsigned long long Misses;
+	unsigned long long TypeMismatches;
+	unsigned long long DuplicateKeys;
+	unsigned long long Replaces;
+	unsigned long long Removes;
+	unsigned long long Allocations[KindCount];
+	unsigned long long AllocatedBytes[KindCount];
+	unsigned long long Latencies[OperationCount][LatencyBucketCount];
+
+	unsigned long long GetLatencySamples(StatsOperation operation) const {
+		unsigned long long samples = 0;
+		for (int i = 0; i < LatencyBucketCount; i++)
+			samples += Latencies[(int)operation][i];
+		return samples;
+	}
+};
+
+#ifdef COMPLEXMAP_STATS
+
+// Relaxed atomics: readers under a shared lock count concurrently, and nothing is ordered by the counters
+class StatsCounters {
+	typedef atomic<unsigned long long> Counter;
+
+public:
+	// One operation in SampleInterval per thread is timed
+	static const unsigned int SampleInterval = 64;
+
+	Counter Hits;
+	Counter Misses;
+	Counter TypeMismatches;
+	Counter DuplicateKeys;
+	Counter Replaces;
+	Counter Removes;
+	Counter Allocations[ComplexMapStats::KindCount];
+	Counter AllocatedBytes[ComplexMapStats::KindCount];
+	Counter Latencies[ComplexMapStats::OperationCount][ComplexMapStats::LatencyBucketCount];
+
+	StatsCounters() {
+		Reset();
+	}
+
+	static void Add(Counter& counter, unsigned long long amount) {
+		counter.fetch_add(amount, memory_order_relaxed);
+	}
+
+	static bool Sample() {
+		static thread_local unsigned int operationCount = 0;
+		return ++operationCount % SampleInterval == 0;
+	}
+
+	void AddLatency(StatsOperation operation, long long nanoseconds) {
+		int bucket = 0;
+		while (nanoseconds > 1 && bucket < ComplexMapStats::LatencyBucketCount - 1) {
+			nanoseconds >>= 1;
+			bucket++;
+		}
+		Add(Latencies[(int)operation][bucket], 1);
+	}
+
+	ComplexMapStats Read() {
+		ComplexMapStats stats;
+		stats.Hits = Hits.load(memory_order_relaxed);
+		stats.Misses = Misses.load(memory_order_relaxed);
+		stats.TypeMismatches = TypeMismatches.load(memory_order_relaxed);
+		stats.DuplicateKeys = DuplicateKeys.load(memory_order_relaxed);
+		stats.Replaces = Replaces.load(memory_order_relaxed);
+		stats.Removes = Removes.load(memory_order_relaxed);
+		for (int i = 0; i < ComplexMapStats::KindCount; i++) {
+			stats.Allocations[i] = Allocations[i].load(memory_order_relaxed);
+			stats.AllocatedBytes[i] = AllocatedBytes[i].load(memory_order_relaxed);
+		}
+		for (int i = 0; i < ComplexMapStats::OperationCount; i++)
+			for (int j = 0; j < ComplexMapStats::LatencyBucketCount; j++)
+				stats.Latencies[i][j] = Latencies[i][j].load(memory_order_relaxed);
+		return stats;
+	}
+
+	void Reset() {
+		Hits.store(0, memory_order_relaxed);
+		Misses.store(0, memory_order_relaxed);
+		TypeMismatches.store(0, memory_order_relaxed);
+		DuplicateKeys.store(0, memory_order_relaxed);
+		Replaces.store(0, memory_order_relaxed);
+		Removes.store(0, memory_order_relaxed);
+		for (int i = 0; i < ComplexMapStats::KindCount; i++) {
+			Allocations[i].store(0, memory_order_relaxed);
+			AllocatedBytes[i].store(0, memory_order_relaxed);
+		}
+		for (int i = 0; i < ComplexMapStats::OperationCount; i++)
+			for (int j = 0; j < ComplexMapStats::LatencyBucketCount; j++)
+				Latencies[i][j].store(0, memory_order_relaxed);
+	}
+};
+
+class StatsTimer {
+	StatsCounters& counters;
+	StatsOperation operation;
+	bool isSampled;
+	chrono::steady_clock::time_point start;
+
+public:
+	StatsTimer(StatsCounters& counters, StatsOperation operation) : counters(counters), operation(operation), isSampled(StatsCounters::Sample()) {
+		if (isSampled)
+			start = chrono::steady_clock::now();
+	}
+
+	StatsTimer(const StatsTimer&) = delete;
+	StatsTimer& operator=(const StatsTimer&) = delete;
+
+	~StatsTimer() {
+		if (isSampled)
+			counters.AddLatency(operation, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+	}
+};
+
+// Both expect a StatsCounters member named stats
+#define COMPLEXMAP_STATS_ADD(counter, amount) StatsCounters::Add(stats.counter, amount)
+#define COMPLEXMAP_STATS_TIME(operation) StatsTimer statsTimer(stats, StatsOperation::operation)
+
+#else
+
+#define COMPLEXMAP_STATS_ADD(counter, amount) ((void)0)
+#define COMPLEXMAP_STATS_TIME(operation) ((void)0)
+
+#endif
@@ -0,0 +1,997 @@
+#pragma once
+
+#include <new>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include "ComplexMapSimd.h"
+#include "ComplexMapAllocator.h"
+#include "ComplexMapCompression.h"
+#include "ComplexMapIntern.h"
+
+using namespace std;
+
+enum class ValueKind : unsigned char {
+	None,
+	Value,
+	Array,
+	String
+};
+
+// Array and string sizes are kept as int, longer payloads are refused before the size narrows
+template <typename TContainer>
+void CheckPayloadSize(const TContainer& payload) {
+	if (payload.size() > (size_t)INT_MAX)
+		throw "Payload is too large";
+}
+
+struct HeapStorage {
+	template <typename TValue, typename TAllocator>
+	class Type {
+		static const int InlineArraySize = sizeof(TValue) < 16 ? 16 / sizeof(TValue) : 1;
+		static const int InlineStringSize = 24;
+
+		class ValueType {
+		public:
+			ValueKind Kind;
+
+			ValueType(ValueKind kind)
+				: Kind{ kind } {
+			}
+
+			virtual ~ValueType() = 0;
+			virtual size_t GetNodeSize() = 0;
+			virtual void FreePayload(TAllocator& allocator) = 0;
+
+			virtual bool HasExternalPayload() {
+				return false;
+			}
+
+			virtual bool IsInterned() {
+				return false;
+			}
+		};
+
+		class SingleValueType : public ValueType {
+		public:
+			TValue Value;
+
+			SingleValueType(TValue value)
+				: ValueType(ValueKind::Value), Value{ value } {
+			}
+
+			virtual ~SingleValueType() {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(SingleValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+			}
+		};
+
+		class ArrayValueType : public ValueType {
+		public:
+			TValue* Values;
+			int Size;
+			TValue InlineValues[InlineArraySize];
+
+			ArrayValueType(TAllocator& allocator, const TValue* values, int size)
+				: ValueType(ValueKind::Array), Size{ size } {
+				Values = size <= InlineArraySize ? InlineValues : (TValue*)allocator.Allocate(size * sizeof(TValue));
+				memcpy_s(Values, size * sizeof(TValue), values, size * sizeof(TValue));
+			}
+
+			ArrayValueType(TValue* values, int size)
+				: ValueType(ValueKind::Array), Values{ values }, Size{ size } {
+			}
+
+			virtual ~ArrayValueType() {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(ArrayValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+				if (Values != InlineValues)
+					allocator.Free(Values, Size * sizeof(TValue));
+			}
+
+			virtual vector<TValue>* GetVector() {
+				return nullptr;
+			}
+
+			virtual CompressedArray<TValue>* GetCompressed() {
+				return nullptr;
+			}
+		};
+
+		class AdoptedArrayValueType : public ArrayValueType {
+		public:
+			AdoptedArrayValueType(unique_ptr<TValue[]> values, int size)
+				: ArrayValueType(values.release(), size) {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(AdoptedArrayValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+				delete[] this->Values;
+			}
+
+			virtual bool HasExternalPayload() {
+				return true;
+			}
+		};
+
+		class VectorArrayValueType : public ArrayValueType {
+		public:
+			vector<TValue> Vector;
+
+			VectorArrayValueType(vector<TValue>&& values)
+				: ArrayValueType(nullptr, (int)values.size()), Vector{ move(values) } {
+				this->Values = Vector.data();
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(VectorArrayValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+			}
+
+			virtual bool HasExternalPayload() {
+				return true;
+			}
+
+			virtual vector<TValue>* GetVector() {
+				return &Vector;
+			}
+		};
+
+		// Values points into the pool and is shared with every entry holding the same array
+		class InternedArrayValueType : public ArrayValueType {
+		public:
+			InternPool* Pool;
+
+			InternedArrayValueType(InternPool& pool, const TValue* values, int size)
+				: ArrayValueType((TValue*)pool.Acquire((const char*)values, size * sizeof(TValue)), size), Pool{ &pool } {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(InternedArrayValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+				Pool->Release((const char*)this->Values, this->Size * sizeof(TValue));
+			}
+
+			virtual bool HasExternalPayload() {
+				return true;
+			}
+
+			virtual bool IsInterned() {
+				return true;
+			}
+		};
+
+		// Values stays null, GetArray decodes the array into the decode cache instead. That copy is only read,
+		// GetGrowableArray turns the entry plain before it changes
+		class CompressedArrayValueType : public ArrayValueType {
+		public:
+			CompressedArray<TValue> Compressed;
+
+			CompressedArrayValueType(const TValue* values, int size)
+				: ArrayValueType(nullptr, size), Compressed(values, size) {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(CompressedArrayValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+			}
+
+			virtual bool HasExternalPayload() {
+				return true;
+			}
+
+			virtual CompressedArray<TValue>* GetCompressed() {
+				return &Compressed;
+			}
+		};
+
+		class StringValueType : public ValueType {
+		public:
+			char* Line;
+			int Length;
+			char InlineLine[InlineStringSize];
+
+			StringValueType(TAllocator& allocator, const char* line, int length)
+				: ValueType(ValueKind::String), Length{ length } {
+				Line = length + 1 <= InlineStringSize ? InlineLine : (char*)allocator.Allocate(length + 1);
+				memcpy_s(Line, length + 1, line, length);
+				Line[length] = 0;
+			}
+
+			StringValueType(char* line, int length)
+				: ValueType(ValueKind::String), Line{ line }, Length{ length } {
+			}
+
+			virtual ~StringValueType() {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(StringValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+				if (Line != InlineLine)
+					allocator.Free(Line, Length + 1);
+			}
+
+			virtual string* GetText() {
+				return nullptr;
+			}
+		};
+
+		class InternedStringValueType : public StringValueType {
+		public:
+			InternPool* Pool;
+
+			InternedStringValueType(InternPool& pool, const char* line, int length)
+				: StringValueType((char*)pool.Acquire(line, length), length), Pool{ &pool } {
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(InternedStringValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+				Pool->Release(this->Line, this->Length);
+			}
+
+			virtual bool HasExternalPayload() {
+				return true;
+			}
+
+			virtual bool IsInterned() {
+				return true;
+			}
+		};
+
+		class OwnedStringValueType : public StringValueType {
+		public:
+			string Text;
+
+			OwnedStringValueType(string&& line)
+				: StringValueType(nullptr, (int)line.size()), Text{ move(line) } {
+				this->Line = &Text[0];
+			}
+
+			virtual size_t GetNodeSize() {
+				return sizeof(OwnedStringValueType);
+			}
+
+			virtual void FreePayload(TAllocator& allocator) {
+			}
+
+			virtual bool HasExternalPayload() {
+				return true;
+			}
+
+			virtual string* GetText() {
+				return &Text;
+			}
+		};
+
+		TAllocator allocator;
+		// Atomic: Destroy may run on a reclaim thread while the map creates entries
+		atomic<int> externalPayloads{ 0 };
+		InterningMode interning = InterningMode::None;
+		InternPool stringPool;
+		InternPool arrayPool;
+
+	public:
+		static const bool SharesItems = false;
+		static const bool CompressesArrays = true;
+		static const bool InternsPayloads = true;
+
+		typedef ValueType* Item;
+
+		Item CreateValue(TValue value) {
+			return new (allocator.Allocate(sizeof(SingleValueType))) SingleValueType(value);
+		}
+		Item CreateArray(const TValue* values, int size) {
+			if (interning == InterningMode::StringsAndArrays) {
+				externalPayloads++;
+				return new (allocator.Allocate(sizeof(InternedArrayValueType))) InternedArrayValueType(arrayPool, values, size);
+			}
+			return new (allocator.Allocate(sizeof(ArrayValueType))) ArrayValueType(allocator, values, size);
+		}
+		Item CreateString(const char* line) {
+			return CreateString(line, strlen(line));
+		}
+		Item CreateString(const char* line, int length) {
+			if (interning != InterningMode::None) {
+				externalPayloads++;
+				return new (allocator.Allocate(sizeof(InternedStringValueType))) InternedStringValueType(stringPool, line, length);
+			}
+			return new (allocator.Allocate(sizeof(StringValueType))) StringValueType(allocator, line, length);
+		}
+
+		Item CreateArray(unique_ptr<TValue[]> values, int size) {
+			externalPayloads++;
+			return new (allocator.Allocate(sizeof(AdoptedArrayValueType))) AdoptedArrayValueType(move(values), size);
+		}
+		Item CreateArray(vector<TValue>&& values) {
+			CheckPayloadSize(values);
+			externalPayloads++;
+			return new (allocator.Allocate(sizeof(VectorArrayValueType))) VectorArrayValueType(move(values));
+		}
+		Item CreateString(string&& line) {
+			CheckPayloadSize(line);
+			externalPayloads++;
+			return new (allocator.Allocate(sizeof(OwnedStringValueType))) OwnedStringValueType(move(line));
+		}
+
+		// Falls back to a plain array when compression would not make it smaller
+		Item CreateCompressedArray(const TValue* values, int size) {
+			CompressedArrayValueType* arrayValue = new (allocator.Allocate(sizeof(CompressedArrayValueType))) CompressedArrayValueType(values, size);
+			externalPayloads++;
+			Item item = arrayValue;
+			if (arrayValue->Compressed.GetCompressedBytes() < arrayValue->Compressed.GetRawBytes())
+				return item;
+
+			Destroy(item);
+			return CreateArray(values, size);
+		}
+
+		void Destroy(Item& item) {
+			if (item->HasExternalPayload())
+				externalPayloads--;
+
+			size_t nodeSize = item->GetNodeSize();
+			item->FreePayload(allocator);
+			item->~ValueType();
+			allocator.Free(item, nodeSize);
+			item = nullptr;
+		}
+
+		bool ReleasesAll() {
+			return TAllocator::ReleasesAll && externalPayloads == 0;
+		}
+
+		void Release() {
+			allocator.Release();
+			externalPayloads = 0;
+		}
+
+		void Prefetch(Item& item) {
+			PrefetchMemory(item);
+		}
+
+		// Only the payloads copied in from then on are pooled: adopted and moved-in payloads stay as they are,
+		// and an interned payload that grows gets a copy of its own
+		void SetInterning(InterningMode mode) {
+			interning = mode;
+		}
+
+		bool IsInterned(Item& item) {
+			return item->IsInterned();
+		}
+
+		// Pooled payloads count once here rather than with every entry sharing them
+		void AddPoolMemoryUsage(MemoryUsage& usage) {
+			usage.StringPayloads += stringPool.GetBytes();
+			usage.ArrayPayloads += arrayPool.GetBytes() - arrayPool.GetBufferCount();
+		}
+
+		// Short arrays and strings that live inside the node count as header
+		void AddMemoryUsage(Item& item, MemoryUsage& usage) {
+			size_t nodeSize = item->GetNodeSize();
+			usage.Headers += nodeSize;
+			if (item->IsInterned())
+				return;
+			if (item->Kind == ValueKind::Array) {
+				ArrayValueType* arrayValue = static_cast<ArrayValueType*>(item);
+				CompressedArray<TValue>* compressed = arrayValue->GetCompressed();
+				if (compressed != nullptr)
+					usage.ArrayPayloads += compressed->GetCompressedBytes();
+				else if (arrayValue->Values != arrayValue->InlineValues)
+					usage.ArrayPayloads += arrayValue->Size * sizeof(TValue);
+				vector<TValue>* values = arrayValue->GetVector();
+				if (values != nullptr)
+					usage.Slack += (values->capacity() - values->size()) * sizeof(TValue);
+			}
+			else if (item->Kind == ValueKind::String) {
+				StringValueType* stringValue = static_cast<StringValueType*>(item);
+				char* node = (char*)item;
+				if (!less<char*>()(stringValue->Line, node) && less<char*>()(stringValue->Line, node + nodeSize))
+					return;
+
+				usage.StringPayloads += stringValue->Length + 1;
+				string* text = stringValue->GetText();
+				if (text != nullptr)
+					usage.Slack += text->capacity() - text->size();
+			}
+		}
+
+		ValueKind GetKind(Item& item) {
+			return item->Kind;
+		}
+
+		TValue* GetValue(Item& item) {
+			if (item->Kind != ValueKind::Value)
+				return nullptr;
+
+			return &static_cast<SingleValueType*>(item)->Value;
+		}
+		bool GetArray(Item& item, TValue** values, int* size) {
+			if (item->Kind != ValueKind::Array)
+				return false;
+
+			ArrayValueType* arrayValue = static_cast<ArrayValueType*>(item);
+			CompressedArray<TValue>* compressed = arrayValue->GetCompressed();
+			*values = compressed != nullptr ? compressed->DecodeCached() : arrayValue->Values;
+			*size = arrayValue->Size;
+			return true;
+		}
+		const CompressedArray<TValue>* GetCompressedArray(Item& item) {
+			if (item->Kind != ValueKind::Array)
+				return nullptr;
+
+			return static_cast<ArrayValueType*>(item)->GetCompressed();
+		}
+		char* GetString(Item& item) {
+			if (item->Kind != ValueKind::String)
+				return nullptr;
+
+			return static_cast<StringValueType*>(item)->Line;
+		}
+		// Only for strings, the length may count zeros inside the string
+		int GetStringLength(Item& item) {
+			return static_cast<StringValueType*>(item)->Length;
+		}
+
+		// An array or string that grows moves once into a vector or string node, which then grows geometrically.
+		// Call UpdateArray/UpdateString after changing the returned container
+		vector<TValue>* GetGrowableArray(Item& item) {
+			if (item->Kind != ValueKind::Array)
+				return nullptr;
+
+			ArrayValueType* arrayValue = static_cast<ArrayValueType*>(item);
+			if (arrayValue->GetVector() == nullptr) {
+				TValue* values;
+				int size;
+				GetArray(item, &values, &size);
+				Item grownItem = CreateArray(vector<TValue>(values, values + size));
+				Destroy(item);
+				item = grownItem;
+			}
+			return static_cast<ArrayValueType*>(item)->GetVector();
+		}
+		void UpdateArray(Item& item) {
+			VectorArrayValueType* arrayValue = static_cast<VectorArrayValueType*>(item);
+			arrayValue->Values = arrayValue->Vector.data();
+			CheckPayloadSize(arrayValue->Vector);
+			arrayValue->Size = (int)arrayValue->Vector.size();
+		}
+
+		string* GetGrowableString(Item& item) {
+			if (item->Kind != ValueKind::String)
+				return nullptr;
+
+			StringValueType* stringValue = static_cast<StringValueType*>(item);
+			if (stringValue->GetText() == nullptr) {
+				Item grownItem = CreateString(string(stringValue->Line, stringValue->Length));
+				Destroy(item);
+				item = grownItem;
+			}
+			return static_cast<StringValueType*>(item)->GetText();
+		}
+		void UpdateString(Item& item) {
+			OwnedStringValueType* stringValue = static_cast<OwnedStringValueType*>(item);
+			stringValue->Line = &stringValue->Text[0];
+			CheckPayloadSize(stringValue->Text);
+			stringValue->Length = (int)stringValue->Text.size();
+		}
+
+		// Moves a grown array or string back into a node sized to its contents; false for single values
+		bool ShrinkToFit(Item& item) {
+			if (item->Kind == ValueKind::Value)
+				return false;
+
+			if (item->Kind == ValueKind::Array) {
+				ArrayValueType* arrayValue = static_cast<ArrayValueType*>(item);
+				if (arrayValue->GetVector() != nullptr) {
+					Item compactItem = CreateArray(arrayValue->Values, arrayValue->Size);
+					Destroy(item);
+					item = compactItem;
+				}
+			}
+			else {
+				StringValueType* stringValue = static_cast<StringValueType*>(item);
+				if (stringValue->GetText() != nullptr) {
+					Item compactItem = CreateString(stringValue->Line, stringValue->Length);
+					Destroy(item);
+					item = compactItem;
+				}
+			}
+			return true;
+		}
+	};
+};
+
+template <typename TValue, typename TAllocator>
+HeapStorage::Type<TValue, TAllocator>::ValueType::~ValueType() {}
+
+struct InlineStorage {
+	enum class PayloadOwner : unsigned char {
+		Allocator,
+		Array,
+		Vector,
+		String
+	};
+
+	template <typename TValue, typename TAllocator>
+	class Type {
+		TAllocator allocator;
+		atomic<int> externalPayloads{ 0 };
+
+	public:
+		static const bool SharesItems = false;
+		static const bool CompressesArrays = false;
+		static const bool InternsPayloads = false;
+
+		class Entry {
+		public:
+			ValueKind Kind;
+			PayloadOwner Owner;
+			int Size;
+			union {
+				TValue Value;
+				TValue* Values;
+				char* Line;
+				vector<TValue>* Vector;
+				string* Text;
+			};
+
+			Entry()
+				: Kind{ ValueKind::None }, Owner{ PayloadOwner::Allocator }, Size{ 0 }, Values{ nullptr } {
+			}
+		};
+
+		typedef Entry Item;
+
+		Item CreateValue(TValue value) {
+			Entry entry;
+			entry.Kind = ValueKind::Value;
+			entry.Value = value;
+			return entry;
+		}
+		Item CreateArray(const TValue* values, int size) {
+			Entry entry;
+			entry.Kind = ValueKind::Array;
+			entry.Size = size;
+			entry.Values = (TValue*)allocator.Allocate(size * sizeof(TValue));
+			memcpy_s(entry.Values, size * sizeof(TValue), values, size * sizeof(TValue));
+			return entry;
+		}
+		Item CreateString(const char* line) {
+			return CreateString(line, strlen(line));
+		}
+		Item CreateString(const char* line, int length) {
+			Entry entry;
+			entry.Kind = ValueKind::String;
+			entry.Size = length;
+			entry.Line = (char*)allocator.Allocate(length + 1);
+			memcpy_s(entry.Line, length + 1, line, length);
+			entry.Line[length] = 0;
+			return entry;
+		}
+
+		Item CreateArray(unique_ptr<TValue[]> values, int size) {
+			Entry entry;
+			entry.Kind = ValueKind::Array;
+			entry.Owner = PayloadOwner::Array;
+			entry.Size = size;
+			entry.Values = values.release();
+			externalPayloads++;
+			return entry;
+		}
+		Item CreateArray(vector<TValue>&& values) {
+			CheckPayloadSize(values);
+			Entry entry;
+			entry.Kind = ValueKind::Array;
+			entry.Owner = PayloadOwner::Vector;
+			entry.Size = (int)values.size();
+			entry.Vector = new vector<TValue>(move(values));
+			externalPayloads++;
+			return entry;
+		}
+		Item CreateString(string&& line) {
+			CheckPayloadSize(line);
+			Entry entry;
+			entry.Kind = ValueKind::String;
+			entry.Owner = PayloadOwner::String;
+			entry.Size = (int)line.size();
+			entry.Text = new string(move(line));
+			externalPayloads++;
+			return entry;
+		}
+
+		void Destroy(Item& item) {
+			if (item.Owner == PayloadOwner::Array) {
+				delete[] item.Values;
+				externalPayloads--;
+			}
+			else if (item.Owner == PayloadOwner::Vector) {
+				delete item.Vector;
+				externalPayloads--;
+			}
+			else if (item.Owner == PayloadOwner::String) {
+				delete item.Text;
+				externalPayloads--;
+			}
+			else if (item.Kind == ValueKind::Array)
+				allocator.Free(item.Values, item.Size * sizeof(TValue));
+			else if (item.Kind == ValueKind::String)
+				allocator.Free(item.Line, item.Size + 1);
+			item = Entry();
+		}
+
+		bool ReleasesAll() {
+			return TAllocator::ReleasesAll && externalPayloads == 0;
+		}
+
+		void Release() {
+			allocator.Release();
+			externalPayloads = 0;
+		}
+
+		// Values and payload pointers are inline, reading them needs no other line
+		void Prefetch(Item& item) {
+		}
+
+		bool IsInterned(Item& item) {
+			return false;
+		}
+
+		void AddPoolMemoryUsage(MemoryUsage& usage) {
+		}
+
+		// Entries are counted with the index, only owned vectors and strings add a header of their own
+		void AddMemoryUsage(Item& item, MemoryUsage& usage) {
+			if (item.Kind == ValueKind::Array) {
+				usage.ArrayPayloads += item.Size * sizeof(TValue);
+				if (item.Owner == PayloadOwner::Vector) {
+					usage.Headers += sizeof(vector<TValue>);
+					usage.Slack += (item.Vector->capacity() - item.Size) * sizeof(TValue);
+				}
+			}
+			else if (item.Kind == ValueKind::String) {
+				if (item.Owner != PayloadOwner::String) {
+					usage.StringPayloads += item.Size + 1;
+					return;
+				}
+
+				usage.Headers += sizeof(string);
+				char* text = (char*)item.Text;
+				if (!less<char*>()(&(*item.Text)[0], text) && less<char*>()(&(*item.Text)[0], text + sizeof(string)))
+					return;
+
+				usage.StringPayloads += item.Size + 1;
+				usage.Slack += item.Text->capacity() - item.Size;
+			}
+		}
+
+		ValueKind GetKind(Item& item) {
+			return item.Kind;
+		}
+
+		TValue* GetValue(Item& item) {
+			if (item.Kind != ValueKind::Value)
+				return nullptr;
+
+			return &item.Value;
+		}
+		bool GetArray(Item& item, TValue** values, int* size) {
+			if (item.Kind != ValueKind::Array)
+				return false;
+
+			*values = item.Owner == PayloadOwner::Vector ? item.Vector->data() : item.Values;
+			*size = item.Size;
+			return true;
+		}
+		const CompressedArray<TValue>* GetCompressedArray(Item& item) {
+			return nullptr;
+		}
+		char* GetString(Item& item) {
+			if (item.Kind != ValueKind::String)
+				return nullptr;
+
+			return item.Owner == PayloadOwner::String ? &(*item.Text)[0] : item.Line;
+		}
+		int GetStringLength(Item& item) {
+			return item.Size;
+		}
+
+		// An array or string that grows moves once into an owned vector or string, which then grows geometrically.
+		// Call UpdateArray/UpdateString after changing the returned container
+		vector<TValue>* GetGrowableArray(Item& item) {
+			if (item.Kind != ValueKind::Array)
+				return nullptr;
+
+			if (item.Owner != PayloadOwner::Vector) {
+				Item grownItem = CreateArray(vector<TValue>(item.Values, item.Values + item.Size));
+				Destroy(item);
+				item = grownItem;
+			}
+			return item.Vector;
+		}
+		void UpdateArray(Item& item) {
+			CheckPayloadSize(*item.Vector);
+			item.Size = (int)item.Vector->size();
+		}
+
+		string* GetGrowableString(Item& item) {
+			if (item.Kind != ValueKind::String)
+				return nullptr;
+
+			if (item.Owner != PayloadOwner::String) {
+				Item grownItem = CreateString(string(item.Line, item.Size));
+				Destroy(item);
+				item = grownItem;
+			}
+			return item.Text;
+		}
+		void UpdateString(Item& item) {
+			CheckPayloadSize(*item.Text);
+			item.Size = (int)item.Text->size();
+		}
+
+		// Moves a grown array or string back into an allocation sized to its contents; false for single values
+		bool ShrinkToFit(Item& item) {
+			if (item.Kind == ValueKind::Value)
+				return false;
+
+			if (item.Owner == PayloadOwner::Vector || item.Owner == PayloadOwner::String) {
+				Item compactItem = item.Kind == ValueKind::Array ? CreateArray(item.Vector->data(), item.Size) : CreateString(item.Text->c_str(), item.Size);
+				Destroy(item);
+				item = compactItem;
+			}
+			return true;
+		}
+	};
+};
+
+// Entries are reference counted and never changed while shared, so maps forked over ChunkedIndex can hold the same
+// entries. An entry is freed by whichever map lets go of it last, possibly after this one is gone, so entries come
+// from the heap rather than TAllocator
+struct SharedStorage {
+	template <typename TValue, typename TAllocator>
+	class Type {
+		struct Node {
+			ValueKind Kind;
+			bool IsAdopted;
+
+			Node(ValueKind kind, bool isAdopted = false)
+				: Kind{ kind }, IsAdopted{ isAdopted } {
+			}
+		};
+
+		struct SingleValueNode : Node {
+			TValue Value;
+
+			SingleValueNode(TValue value)
+				: Node(ValueKind::Value), Value{ value } {
+			}
+		};
+
+		struct ArrayNode : Node {
+			vector<TValue> Values;
+
+			ArrayNode(vector<TValue>&& values)
+				: Node(ValueKind::Array), Values{ move(values) } {
+			}
+		};
+
+		// An array handed over with unique_ptr keeps its buffer until it grows
+		struct AdoptedArrayNode : Node {
+			unique_ptr<TValue[]> Values;
+			int Size;
+
+			AdoptedArrayNode(unique_ptr<TValue[]> values, int size)
+				: Node(ValueKind::Array, true), Values{ move(values) }, Size{ size } {
+			}
+		};
+
+		struct StringNode : Node {
+			string Text;
+
+			StringNode(string&& text)
+				: Node(ValueKind::String), Text{ move(text) } {
+			}
+		};
+
+		// make_shared puts the counts next to the node
+		static const size_t ControlBlockSize = 2 * sizeof(long) + sizeof(void*);
+
+		template <typename TNode>
+		static TNode& GetNodeForUpdate(shared_ptr<Node>& item) {
+			if (item.use_count() > 1)
+				item = make_shared<TNode>(*static_cast<TNode*>(item.get()));
+			return *static_cast<TNode*>(item.get());
+		}
+
+	public:
+		static const bool SharesItems = true;
+		static const bool CompressesArrays = false;
+		static const bool InternsPayloads = false;
+
+		typedef shared_ptr<Node> Item;
+
+		Item CreateValue(TValue value) {
+			return make_shared<SingleValueNode>(value);
+		}
+		Item CreateArray(const TValue* values, int size) {
+			return make_shared<ArrayNode>(vector<TValue>(values, values + size));
+		}
+		Item CreateString(const char* line) {
+			return make_shared<StringNode>(string(line));
+		}
+		Item CreateString(const char* line, int length) {
+			return make_shared<StringNode>(string(line, length));
+		}
+
+		Item CreateArray(unique_ptr<TValue[]> values, int size) {
+			return make_shared<AdoptedArrayNode>(move(values), size);
+		}
+		Item CreateArray(vector<TValue>&& values) {
+			CheckPayloadSize(values);
+			return make_shared<ArrayNode>(move(values));
+		}
+		Item CreateString(string&& line) {
+			CheckPayloadSize(line);
+			return make_shared<StringNode>(move(line));
+		}
+
+		void Destroy(Item& item) {
+			item.reset();
+		}
+
+		// Entries go when the index lets go of them
+		bool ReleasesAll() {
+			return true;
+		}
+
+		void Release() {
+		}
+
+		void Prefetch(Item& item) {
+			PrefetchMemory(item.get());
+		}
+
+		bool IsInterned(Item& item) {
+			return false;
+		}
+
+		void AddPoolMemoryUsage(MemoryUsage& usage) {
+		}
+
+		void AddMemoryUsage(Item& item, MemoryUsage& usage) {
+			if (item->Kind == ValueKind::Value) {
+				usage.Headers += sizeof(SingleValueNode) + ControlBlockSize;
+				return;
+			}
+
+			if (item->IsAdopted) {
+				usage.Headers += sizeof(AdoptedArrayNode) + ControlBlockSize;
+				usage.ArrayPayloads += static_cast<AdoptedArrayNode*>(item.get())->Size * sizeof(TValue);
+				return;
+			}
+
+			if (item->Kind == ValueKind::Array) {
+				vector<TValue>& values = static_cast<ArrayNode*>(item.get())->Values;
+				usage.Headers += sizeof(ArrayNode) + ControlBlockSize;
+				usage.ArrayPayloads += values.size() * sizeof(TValue);
+				usage.Slack += (values.capacity() - values.size()) * sizeof(TValue);
+				return;
+			}
+
+			StringNode* stringNode = static_cast<StringNode*>(item.get());
+			char* node = (char*)stringNode;
+			usage.Headers += sizeof(StringNode) + ControlBlockSize;
+			if (!less<char*>()(&stringNode->Text[0], node) && less<char*>()(&stringNode->Text[0], node + sizeof(StringNode)))
+				return;
+
+			usage.StringPayloads += stringNode->Text.size() + 1;
+			usage.Slack += stringNode->Text.capacity() - stringNode->Text.size();
+		}
+
+		ValueKind GetKind(Item& item) {
+			return item->Kind;
+		}
+
+		TValue* GetValue(Item& item) {
+			if (item->Kind != ValueKind::Value)
+				return nullptr;
+
+			return &static_cast<SingleValueNode*>(item.get())->Value;
+		}
+		bool GetArray(Item& item, TValue** values, int* size) {
+			if (item->Kind != ValueKind::Array)
+				return false;
+
+			if (item->IsAdopted) {
+				*values = static_cast<AdoptedArrayNode*>(item.get())->Values.get();
+				*size = static_cast<AdoptedArrayNode*>(item.get())->Size;
+				return true;
+			}
+
+			vector<TValue>& arrayValues = static_cast<ArrayNode*>(item.get())->Values;
+			*values = arrayValues.data();
+			*size = (int)arrayValues.size();
+			return true;
+		}
+		const CompressedArray<TValue>* GetCompressedArray(Item& item) {
+			return nullptr;
+		}
+		char* GetString(Item& item) {
+			if (item->Kind != ValueKind::String)
+				return nullptr;
+
+			return &static_cast<StringNode*>(item.get())->Text[0];
+		}
+		int GetStringLength(Item& item) {
+			return (int)static_cast<StringNode*>(item.get())->Text.size();
+		}
+
+		// A shared entry is copied before it changes, forks keep seeing the old one
+		vector<TValue>* GetGrowableArray(Item& item) {
+			if (item->Kind != ValueKind::Array)
+				return nullptr;
+
+			if (item->IsAdopted) {
+				AdoptedArrayNode* arrayNode = static_cast<AdoptedArrayNode*>(item.get());
+				item = CreateArray(arrayNode->Values.get(), arrayNode->Size);
+			}
+			return &GetNodeForUpdate<ArrayNode>(item).Values;
+		}
+		void UpdateArray(Item& item) {
+		}
+
+		string* GetGrowableString(Item& item) {
+			if (item->Kind != ValueKind::String)
+				return nullptr;
+
+			return &GetNodeForUpdate<StringNode>(item).Text;
+		}
+		void UpdateString(Item& item) {
+		}
+
+		bool ShrinkToFit(Item& item) {
+			if (item->Kind == ValueKind::Value)
+				return false;
+
+			if (item->IsAdopted)
+				return true;
+
+			if (item->Kind == ValueKind::Array) {
+				if (static_cast<ArrayNode*>(item.get())->Values.capacity() > static_cast<ArrayNode*>(item.get())->Values.size())
+					GetNodeForUpdate<ArrayNode>(item).Values.shrink_to_fit();
+			}
+			else if (static_cast<StringNode*>(item.get())->Text.capacity() > static_cast<StringNode*>(item.get())->Text.size())
+				GetNodeForUpdate<StringNode>(item).Text.shrink_to_fit();
+			return true;
+		}
+	};
+};
@@ -0,0 +1,845 @@
+#pragma once
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include "ComplexMapIndex.h"
+#include "ComplexMapStorage.h"
+#include "ComplexMapReclaim.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// A scratch file that only grows: created empty, deleted when closed. Reads and appends are positional,
+// so the compactor can copy out of the file while the map appends to it
+class SegmentFile {
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+#endif
+	string path;
+	unsigned long long size = 0;
+
+public:
+	SegmentFile(const string& path)
+		: path{ path } {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+#else
+		file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (file == -1)
+#endif
+			throw "Cannot open segment";
+	}
+
+	SegmentFile(const SegmentFile&) = delete;
+	SegmentFile& operator=(const SegmentFile&) = delete;
+
+	~SegmentFile() {
+#ifdef _WIN32
+		CloseHandle(file);
+		DeleteFileA(path.c_str());
+#else
+		close(file);
+		unlink(path.c_str());
+#endif
+	}
+
+	unsigned long long GetSize() {
+		return size;
+	}
+
+	// Returns the offset the data was written at
+	unsigned long long Append(const void* data, size_t length) {
+		unsigned long long offset = size;
+		const char* bytes = (const char*)data;
+		while (length > 0) {
+#ifdef _WIN32
+			OVERLAPPED position = {};
+			position.Offset = (DWORD)size;
+			position.OffsetHigh = (DWORD)(size >> 32);
+			DWORD written = 0;
+			if (!WriteFile(file, bytes, (DWORD)min(length, (size_t)1 << 30), &written, &position) || written == 0)
+				throw "Cannot write segment";
+#else
+			ssize_t written = pwrite(file, bytes, length, size);
+			if (written <= 0)
+				throw "Cannot write segment";
+#endif
+			bytes += written;
+			length -= written;
+			size += written;
+		}
+		return offset;
+	}
+
+	void Read(unsigned long long offset, void* data, size_t length) {
+		char* bytes = (char*)data;
+		while (length > 0) {
+#ifdef _WIN32
+			OVERLAPPED position = {};
+			position.Offset = (DWORD)offset;
+			position.OffsetHigh = (DWORD)(offset >> 32);
+			DWORD read = 0;
+			if (!ReadFile(file, bytes, (DWORD)min(length, (size_t)1 << 30), &read, &position) || read == 0)
+				throw "Cannot read segment";
+#else
+			ssize_t read = pread(file, bytes, length, offset);
+			if (read <= 0)
+				throw "Cannot read segment";
+#endif
+			bytes += read;
+			length -= read;
+			offset += read;
+		}
+	}
+};
+
+struct TieredOptions {
+	// Arrays and strings with fewer payload bytes always stay in memory
+	size_t SpillThreshold = 4096;
+	// Payload bytes of spillable entries kept in memory before the coldest ones are spilled
+	size_t MaxResidentBytes = 64 * 1024 * 1024;
+	// The compactor starts once the segment has CompactionSize bytes and at least half of them are dead
+	unsigned long long CompactionSize = 16 * 1024 * 1024;
+	bool BackgroundCompaction = true;
+};
+
+// ResidentHits and SpilledHits count reads of arrays and strings that were in memory or had to be loaded from the
+// segment. The byte counts are current: ResidentBytes of spillable payloads in memory, SegmentBytes of the file
+// and DeadBytes of it left by removed and replaced payloads
+struct TieredStats {
+	unsigned long long ResidentHits;
+	unsigned long long SpilledHits;
+	unsigned long long Misses;
+	unsigned long long Spills;
+	unsigned long long SpilledBytes;
+	unsigned long long Compactions;
+	size_t ResidentBytes;
+	unsigned long long SegmentBytes;
+	unsigned long long DeadBytes;
+};
+
+// Keeps keys and single values in memory and moves large cold arrays and strings to an append-only segment file.
+// When spillable payloads outgrow MaxResidentBytes, the CLOCK hand spills those not read since it last passed them.
+// A spilled payload is read back with a positional read on access and keeps its place in the segment, so spilling
+// it again writes nothing. Pointers returned by array and string getters are read-only and stay valid until the next add, or the
+// next read of another spilled entry. Like ComplexMap, the map is not thread-safe; only the compactor runs aside.
+// It has the add, get, GetOrAdd, append, resize, element read and remove methods of ComplexMap. Lazy adds, moved-in
+// payloads, batches, bulk loads, snapshots, iteration and stats stay ComplexMap only
+template <typename TKey, typename TValue, typename TIndex = FlatHashIndex>
+class TieredComplexMap {
+	static_assert(is_trivially_copyable<TValue>::value, "Spilled payloads need trivially copyable values");
+
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+
+	struct Entry {
+		TKey Key;
+		ValueKind Kind;
+		bool Referenced;
+		bool IsResident;
+		int Size;
+		// Of a resident array or string, grown ones keep spare room
+		int Capacity;
+		union {
+			TValue Value;
+			TValue* Values;
+			char* Line;
+		};
+
+		Entry()
+			: Key{}, Kind{ ValueKind::None }, Referenced{ false }, IsResident{ true }, Size{ 0 }, Capacity{ 0 }, Values{ nullptr } {
+		}
+	};
+
+	// Where a slot's payload sits in the segment; Offset is NoOffset for payloads that were never spilled
+	struct SegmentLocation {
+		unsigned long long Offset;
+		size_t Bytes;
+	};
+
+	static const unsigned long long NoOffset = ~0ULL;
+
+	typedef typename TIndex::template Type<TKey, int> Index;
+
+	Index slotsIndex;
+	vector<Entry> entries;
+	vector<int> freeSlots;
+	size_t hand = 0;
+	TieredOptions options;
+	string segmentPath;
+	unsigned long long residentHits = 0;
+	unsigned long long spilledHits = 0;
+	unsigned long long misses = 0;
+	unsigned long long spills = 0;
+	unsigned long long spilledBytes = 0;
+	size_t residentBytes = 0;
+
+	// Everything below is shared with the compactor and guarded by segmentMutex
+	mutex segmentMutex;
+	vector<SegmentLocation> locations;
+	unique_ptr<SegmentFile> segment;
+	int segmentGeneration = 0;
+	unsigned long long deadBytes = 0;
+	unsigned long long compactions = 0;
+	bool isCompactionPosted = false;
+	// Runs one compaction at a time, with or without the background thread
+	mutex compactionMutex;
+	// Last, so it stops before the segment goes away
+	unique_ptr<ReclaimThread> compactor;
+
+	static size_t GetPayloadBytes(const Entry& entry) {
+		switch (entry.Kind) {
+		case ValueKind::Array:
+			return entry.Size * sizeof(TValue);
+		case ValueKind::String:
+			return entry.Size + 1;
+		default:
+			return 0;
+		}
+	}
+
+	bool IsSpillable(const Entry& entry) {
+		return entry.Kind != ValueKind::Value && GetPayloadBytes(entry) >= options.SpillThreshold;
+	}
+
+	static Entry CreateValue(TValue value) {
+		Entry entry;
+		entry.Kind = ValueKind::Value;
+		entry.Value = value;
+		return entry;
+	}
+	static Entry CreateArray(const TValue* values, int size) {
+		Entry entry;
+		entry.Kind = ValueKind::Array;
+		entry.Size = size;
+		entry.Capacity = size;
+		entry.Values = new TValue[size];
+		memcpy_s(entry.Values, size * sizeof(TValue), values, size * sizeof(TValue));
+		return entry;
+	}
+	static Entry CreateString(const char* line, int length) {
+		Entry entry;
+		entry.Kind = ValueKind::String;
+		entry.Size = length;
+		entry.Capacity = length;
+		entry.Line = new char[length + 1];
+		memcpy_s(entry.Line, length + 1, line, length);
+		entry.Line[length] = '\0';
+		return entry;
+	}
+
+	static void FreePayload(Entry& entry) {
+		if (!entry.IsResident)
+			return;
+
+		if (entry.Kind == ValueKind::Array)
+			delete[] entry.Values;
+		else if (entry.Kind == ValueKind::String)
+			delete[] entry.Line;
+	}
+
+	static void* GetPayload(Entry& entry) {
+		return entry.Kind == ValueKind::Array ? (void*)entry.Values : (void*)entry.Line;
+	}
+
+	// The segment copy of a removed payload becomes dead space for the compactor
+	void ReleaseLocation(int slot) {
+		lock_guard<mutex> lock(segmentMutex);
+		if (locations[slot].Offset != NoOffset)
+			deadBytes += locations[slot].Bytes;
+		locations[slot].Offset = NoOffset;
+	}
+
+	void DestroyEntry(int slot) {
+		Entry& entry = entries[slot];
+		int erasedSlot;
+		slotsIndex.Erase(entry.Key, &erasedSlot);
+		if (entry.IsResident && IsSpillable(entry))
+			residentBytes -= GetPayloadBytes(entry);
+		FreePayload(entry);
+		ReleaseLocation(slot);
+		entry = Entry();
+		freeSlots.push_back(slot);
+		PostCompaction();
+	}
+
+	void Spill(int slot) {
+		Entry& entry = entries[slot];
+		size_t bytes = GetPayloadBytes(entry);
+		{
+			lock_guard<mutex> lock(segmentMutex);
+			if (locations[slot].Offset == NoOffset) {
+				locations[slot].Offset = segment->Append(GetPayload(entry), bytes);
+				locations[slot].Bytes = bytes;
+				spilledBytes += bytes;
+			}
+		}
+		FreePayload(entry);
+		entry.IsResident = false;
+		entry.Values = nullptr;
+		residentBytes -= bytes;
+		spills++;
+	}
+
+	void Load(int slot) {
+		Entry& entry = entries[slot];
+		size_t bytes = GetPayloadBytes(entry);
+		if (entry.Kind == ValueKind::Array)
+			entry.Values = new TValue[entry.Size];
+		else
+			entry.Line = new char[bytes];
+		entry.Capacity = entry.Size;
+		entry.IsResident = true;
+		try {
+			lock_guard<mutex> lock(segmentMutex);
+			segment->Read(locations[slot].Offset, GetPayload(entry), bytes);
+		}
+		catch (...) {
+			FreePayload(entry);
+			entry.IsResident = false;
+			entry.Values = nullptr;
+			throw;
+		}
+
+		residentBytes += bytes;
+		spilledHits++;
+		MakeRoom(slot);
+	}
+
+	// Gives every resident spillable entry one more pass of the hand if it was read since the last one.
+	// keptSlot is the entry being returned to the caller, it is never spilled
+	void MakeRoom(int keptSlot) {
+		size_t passes = 0;
+		while (residentBytes > options.MaxResidentBytes && passes < 2 * entries.size()) {
+			if (hand >= entries.size())
+				hand = 0;
+
+			Entry& entry = entries[hand];
+			int slot = hand++;
+			passes++;
+			if (slot == keptSlot || !entry.IsResident || !IsSpillable(entry))
+				continue;
+
+			if (entry.Referenced) {
+				entry.Referenced = false;
+				continue;
+			}
+
+			Spill(slot);
+		}
+	}
+
+	// Reads a payload, loading it from the segment if it was spilled
+	Entry* FindEntry(LookupKey key) {
+		int* slot = slotsIndex.Find(key);
+		if (slot == nullptr) {
+			misses++;
+			return nullptr;
+		}
+
+		Entry& entry = entries[*slot];
+		entry.Referenced = true;
+		if (!entry.IsResident)
+			Load(*slot);
+		else if (entry.Kind != ValueKind::Value)
+			residentHits++;
+		return &entry;
+	}
+
+	Entry& GetEntry(LookupKey key) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr)
+			throw "Key not found";
+
+		return *entry;
+	}
+
+	// A kept entry stays resident for the caller, the others may be spilled right away
+	template <typename TKeyArg>
+	int PlaceEntry(TKeyArg&& key, Entry entry, bool isKept = false) {
+		int slot;
+		try {
+			entry.Key = TKey(LookupKey(key));
+			if (freeSlots.empty()) {
+				entries.emplace_back();
+				lock_guard<mutex> lock(segmentMutex);
+				locations.push_back(SegmentLocation{ NoOffset, 0 });
+				freeSlots.push_back(entries.size() - 1);
+			}
+			slot = freeSlots.back();
+			slotsIndex.Insert(forward<TKeyArg>(key), slot);
+		}
+		catch (...) {
+			FreePayload(entry);
+			throw;
+		}
+
+		freeSlots.pop_back();
+		entries[slot] = move(entry);
+		if (IsSpillable(entries[slot])) {
+			residentBytes += GetPayloadBytes(entries[slot]);
+			MakeRoom(isKept ? slot : -1);
+		}
+		return slot;
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	bool TryAddEntry(TKeyArg&& key, TCreateEntry createEntry) {
+		if (slotsIndex.Find(key) != nullptr)
+			return false;
+
+		PlaceEntry(forward<TKeyArg>(key), createEntry());
+		return true;
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	void AddEntry(TKeyArg&& key, TCreateEntry createEntry) {
+		if (!TryAddEntry(forward<TKeyArg>(key), createEntry))
+			throw "Key already exists";
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	Entry& GetOrAddEntry(TKeyArg&& key, TCreateEntry createEntry) {
+		Entry* entry = FindEntry(key);
+		if (entry != nullptr)
+			return *entry;
+
+		return entries[PlaceEntry(forward<TKeyArg>(key), createEntry(), true)];
+	}
+
+	template <typename TKeyArg, typename TCreateEntry>
+	void AddEntryOrReplace(TKeyArg&& key, TCreateEntry createEntry) {
+		Entry entry = createEntry();
+		int* slot = slotsIndex.Find(key);
+		if (slot != nullptr)
+			DestroyEntry(*slot);
+
+		PlaceEntry(forward<TKeyArg>(key), move(entry));
+	}
+
+	static TValue GetEntryValue(Entry& entry) {
+		if (entry.Kind != ValueKind::Value)
+			throw "Invalid value type";
+
+		return entry.Value;
+	}
+
+	static const TValue* GetEntryArray(Entry& entry, int* size) {
+		if (entry.Kind != ValueKind::Array)
+			throw "Invalid value type";
+
+		*size = entry.Size;
+		return entry.Values;
+	}
+
+	static const char* GetEntryString(Entry& entry) {
+		if (entry.Kind != ValueKind::String)
+			throw "Invalid value type";
+
+		return entry.Line;
+	}
+
+	static int GetGrownCapacity(int capacity, int neededCapacity) {
+		int doubledCapacity = capacity > INT_MAX / 2 ? INT_MAX : capacity * 2;
+		return neededCapacity > doubledCapacity ? neededCapacity : doubledCapacity;
+	}
+
+	// Moves a resident array or string into a buffer of the given capacity, which holds at least its size
+	static void ReallocatePayload(Entry& entry, int capacity) {
+		if (entry.Kind == ValueKind::Array) {
+			TValue* values = new TValue[capacity];
+			memcpy_s(values, (size_t)capacity * sizeof(TValue), entry.Values, (size_t)entry.Size * sizeof(TValue));
+			delete[] entry.Values;
+			entry.Values = values;
+		}
+		else {
+			char* line = new char[(size_t)capacity + 1];
+			memcpy_s(line, (size_t)capacity + 1, entry.Line, (size_t)entry.Size + 1);
+			delete[] entry.Line;
+			entry.Line = line;
+		}
+		entry.Capacity = capacity;
+	}
+
+	// Changes a resident payload in place. Its copy in the segment is dead from then on, the next spill writes it
+	// again, and a payload grown past SpillThreshold starts counting toward MaxResidentBytes
+	template <typename TChange>
+	void ChangePayload(Entry& entry, TChange change) {
+		int slot = (int)(&entry - entries.data());
+		size_t oldBytes = IsSpillable(entry) ? GetPayloadBytes(entry) : 0;
+		change();
+		size_t newBytes = IsSpillable(entry) ? GetPayloadBytes(entry) : 0;
+		residentBytes = residentBytes - oldBytes + newBytes;
+		ReleaseLocation(slot);
+		PostCompaction();
+		MakeRoom(slot);
+	}
+
+	void AppendToEntryArray(Entry& entry, const TValue* values, int count) {
+		if (entry.Kind != ValueKind::Array)
+			throw "Invalid value type";
+		// Refused before growing, so the entry keeps its old contents
+		if ((size_t)count > (size_t)INT_MAX - entry.Size)
+			throw "Payload is too large";
+
+		ChangePayload(entry, [&]() {
+			// Appending part of the array to itself copies the source first, growing would free it
+			vector<TValue> copy;
+			if (count > 0 && !less<const TValue*>()(values, entry.Values) && less<const TValue*>()(values, entry.Values + entry.Size)) {
+				copy.assign(values, values + count);
+				values = copy.data();
+			}
+			if (count > entry.Capacity - entry.Size)
+				ReallocatePayload(entry, GetGrownCapacity(entry.Capacity, entry.Size + count));
+			memcpy_s(entry.Values + entry.Size, (size_t)(entry.Capacity - entry.Size) * sizeof(TValue), values, (size_t)count * sizeof(TValue));
+			entry.Size += count;
+		});
+	}
+
+	void AppendToEntryString(Entry& entry, const char* text, int length) {
+		if (entry.Kind != ValueKind::String)
+			throw "Invalid value type";
+		if ((size_t)length > (size_t)INT_MAX - entry.Size)
+			throw "Payload is too large";
+
+		ChangePayload(entry, [&]() {
+			string copy;
+			if (length > 0 && !less<const char*>()(text, entry.Line) && less<const char*>()(text, entry.Line + entry.Size)) {
+				copy.assign(text, length);
+				text = copy.c_str();
+			}
+			if (length > entry.Capacity - entry.Size)
+				ReallocatePayload(entry, GetGrownCapacity(entry.Capacity, entry.Size + length));
+			memcpy_s(entry.Line + entry.Size, (size_t)(entry.Capacity - entry.Size) + 1, text, length);
+			entry.Size += length;
+			entry.Line[entry.Size] = '\0';
+		});
+	}
+
+	void PostCompaction() {
+		if (compactor == nullptr)
+			return;
+
+		{
+			lock_guard<mutex> lock(segmentMutex);
+			if (isCompactionPosted || !IsCompactionDue())
+				return;
+
+			isCompactionPosted = true;
+		}
+		compactor->Post([this]() {
+			try {
+				Compact();
+			}
+			catch (...) {
+				// The old segment stays in use, the next removal tries again
+			}
+			lock_guard<mutex> lock(segmentMutex);
+			isCompactionPosted = false;
+		});
+	}
+
+	// Needs segmentMutex
+	bool IsCompactionDue() {
+		unsigned long long size = segment->GetSize();
+		return size >= options.CompactionSize && deadBytes * 2 >= size;
+	}
+
+public:
+	// The segment file is created at segmentPath, with a second one next to it while compacting; both are deleted with the map
+	TieredComplexMap(const char* segmentPath, TieredOptions options = TieredOptions())
+		: options{ options }, segmentPath{ segmentPath }, segment{ new SegmentFile(segmentPath) } {
+		if (options.BackgroundCompaction)
+			compactor.reset(new ReclaimThread());
+	}
+
+	TieredComplexMap(const TieredComplexMap&) = delete;
+	TieredComplexMap& operator=(const TieredComplexMap&) = delete;
+
+	~TieredComplexMap() {
+		compactor.reset();
+		RemoveAll();
+	}
+
+	int GetSize() {
+		return slotsIndex.GetSize();
+	}
+	void Reserve(int count) {
+		slotsIndex.Reserve(count);
+		entries.reserve(count);
+	}
+
+	// Gives back index slots left by removals and the spare room of grown arrays and strings
+	void ShrinkToFit() {
+		for (size_t i = 0; i < entries.size(); i++)
+			if (entries[i].IsResident && entries[i].Capacity > entries[i].Size)
+				ReallocatePayload(entries[i], entries[i].Size);
+		slotsIndex.ShrinkToFit();
+	}
+
+	TieredStats GetStats() {
+		lock_guard<mutex> lock(segmentMutex);
+		return TieredStats{ residentHits, spilledHits, misses, spills, spilledBytes, compactions, residentBytes, segment->GetSize(), deadBytes };
+	}
+
+	template <typename TKeyArg>
+	void AddValue(TKeyArg&& key, TValue value) {
+		AddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(value); });
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, TValue* values, int size) {
+		AddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); });
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, const char* line) {
+		AddEntry(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); });
+	}
+
+	template <typename TKeyArg>
+	bool TryAddValue(TKeyArg&& key, TValue value) {
+		return TryAddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(value); });
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, TValue* values, int size) {
+		return TryAddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); });
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, const char* line) {
+		return TryAddEntry(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); });
+	}
+
+	template <typename TKeyArg>
+	void AddValueOrReplace(TKeyArg&& key, TValue value) {
+		AddEntryOrReplace(forward<TKeyArg>(key), [&]() { return CreateValue(value); });
+	}
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, TValue* values, int size) {
+		AddEntryOrReplace(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); });
+	}
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, const char* line) {
+		AddEntryOrReplace(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); });
+	}
+
+	TValue GetValue(LookupKey key) {
+		return GetEntryValue(GetEntry(key));
+	}
+	const TValue* GetArray(LookupKey key, int* size) {
+		return GetEntryArray(GetEntry(key), size);
+	}
+	const char* GetString(LookupKey key) {
+		return GetEntryString(GetEntry(key));
+	}
+
+	bool TryGetValue(LookupKey key, TValue* value) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::Value)
+			return false;
+
+		*value = entry->Value;
+		return true;
+	}
+	bool TryGetArray(LookupKey key, const TValue** values, int* size) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::Array)
+			return false;
+
+		*values = entry->Values;
+		*size = entry->Size;
+		return true;
+	}
+	bool TryGetString(LookupKey key, const char** line) {
+		Entry* entry = FindEntry(key);
+		if (entry == nullptr || entry->Kind != ValueKind::String)
+			return false;
+
+		*line = entry->Line;
+		return true;
+	}
+
+	// Both throw "Index out of range" for a start outside the array
+	TValue GetArrayElement(LookupKey key, int index) {
+		TValue value;
+		if (ReadArray(key, index, &value, 1) != 1)
+			throw "Index out of range";
+
+		return value;
+	}
+	// Copies up to count elements from begin into buffer and returns how many there were
+	int ReadArray(LookupKey key, int begin, TValue* buffer, int count) {
+		int size;
+		const TValue* values = GetEntryArray(GetEntry(key), &size);
+		if (begin < 0 || begin > size || count < 0)
+			throw "Index out of range";
+
+		int readCount = size - begin < count ? size - begin : count;
+		copy(values + begin, values + begin + readCount, buffer);
+		return readCount;
+	}
+
+	// A missing key is added and stays resident until the next add, so its payload can be returned
+	template <typename TKeyArg>
+	TValue GetOrAddValue(TKeyArg&& key, TValue value) {
+		return GetEntryValue(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateValue(value); }));
+	}
+	template <typename TKeyArg>
+	const TValue* GetOrAddArray(TKeyArg&& key, int* resultSize, TValue* values, int size) {
+		return GetEntryArray(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(values, size); }), resultSize);
+	}
+	template <typename TKeyArg>
+	const char* GetOrAddString(TKeyArg&& key, const char* line) {
+		return GetEntryString(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateString(line, strlen(line)); }));
+	}
+
+	// Appending to a missing key adds an empty array or string first, like GetOrAdd; appending to another kind throws.
+	// The payload grows into spare room that doubles as needed, ShrinkToFit gives it back
+	template <typename TKeyArg>
+	void AppendToArray(TKeyArg&& key, const TValue* values, int count) {
+		AppendToEntryArray(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateArray(nullptr, 0); }), values, count);
+	}
+	template <typename TKeyArg>
+	void AppendToString(TKeyArg&& key, const char* text) {
+		AppendToString(forward<TKeyArg>(key), text, strlen(text));
+	}
+	template <typename TKeyArg>
+	void AppendToString(TKeyArg&& key, const char* text, int length) {
+		AppendToEntryString(GetOrAddEntry(forward<TKeyArg>(key), [&]() { return CreateString("", 0); }), text, length);
+	}
+
+	// Reserving and resizing work on existing arrays only, like Get. New elements of a resized array are value-initialized
+	void ReserveArray(LookupKey key, int capacity) {
+		Entry& entry = GetEntry(key);
+		if (entry.Kind != ValueKind::Array)
+			throw "Invalid value type";
+		if (capacity < 0)
+			throw "Index out of range";
+
+		if (capacity > entry.Capacity)
+			ReallocatePayload(entry, capacity);
+	}
+	void ResizeArray(LookupKey key, int size) {
+		Entry& entry = GetEntry(key);
+		if (entry.Kind != ValueKind::Array)
+			throw "Invalid value type";
+		if (size < 0)
+			throw "Index out of range";
+
+		ChangePayload(entry, [&]() {
+			if (size > entry.Capacity)
+				ReallocatePayload(entry, size);
+			if (size > entry.Size)
+				fill(entry.Values + entry.Size, entry.Values + size, TValue());
+			entry.Size = size;
+		});
+	}
+
+	void ShrinkToFit(LookupKey key) {
+		Entry& entry = GetEntry(key);
+		if (entry.Kind == ValueKind::Value)
+			throw "Invalid value type";
+
+		if (entry.Capacity > entry.Size)
+			ReallocatePayload(entry, entry.Size);
+	}
+
+	void Remove(LookupKey key) {
+		if (!TryRemove(key))
+			throw "Key not found";
+	}
+	bool TryRemove(LookupKey key) {
+		int* slot = slotsIndex.Find(key);
+		if (slot == nullptr)
+			return false;
+
+		DestroyEntry(*slot);
+		return true;
+	}
+	void RemoveAll() {
+		for (size_t i = 0; i < entries.size(); i++)
+			FreePayload(entries[i]);
+
+		entries.clear();
+		freeSlots.clear();
+		slotsIndex.Clear();
+		hand = 0;
+		residentBytes = 0;
+		{
+			lock_guard<mutex> lock(segmentMutex);
+			for (size_t i = 0; i < locations.size(); i++)
+				if (locations[i].Offset != NoOffset)
+					deadBytes += locations[i].Bytes;
+			locations.clear();
+		}
+		PostCompaction();
+	}
+
+	// Copies the live spilled payloads into a fresh segment and drops the old one. The copy runs without holding up
+	// the map; payloads spilled meanwhile are carried over at the end, those removed meanwhile are left behind
+	void Compact() {
+		lock_guard<mutex> compactionLock(compactionMutex);
+		vector<pair<int, SegmentLocation>> live;
+		string compactedPath;
+		{
+			lock_guard<mutex> lock(segmentMutex);
+			for (size_t i = 0; i < locations.size(); i++)
+				if (locations[i].Offset != NoOffset)
+					live.push_back(pair<int, SegmentLocation>((int)i, locations[i]));
+			compactedPath = segmentPath + (segmentGeneration % 2 == 0 ? ".1" : "");
+		}
+
+		// Appends go to the end of the old segment, what is copied here stays where it is until the swap
+		unique_ptr<SegmentFile> compacted(new SegmentFile(compactedPath));
+		vector<unsigned long long> offsets(live.size());
+		vector<char> buffer;
+		for (size_t i = 0; i < live.size(); i++) {
+			buffer.resize(live[i].second.Bytes);
+			segment->Read(live[i].second.Offset, buffer.data(), buffer.size());
+			offsets[i] = compacted->Append(buffer.data(), buffer.size());
+		}
+
+		// Offsets in the old segment are never reused, a slot still at its copied offset still holds that payload
+		lock_guard<mutex> lock(segmentMutex);
+		vector<char> isCopied(locations.size());
+		unsigned long long compactedDeadBytes = 0;
+		for (size_t i = 0; i < live.size(); i++) {
+			size_t slot = live[i].first;
+			if (slot < locations.size() && locations[slot].Offset == live[i].second.Offset) {
+				locations[slot].Offset = offsets[i];
+				isCopied[slot] = true;
+			}
+			else
+				compactedDeadBytes += live[i].second.Bytes;
+		}
+		for (size_t i = 0; i < locations.size(); i++)
+			if (locations[i].Offset != NoOffset && !isCopied[i]) {
+				buffer.resize(locations[i].Bytes);
+				segment->Read(locations[i].Offset, buffer.data(), buffer.size());
+				locations[i].Offset = compacted->Append(buffer.data(), buffer.size());
+			}
+
+		deadBytes = compactedDeadBytes;
+		segment = move(compacted);
+		segmentGeneration++;
+		compactions++;
+	}
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include "ComplexMap.h"
+
+using namespace std;
+
+template <typename TKey, typename TValue, typename TIndex = FlatHashIndex, typename TStorage = InlineStorage, typename TAllocator = HeapAllocator>
+class ConcurrentComplexMap {
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+
+	struct alignas(64) Shard {
+		shared_mutex Mutex;
+		ComplexMap<TKey, TValue, TIndex, TStorage, TAllocator> Map;
+	};
+
+	unique_ptr<Shard[]> shards;
+	size_t shardMask;
+
+	Shard& GetShard(LookupKey key) {
+		unsigned long long hashCode = KeyTraits<TKey>::GetHash(key);
+		hashCode = (hashCode ^ (hashCode >> 30)) * 0xBF58476D1CE4E5B9ull;
+		hashCode = (hashCode ^ (hashCode >> 27)) * 0x94D049BB133111EBull;
+		return shards[(size_t)(hashCode ^ (hashCode >> 31)) & shardMask];
+	}
+
+	template <typename TAction>
+	auto Read(LookupKey key, TAction action) -> decltype(action(declval<ComplexMap<TKey, TValue, TIndex, TStorage, TAllocator>&>())) {
+		Shard& shard = GetShard(key);
+		shared_lock<shared_mutex> lock(shard.Mutex);
+		return action(shard.Map);
+	}
+
+	template <typename TAction>
+	auto Write(LookupKey key, TAction action) -> decltype(action(declval<ComplexMap<TKey, TValue, TIndex, TStorage, TAllocator>&>())) {
+		Shard& shard = GetShard(key);
+		unique_lock<shared_mutex> lock(shard.Mutex);
+		return action(shard.Map);
+	}
+
+public:
+	ConcurrentComplexMap(int shardCount = 64) {
+		size_t count = 1;
+		while (count < (size_t)shardCount)
+			count *= 2;
+
+		shards.reset(new Shard[count]);
+		shardMask = count - 1;
+	}
+
+	ConcurrentComplexMap(const ConcurrentComplexMap&) = delete;
+	ConcurrentComplexMap& operator=(const ConcurrentComplexMap&) = delete;
+
+	int GetShardCount() {
+		return shardMask + 1;
+	}
+
+	int GetSize() {
+		int size = 0;
+		for (size_t i = 0; i <= shardMask; i++) {
+			shared_lock<shared_mutex> lock(shards[i].Mutex);
+			size += shards[i].Map.GetSize();
+		}
+		return size;
+	}
+
+	template <typename TKeyArg>
+	void AddValue(TKeyArg&& key, TValue value) {
+		Write(key, [&](auto& map) { map.AddValue(forward<TKeyArg>(key), value); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	void AddArray(TKeyArg&& key, TArgs&&... args) {
+		Write(key, [&](auto& map) { map.AddArray(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	void AddString(TKeyArg&& key, TArgs&&... args) {
+		Write(key, [&](auto& map) { map.AddString(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+
+	template <typename TKeyArg>
+	bool TryAddValue(TKeyArg&& key, TValue value) {
+		return Write(key, [&](auto& map) { return map.TryAddValue(forward<TKeyArg>(key), value); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	bool TryAddArray(TKeyArg&& key, TArgs&&... args) {
+		return Write(key, [&](auto& map) { return map.TryAddArray(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	bool TryAddString(TKeyArg&& key, TArgs&&... args) {
+		return Write(key, [&](auto& map) { return map.TryAddString(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+
+	template <typename TKeyArg>
+	void AddValueOrReplace(TKeyArg&& key, TValue value) {
+		Write(key, [&](auto& map) { map.AddValueOrReplace(forward<TKeyArg>(key), value); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	void AddArrayOrReplace(TKeyArg&& key, TArgs&&... args) {
+		Write(key, [&](auto& map) { map.AddArrayOrReplace(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	void AddStringOrReplace(TKeyArg&& key, TArgs&&... args) {
+		Write(key, [&](auto& map) { map.AddStringOrReplace(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+
+	TValue GetValue(LookupKey key) {
+		return Read(key, [&](auto& map) { return map.GetValue(key); });
+	}
+	vector<TValue> GetArray(LookupKey key) {
+		return Read(key, [&](auto& map) {
+			int size;
+			const TValue* values = map.GetArray(key, &size);
+			return vector<TValue>(values, values + size);
+		});
+	}
+	string GetString(LookupKey key) {
+		return Read(key, [&](auto& map) { return string(map.GetString(key)); });
+	}
+	TValue GetArrayElement(LookupKey key, int index) {
+		return Read(key, [&](auto& map) { return map.GetArrayElement(key, index); });
+	}
+	int ReadArray(LookupKey key, int begin, TValue* buffer, int count) {
+		return Read(key, [&](auto& map) { return map.ReadArray(key, begin, buffer, count); });
+	}
+
+	bool TryGetValue(LookupKey key, TValue* value) {
+		return Read(key, [&](auto& map) { return map.TryGetValue(key, value); });
+	}
+	bool TryGetArray(LookupKey key, vector<TValue>* values) {
+		return Read(key, [&](auto& map) {
+			int size;
+			const TValue* arrayValues;
+			if (!map.TryGetArray(key, &arrayValues, &size))
+				return false;
+
+			values->assign(arrayValues, arrayValues + size);
+			return true;
+		});
+	}
+	bool TryGetString(LookupKey key, string* line) {
+		return Read(key, [&](auto& map) {
+			const char* stringValue;
+			if (!map.TryGetString(key, &stringValue))
+				return false;
+
+			line->assign(stringValue);
+			return true;
+		});
+	}
+
+	template <typename TVisitor>
+	bool VisitArray(LookupKey key, TVisitor visitor) {
+		return Read(key, [&](auto& map) {
+			int size;
+			const TValue* values;
+			if (!map.TryGetArray(key, &values, &size))
+				return false;
+
+			visitor(values, size);
+			return true;
+		});
+	}
+	template <typename TVisitor>
+	bool VisitString(LookupKey key, TVisitor visitor) {
+		return Read(key, [&](auto& map) {
+			const char* line;
+			if (!map.TryGetString(key, &line))
+				return false;
+
+			visitor(line);
+			return true;
+		});
+	}
+
+	template <typename TKeyArg>
+	TValue GetOrAddValue(TKeyArg&& key, TValue value) {
+		TValue existingValue;
+		if (TryGetValue(key, &existingValue))
+			return existingValue;
+
+		return Write(key, [&](auto& map) { return map.GetOrAddValue(forward<TKeyArg>(key), value); });
+	}
+	template <typename TKeyArg>
+	vector<TValue> GetOrAddArray(TKeyArg&& key, TValue* values, int size) {
+		vector<TValue> existingValues;
+		if (TryGetArray(key, &existingValues))
+			return existingValues;
+
+		return Write(key, [&](auto& map) {
+			int resultSize;
+			TValue* arrayValues = map.GetOrAddArray(forward<TKeyArg>(key), &resultSize, values, size);
+			return vector<TValue>(arrayValues, arrayValues + resultSize);
+		});
+	}
+	template <typename TKeyArg>
+	string GetOrAddString(TKeyArg&& key, const char* line) {
+		string existingLine;
+		if (TryGetString(key, &existingLine))
+			return existingLine;
+
+		return Write(key, [&](auto& map) { return string(map.GetOrAddString(forward<TKeyArg>(key), line)); });
+	}
+
+	template <typename TKeyArg, typename... TArgs>
+	void AppendToArray(TKeyArg&& key, TArgs&&... args) {
+		Write(key, [&](auto& map) { map.AppendToArray(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+	template <typename TKeyArg, typename... TArgs>
+	void AppendToString(TKeyArg&& key, TArgs&&... args) {
+		Write(key, [&](auto& map) { map.AppendToString(forward<TKeyArg>(key), forward<TArgs>(args)...); });
+	}
+	void ReserveArray(LookupKey key, int capacity) {
+		Write(key, [&](auto& map) { map.ReserveArray(key, capacity); });
+	}
+	void ResizeArray(LookupKey key, int size) {
+		Write(key, [&](auto& map) { map.ResizeArray(key, size); });
+	}
+	void ShrinkToFit(LookupKey key) {
+		Write(key, [&](auto& map) { map.ShrinkToFit(key); });
+	}
+
+	void Remove(LookupKey key) {
+		Write(key, [&](auto& map) { map.Remove(key); });
+	}
+	bool TryRemove(LookupKey key) {
+		return Write(key, [&](auto& map) { return map.TryRemove(key); });
+	}
+	void RemoveAll() {
+		for (size_t i = 0; i <= shardMask; i++) {
+			unique_lock<shared_mutex> lock(shards[i].Mutex);
+			shards[i].Map.RemoveAll();
+		}
+	}
+
+	// Every shard gets its own reclaim thread under Background
+	void SetReclaimMode(ReclaimMode mode) {
+		for (size_t i = 0; i <= shardMask; i++) {
+			unique_lock<shared_mutex> lock(shards[i].Mutex);
+			shards[i].Map.SetReclaimMode(mode);
+		}
+	}
+	void Reclaim() {
+		for (size_t i = 0; i <= shardMask; i++) {
+			unique_lock<shared_mutex> lock(shards[i].Mutex);
+			shards[i].Map.Reclaim();
+		}
+	}
+
+	// Each shard pools its own payloads, equal payloads in different shards are not shared
+	void SetInterning(InterningMode mode) {
+		for (size_t i = 0; i <= shardMask; i++) {
+			unique_lock<shared_mutex> lock(shards[i].Mutex);
+			shards[i].Map.SetInterning(mode);
+		}
+	}
+};
@@ -0,0 +1,460 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <functional>
+#include "ComplexMapIndex.h"
+#include "ComplexMapStorage.h"
+#include "ComplexMapEpoch.h"
+
+using namespace std;
+
+// Readers take no locks: they announce an epoch and probe an open-addressed slot array whose entries are published
+// with release stores. Writers are serialized and retire replaced nodes and outgrown slot arrays to the epoch domain
+// instead of freeing them. Nodes never move, growing copies only the slot pointers
+template <typename TKey, typename TValue>
+class LockFreeComplexMap {
+	typedef typename KeyTraits<TKey>::LookupKey LookupKey;
+
+	struct Node {
+		TKey Key;
+		ValueKind Kind;
+		int Size;
+		union {
+			TValue Value;
+			TValue* Values;
+			char* Line;
+		};
+
+		template <typename TKeyArg>
+		Node(TKeyArg&& key)
+			: Key{ forward<TKeyArg>(key) }, Kind{ ValueKind::None }, Size{ 0 }, Values{ nullptr } {
+		}
+	};
+
+	// Hash is written before Entry is published, so a reader that sees the node sees its hash and can skip other
+	// keys without touching their nodes
+	struct Slot {
+		atomic<size_t> Hash;
+		atomic<Node*> Entry;
+	};
+
+	struct Table {
+		size_t Mask;
+		Slot* Slots;
+
+		Table(size_t capacity)
+			: Mask{ capacity - 1 }, Slots{ new Slot[capacity] } {
+			for (size_t i = 0; i < capacity; i++) {
+				Slots[i].Hash.store(0, memory_order_relaxed);
+				Slots[i].Entry.store(nullptr, memory_order_relaxed);
+			}
+		}
+
+		~Table() {
+			delete[] Slots;
+		}
+	};
+
+	// Writer side position of a key: the slot holding it, or the slot a new entry for it goes to
+	struct Position {
+		Slot* Place;
+		bool IsFound;
+	};
+
+	static const size_t InitialCapacity = 16;
+
+	EpochDomain epochs;
+	// Read by every lookup, kept off the lines writers change
+	alignas(64) atomic<Table*> table;
+	alignas(64) mutex writeMutex;
+	atomic<int> size;
+	// Slots that are not empty, removed entries leave tombstones until the next rehash
+	size_t usedSlots;
+
+	static size_t GetHash(LookupKey key) {
+		unsigned long long hashCode = KeyTraits<TKey>::GetHash(key);
+		hashCode = (hashCode ^ (hashCode >> 30)) * 0xBF58476D1CE4E5B9ull;
+		hashCode = (hashCode ^ (hashCode >> 27)) * 0x94D049BB133111EBull;
+		return (size_t)(hashCode ^ (hashCode >> 31));
+	}
+
+	// Marks a removed entry, probes go on past it
+	static Node* GetTombstone() {
+		static char tombstone;
+		return (Node*)&tombstone;
+	}
+
+	static void DeleteNode(void* memory) {
+		Node* node = (Node*)memory;
+		if (node->Kind == ValueKind::Array)
+			delete[] node->Values;
+		else if (node->Kind == ValueKind::String)
+			delete[] node->Line;
+		delete node;
+	}
+
+	static void DeleteTable(void* memory) {
+		delete (Table*)memory;
+	}
+
+	static void DeleteTableAndNodes(void* memory) {
+		Table* oldTable = (Table*)memory;
+		for (size_t i = 0; i <= oldTable->Mask; i++) {
+			Node* node = oldTable->Slots[i].Entry.load(memory_order_relaxed);
+			if (node != nullptr && node != GetTombstone())
+				DeleteNode(node);
+		}
+		delete oldTable;
+	}
+
+	template <typename TKeyArg>
+	static Node* CreateValue(TKeyArg&& key, TValue value) {
+		Node* node = new Node(forward<TKeyArg>(key));
+		node->Kind = ValueKind::Value;
+		node->Value = value;
+		return node;
+	}
+	template <typename TKeyArg>
+	static Node* CreateArray(TKeyArg&& key, const TValue* values, int size) {
+		TValue* arrayValues = new TValue[size];
+		memcpy_s(arrayValues, size * sizeof(TValue), values, size * sizeof(TValue));
+
+		Node* node = new Node(forward<TKeyArg>(key));
+		node->Kind = ValueKind::Array;
+		node->Size = size;
+		node->Values = arrayValues;
+		return node;
+	}
+	template <typename TKeyArg>
+	static Node* CreateString(TKeyArg&& key, const char* line) {
+		int length = strlen(line);
+		char* stringValue = new char[length + 1];
+		memcpy_s(stringValue, length + 1, line, length + 1);
+
+		Node* node = new Node(forward<TKeyArg>(key));
+		node->Kind = ValueKind::String;
+		node->Size = length;
+		node->Line = stringValue;
+		return node;
+	}
+
+	// Writers keep at least half of the slots empty, so every probe ends
+	Node* FindNode(LookupKey key) {
+		size_t hash = GetHash(key);
+		Table* currentTable = table.load(memory_order_acquire);
+		for (size_t i = hash & currentTable->Mask;; i = (i + 1) & currentTable->Mask) {
+			Slot& slot = currentTable->Slots[i];
+			Node* node = slot.Entry.load(memory_order_acquire);
+			if (node == nullptr)
+				return nullptr;
+			if (node != GetTombstone() && slot.Hash.load(memory_order_relaxed) == hash && node->Key == key)
+				return node;
+		}
+	}
+
+	// Writer side, called under writeMutex. A new entry reuses the first tombstone on the probe
+	Position FindPosition(LookupKey key, size_t hash) {
+		Table* currentTable = table.load(memory_order_relaxed);
+		Slot* tombstone = nullptr;
+		for (size_t i = hash & currentTable->Mask;; i = (i + 1) & currentTable->Mask) {
+			Slot& slot = currentTable->Slots[i];
+			Node* node = slot.Entry.load(memory_order_relaxed);
+			if (node == nullptr)
+				return Position{ tombstone != nullptr ? tombstone : &slot, false };
+			if (node == GetTombstone()) {
+				if (tombstone == nullptr)
+					tombstone = &slot;
+			}
+			else if (slot.Hash.load(memory_order_relaxed) == hash && node->Key == key)
+				return Position{ &slot, true };
+		}
+	}
+
+	// Copies the live slots into a table a quarter full and drops the tombstones. Only the old slot array is
+	// retired, the nodes move over as they are
+	void Rehash() {
+		Table* oldTable = table.load(memory_order_relaxed);
+		size_t capacity = InitialCapacity;
+		while (capacity < (size_t)size.load(memory_order_relaxed) * 4)
+			capacity *= 2;
+
+		Table* newTable = new Table(capacity);
+		for (size_t i = 0; i <= oldTable->Mask; i++) {
+			Node* node = oldTable->Slots[i].Entry.load(memory_order_relaxed);
+			if (node == nullptr || node == GetTombstone())
+				continue;
+
+			size_t hash = oldTable->Slots[i].Hash.load(memory_order_relaxed);
+			size_t j = hash & newTable->Mask;
+			while (newTable->Slots[j].Entry.load(memory_order_relaxed) != nullptr)
+				j = (j + 1) & newTable->Mask;
+			newTable->Slots[j].Hash.store(hash, memory_order_relaxed);
+			newTable->Slots[j].Entry.store(node, memory_order_relaxed);
+		}
+
+		usedSlots = size.load(memory_order_relaxed);
+		table.store(newTable, memory_order_release);
+		epochs.Retire(oldTable, DeleteTable);
+	}
+
+	// Writer side, called under writeMutex
+	void PlaceNewNode(Position position, size_t hash, Node* node) {
+		if (position.Place->Entry.load(memory_order_relaxed) == nullptr)
+			usedSlots++;
+		position.Place->Hash.store(hash, memory_order_relaxed);
+		position.Place->Entry.store(node, memory_order_release);
+
+		size.store(size.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		if (usedSlots * 2 > table.load(memory_order_relaxed)->Mask + 1)
+			Rehash();
+	}
+
+	template <typename TCreateNode>
+	bool TryAddNode(LookupKey key, TCreateNode createNode) {
+		lock_guard<mutex> lock(writeMutex);
+		size_t hash = GetHash(key);
+		Position position = FindPosition(key, hash);
+		if (position.IsFound)
+			return false;
+
+		PlaceNewNode(position, hash, createNode());
+		return true;
+	}
+
+	template <typename TCreateNode>
+	void AddNode(LookupKey key, TCreateNode createNode) {
+		if (!TryAddNode(key, createNode))
+			throw "Key already exists";
+	}
+
+	void AddNodeOrReplace(Node* node) {
+		lock_guard<mutex> lock(writeMutex);
+		size_t hash = GetHash(node->Key);
+		Position position = FindPosition(node->Key, hash);
+		if (!position.IsFound) {
+			PlaceNewNode(position, hash, node);
+			return;
+		}
+
+		Node* oldNode = position.Place->Entry.load(memory_order_relaxed);
+		position.Place->Entry.store(node, memory_order_release);
+		epochs.Retire(oldNode, DeleteNode);
+	}
+
+	template <typename TCreateNode>
+	Node* GetOrAddNode(LookupKey key, TCreateNode createNode) {
+		Node* node = FindNode(key);
+		if (node != nullptr)
+			return node;
+
+		lock_guard<mutex> lock(writeMutex);
+		size_t hash = GetHash(key);
+		Position position = FindPosition(key, hash);
+		if (position.IsFound)
+			return position.Place->Entry.load(memory_order_relaxed);
+
+		node = createNode();
+		PlaceNewNode(position, hash, node);
+		return node;
+	}
+
+	bool RemoveNode(LookupKey key) {
+		lock_guard<mutex> lock(writeMutex);
+		Position position = FindPosition(key, GetHash(key));
+		if (!position.IsFound)
+			return false;
+
+		Node* node = position.Place->Entry.load(memory_order_relaxed);
+		position.Place->Entry.store(GetTombstone(), memory_order_release);
+		size.store(size.load(memory_order_relaxed) - 1, memory_order_relaxed);
+		epochs.Retire(node, DeleteNode);
+		return true;
+	}
+
+	Node* GetNode(LookupKey key) {
+		Node* node = FindNode(key);
+		if (node == nullptr)
+			throw "Key not found";
+
+		return node;
+	}
+
+	static const TValue* GetNodeArray(Node* node, int* size) {
+		if (node->Kind != ValueKind::Array)
+			throw "Invalid value type";
+
+		*size = node->Size;
+		return node->Values;
+	}
+
+	static const char* GetNodeString(Node* node) {
+		if (node->Kind != ValueKind::String)
+			throw "Invalid value type";
+
+		return node->Line;
+	}
+
+public:
+	// Keeps pointers returned by GetArray/GetString/TryGetArray/TryGetString valid until destroyed
+	class ReadGuard {
+		EpochDomain& epochs;
+		int threadId;
+
+	public:
+		ReadGuard(LockFreeComplexMap& map)
+			: epochs{ map.epochs }, threadId{ map.epochs.Enter() } {
+		}
+
+		ReadGuard(const ReadGuard&) = delete;
+		ReadGuard& operator=(const ReadGuard&) = delete;
+
+		~ReadGuard() {
+			epochs.Exit(threadId);
+		}
+	};
+
+	LockFreeComplexMap()
+		: table{ new Table(InitialCapacity) }, size{ 0 }, usedSlots{ 0 } {
+	}
+
+	LockFreeComplexMap(const LockFreeComplexMap&) = delete;
+	LockFreeComplexMap& operator=(const LockFreeComplexMap&) = delete;
+
+	~LockFreeComplexMap() {
+		DeleteTableAndNodes(table.load(memory_order_relaxed));
+	}
+
+	int GetSize() {
+		return size.load(memory_order_relaxed);
+	}
+
+	template <typename TKeyArg>
+	void AddValue(TKeyArg&& key, TValue value) {
+		AddNode(key, [&]() { return CreateValue(forward<TKeyArg>(key), value); });
+	}
+	template <typename TKeyArg>
+	void AddArray(TKeyArg&& key, TValue* values, int size) {
+		AddNode(key, [&]() { return CreateArray(forward<TKeyArg>(key), values, size); });
+	}
+	template <typename TKeyArg>
+	void AddString(TKeyArg&& key, const char* line) {
+		AddNode(key, [&]() { return CreateString(forward<TKeyArg>(key), line); });
+	}
+
+	template <typename TKeyArg>
+	bool TryAddValue(TKeyArg&& key, TValue value) {
+		return TryAddNode(key, [&]() { return CreateValue(forward<TKeyArg>(key), value); });
+	}
+	template <typename TKeyArg>
+	bool TryAddArray(TKeyArg&& key, TValue* values, int size) {
+		return TryAddNode(key, [&]() { return CreateArray(forward<TKeyArg>(key), values, size); });
+	}
+	template <typename TKeyArg>
+	bool TryAddString(TKeyArg&& key, const char* line) {
+		return TryAddNode(key, [&]() { return CreateString(forward<TKeyArg>(key), line); });
+	}
+
+	template <typename TKeyArg>
+	void AddValueOrReplace(TKeyArg&& key, TValue value) {
+		AddNodeOrReplace(CreateValue(forward<TKeyArg>(key), value));
+	}
+	template <typename TKeyArg>
+	void AddArrayOrReplace(TKeyArg&& key, TValue* values, int size) {
+		AddNodeOrReplace(CreateArray(forward<TKeyArg>(key), values, size));
+	}
+	template <typename TKeyArg>
+	void AddStringOrReplace(TKeyArg&& key, const char* line) {
+		AddNodeOrReplace(CreateString(forward<TKeyArg>(key), line));
+	}
+
+	TValue GetValue(LookupKey key) {
+		ReadGuard guard(*this);
+		Node* node = GetNode(key);
+		if (node->Kind != ValueKind::Value)
+			throw "Invalid value type";
+
+		return node->Value;
+	}
+	const TValue* GetArray(LookupKey key, int* size) {
+		ReadGuard guard(*this);
+		return GetNodeArray(GetNode(key), size);
+	}
+	const char* GetString(LookupKey key) {
+		ReadGuard guard(*this);
+		return GetNodeString(GetNode(key));
+	}
+
+	bool TryGetValue(LookupKey key, TValue* value) {
+		ReadGuard guard(*this);
+		Node* node = FindNode(key);
+		if (node == nullptr || node->Kind != ValueKind::Value)
+			return false;
+
+		*value = node->Value;
+		return true;
+	}
+	bool TryGetArray(LookupKey key, const TValue** values, int* size) {
+		ReadGuard guard(*this);
+		Node* node = FindNode(key);
+		if (node == nullptr || node->Kind != ValueKind::Array)
+			return false;
+
+		*values = node->Values;
+		*size = node->Size;
+		return true;
+	}
+	bool TryGetString(LookupKey key, const char** line) {
+		ReadGuard guard(*this);
+		Node* node = FindNode(key);
+		if (node == nullptr || node->Kind != ValueKind::String)
+			return false;
+
+		*line = node->Line;
+		return true;
+	}
+
+	template <typename TKeyArg>
+	TValue GetOrAddValue(TKeyArg&& key, TValue value) {
+		ReadGuard guard(*this);
+		Node* node = GetOrAddNode(key, [&]() { return CreateValue(forward<TKeyArg>(key), value); });
+		if (node->Kind != ValueKind::Value)
+			throw "Invalid value type";
+
+		return node->Value;
+	}
+	template <typename TKeyArg>
+	const TValue* GetOrAddArray(TKeyArg&& key, int* resultSize, TValue* values, int size) {
+		ReadGuard guard(*this);
+		return GetNodeArray(GetOrAddNode(key, [&]() { return CreateArray(forward<TKeyArg>(key), values, size); }), resultSize);
+	}
+	template <typename TKeyArg>
+	const char* GetOrAddString(TKeyArg&& key, const char* line) {
+		ReadGuard guard(*this);
+		return GetNodeString(GetOrAddNode(key, [&]() { return CreateString(forward<TKeyArg>(key), line); }));
+	}
+
+	void Remove(LookupKey key) {
+		if (!RemoveNode(key))
+			throw "Key not found";
+	}
+	bool TryRemove(LookupKey key) {
+		return RemoveNode(key);
+	}
+	void RemoveAll() {
+		lock_guard<mutex> lock(writeMutex);
+		Table* oldTable = table.load(memory_order_relaxed);
+		table.store(new Table(InitialCapacity), memory_order_release);
+		size.store(0, memory_order_relaxed);
+		usedSlots = 0;
+
+		epochs.Retire(oldTable, DeleteTableAndNodes);
+	}
+
+	// Frees retired nodes that no reader can still observe
+	void Reclaim() {
+		lock_guard<mutex> lock(writeMutex);
+		epochs.Reclaim();
+	}
+};
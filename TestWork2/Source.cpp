@@ -1,13 +1,79 @@
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <functional>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <cstdlib>
+#include <cstdio>
+#include <cstddef>
+#include <fstream>
+#include <new>
 #include "ComplexMap.h"
+#include "ConcurrentComplexMap.h"
+#include "LockFreeComplexMap.h"
+#include "ColumnarComplexMap.h"
+#include "CachedComplexMap.h"
+#include "ComplexMapTiered.h"
+#include "ComplexMapJournal.h"
 
 using namespace std;
 
+atomic<long long> allocationCount(0);
+
+void* operator new(size_t size) {
+	allocationCount.fetch_add(1, memory_order_relaxed);
+	void* memory = malloc(size == 0 ? 1 : size);
+	if (memory == nullptr)
+		throw bad_alloc();
+	return memory;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+	try {
+		return operator new(size);
+	}
+	catch (...) {
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+	return operator new(size, nothrow);
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+	operator delete(memory);
+}
+
+void operator delete(void* memory, size_t size) noexcept {
+	operator delete(memory);
+}
+
+void operator delete[](void* memory, size_t size) noexcept {
+	operator delete(memory);
+}
+
 template <typename TValue>
-string ArrayToString(TValue* array, int size) {
+string ArrayToString(const TValue* array, int size) {
 	string result;
+	if (size == 0)
+		return result;
 	for (int i = 0; i < size - 1; i++)
 		result += to_string(array[i]) + ", ";
 	result += to_string(array[size - 1]);
@@ -15,7 +81,7 @@ string ArrayToString(TValue* array, int size) {
 }
 
 template <typename TValue>
-bool ArraysEqual(TValue* firstArray, int firstSize, TValue* secondArray, int secondSize) {
+bool ArraysEqual(const TValue* firstArray, int firstSize, const TValue* secondArray, int secondSize) {
 	if (firstSize != secondSize)
 		return false;
 	for (int i = 0; i < firstSize; i++)
@@ -24,8 +90,8 @@ bool ArraysEqual(TValue* firstArray, int firstSize, TValue* secondArray, int sec
 	return true;
 }
 
-template <typename TKey, typename TValue>
-void AssertGetValue(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue expectedValue) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertGetValue(TComplexMap& complexMap, TKey key, TValue expectedValue) {
 	TValue value = complexMap.GetValue(key);
 
 	cout << "Key: " << key << " Value: " << value << endl;
@@ -35,10 +101,10 @@ void AssertGetValue(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue expec
 		throw "Values not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertGetArray(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue* expectedArray, int expectedSize) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertGetArray(TComplexMap& complexMap, TKey key, TValue* expectedArray, int expectedSize) {
 	int size;
-	TValue* array = complexMap.GetArray(key, &size);
+	const TValue* array = complexMap.GetArray(key, &size);
 
 	cout << "Key: " << key << " Size: " << size << " Values: " << ArrayToString(array, size) << endl;
 	cout << "Key: " << key << " Size: " << expectedSize << " Values: " << ArrayToString(expectedArray, expectedSize) << " (test)" << endl << endl;
@@ -47,8 +113,8 @@ void AssertGetArray(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue* expe
 		throw "Arrays not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertGetOrAddValue(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue newValue, TValue expectedValue) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertGetOrAddValue(TComplexMap& complexMap, TKey key, TValue newValue, TValue expectedValue) {
 	TValue value = complexMap.GetOrAddValue(key, newValue);
 
 	cout << "Key: " << key << " Value: " << value << endl;
@@ -58,10 +124,10 @@ void AssertGetOrAddValue(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue
 		throw "Values not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertGetOrAddArray(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue* newArray, int newSize, TValue* expectedArray, int expectedSize) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertGetOrAddArray(TComplexMap& complexMap, TKey key, TValue* newArray, int newSize, TValue* expectedArray, int expectedSize) {
 	int size;
-	TValue* array = complexMap.GetOrAddArray(key, &size, newArray, newSize);
+	const TValue* array = complexMap.GetOrAddArray(key, &size, newArray, newSize);
 
 	cout << "Key: " << key << " Size: " << size << " Values: " << ArrayToString(array, size) << endl;
 	cout << "Key: " << key << " Size: " << expectedSize << " Values: " << ArrayToString(expectedArray, expectedSize) << " (test)" << endl << endl;
@@ -70,9 +136,9 @@ void AssertGetOrAddArray(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue*
 		throw "Arrays not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertGetOrAddString(ComplexMap<TKey, TValue>& complexMap, TKey key, const char* newLine, const char* expectedLine) {
-	char* line = complexMap.GetOrAddString(key, newLine);
+template <typename TComplexMap, typename TKey>
+void AssertGetOrAddString(TComplexMap& complexMap, TKey key, const char* newLine, const char* expectedLine) {
+	const char* line = complexMap.GetOrAddString(key, newLine);
 
 	cout << "Key: " << key << " Line: " << line << endl;
 	cout << "Key: " << key << " Line: " << expectedLine << " (test)" << endl << endl;
@@ -81,9 +147,9 @@ void AssertGetOrAddString(ComplexMap<TKey, TValue>& complexMap, TKey key, const
 		throw "Strings not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertGetString(ComplexMap<TKey, TValue>& complexMap, TKey key, const char* expectedLine) {
-	char* line = complexMap.GetString(key);
+template <typename TComplexMap, typename TKey>
+void AssertGetString(TComplexMap& complexMap, TKey key, const char* expectedLine) {
+	const char* line = complexMap.GetString(key);
 
 	cout << "Key: " << key << " Line: " << line << endl;
 	cout << "Key: " << key << " Line: " << expectedLine << " (test)" << endl << endl;
@@ -92,8 +158,8 @@ void AssertGetString(ComplexMap<TKey, TValue>& complexMap, TKey key, const char*
 		throw "Strings not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertTryAddValue(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue value, bool mustBeAdded) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertTryAddValue(TComplexMap& complexMap, TKey key, TValue value, bool mustBeAdded) {
 	bool isAdded = complexMap.TryAddValue(key, value);
 
 	if (isAdded)
@@ -105,8 +171,8 @@ void AssertTryAddValue(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue va
 		throw isAdded ? "Value must be not added!" : "Value must be added!";
 }
 
-template <typename TKey, typename TValue>
-void AssertTryAddArray(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue* array, int size, bool mustBeAdded) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertTryAddArray(TComplexMap& complexMap, TKey key, TValue* array, int size, bool mustBeAdded) {
 	bool isAdded = complexMap.TryAddArray(key, array, size);
 
 	if (isAdded)
@@ -118,8 +184,8 @@ void AssertTryAddArray(ComplexMap<TKey, TValue>& complexMap, TKey key, TValue* a
 		throw isAdded ? "Values must be not added!" : "Values must be added!";
 }
 
-template <typename TKey, typename TValue>
-void AssertTryAddString(ComplexMap<TKey, TValue>& complexMap, TKey key, const char* line, bool mustBeAdded) {
+template <typename TComplexMap, typename TKey>
+void AssertTryAddString(TComplexMap& complexMap, TKey key, const char* line, bool mustBeAdded) {
 	bool isAdded = complexMap.TryAddString(key, line);
 
 	if (isAdded)
@@ -131,8 +197,8 @@ void AssertTryAddString(ComplexMap<TKey, TValue>& complexMap, TKey key, const ch
 		throw isAdded ? "Line must be not added!" : "Line must be added!";
 }
 
-template <typename TKey, typename TValue>
-void AssertTryGetValue(ComplexMap<TKey, TValue>& complexMap, TKey key, bool mustBeFound, TValue expectedValue) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertTryGetValue(TComplexMap& complexMap, TKey key, bool mustBeFound, TValue expectedValue) {
 	TValue value;
 	bool isFound = complexMap.TryGetValue(key, &value);
 
@@ -156,10 +222,10 @@ void AssertTryGetValue(ComplexMap<TKey, TValue>& complexMap, TKey key, bool must
 		throw "Values not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertTryGetArray(ComplexMap<TKey, TValue>& complexMap, TKey key, bool mustBeFound, TValue* expectedArray, int expectedSize) {
+template <typename TComplexMap, typename TKey, typename TValue>
+void AssertTryGetArray(TComplexMap& complexMap, TKey key, bool mustBeFound, TValue* expectedArray, int expectedSize) {
 	int size;
-	TValue* array;
+	const TValue* array;
 	bool isFound = complexMap.TryGetArray(key, &array, &size);
 
 	if (isFound)
@@ -182,9 +248,9 @@ void AssertTryGetArray(ComplexMap<TKey, TValue>& complexMap, TKey key, bool must
 		throw "Arrays not equal!";
 }
 
-template <typename TKey, typename TValue>
-void AssertTryGetString(ComplexMap<TKey, TValue>& complexMap, TKey key, bool mustBeFound, const char* expectedLine) {
-	char* line;
+template <typename TComplexMap, typename TKey>
+void AssertTryGetString(TComplexMap& complexMap, TKey key, bool mustBeFound, const char* expectedLine) {
+	const char* line;
 	bool isFound = complexMap.TryGetString(key, &line);
 
 	if (isFound)
@@ -220,8 +286,9 @@ void AssertConstCharException(const char* previewMessage, function<void()> actio
 	throw "Exception not found!";
 }
 
+template <template <typename, typename> class TComplexMap>
 void SimpleTest() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	if (complexMap.GetSize() != 0)
 		throw "ComplexMap size not 0";
@@ -251,8 +318,9 @@ void SimpleTest() {
 		throw "ComplexMap size not 0";
 }
 
+template <template <typename, typename> class TComplexMap>
 void TryAddMethods() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	complexMap.AddValue(16, 222);
 	int array1[] = { 4, 5, 6, 7 };
@@ -280,8 +348,9 @@ void TryAddMethods() {
 	AssertTryAddString(complexMap, 16, "123123", false);
 }
 
+template <template <typename, typename> class TComplexMap>
 void TryGetMethods() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	complexMap.AddValue(16, 222);
 	int array1[] = { 4, 5, 6, 7 };
@@ -304,8 +373,9 @@ void TryGetMethods() {
 	AssertTryGetString(complexMap, 111, false, "");
 }
 
+template <template <typename, typename> class TComplexMap>
 void GetOrAddMethods() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	int size;
 	complexMap.AddValue(16, 222);
@@ -328,8 +398,9 @@ void GetOrAddMethods() {
 	AssertConstCharException("Check exception on GetOrAddString instead of GetValue", [&]() { complexMap.GetOrAddString(16, "qq123123"); });
 }
 
+template <template <typename, typename> class TComplexMap>
 void SimpleTestWithOtherTypes() {
-	ComplexMap<double, double> complexMap;
+	TComplexMap<double, double> complexMap;
 
 	if (complexMap.GetSize() != 0)
 		throw "ComplexMap size not 0";
@@ -359,17 +430,19 @@ void SimpleTestWithOtherTypes() {
 		throw "ComplexMap size not 0";
 }
 
+template <template <typename, typename> class TComplexMap>
 void ExceptionOnGetMissingKeys() {
 	int size;
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	AssertConstCharException("Check exception on GetValue by missing key", [&]() { complexMap.GetValue(16); });
 	AssertConstCharException("Check exception on GetArray by missing key", [&]() { complexMap.GetArray(16, &size); });
 	AssertConstCharException("Check exception on GetString by missing key", [&]() { complexMap.GetString(16); });
 }
 
+template <template <typename, typename> class TComplexMap>
 void ExceptionOnAddingDuplicateValue() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	complexMap.AddValue(16, 222);
 	AssertConstCharException("Check exception on AddValue", [&]() { complexMap.AddValue(16, 333); });
@@ -383,8 +456,9 @@ void ExceptionOnAddingDuplicateValue() {
 	AssertConstCharException("Check exception on AddString", [&]() { complexMap.AddString(993, "123123"); });
 }
 
+template <template <typename, typename> class TComplexMap>
 void ReplaceOnAddingDuplicateValue() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	complexMap.AddValueOrReplace(16, 222);
 	complexMap.AddValueOrReplace(16, 333);
@@ -404,9 +478,10 @@ void ReplaceOnAddingDuplicateValue() {
 	AssertGetValue(complexMap, 993, 222);
 }
 
+template <template <typename, typename> class TComplexMap>
 void ExceptionOnGetInvalidType() {
 	int size;
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	complexMap.AddValue(16, 222);
 	AssertConstCharException("Check exception on GetArray instead of GetValue", [&]() { complexMap.GetArray(16, &size); });
@@ -422,8 +497,9 @@ void ExceptionOnGetInvalidType() {
 	AssertConstCharException("Check exception on GetArray instead of GetString", [&]() { complexMap.GetArray(993, &size); });
 }
 
+template <template <typename, typename> class TComplexMap>
 void RemoveTempMemory() {
-	ComplexMap<int, int> complexMap;
+	TComplexMap<int, int> complexMap;
 
 	int* array1 = new int[4]{ 4, 5, 6, 7 };
 	complexMap.AddArray(142, array1, 4);
@@ -439,16 +515,1869 @@ void RemoveTempMemory() {
 	AssertTryGetString(complexMap, 993, true, "123123");
 }
 
+template <template <typename, typename> class TComplexMap>
+void ManyKeysTest() {
+	TComplexMap<int, int> complexMap;
+
+	for (int i = 0; i < 10000; i++)
+		complexMap.AddValue(i * 7, i);
+	for (int i = 0; i < 10000; i += 2)
+		complexMap.Remove(i * 7);
+
+	if (complexMap.GetSize() != 5000)
+		throw "ComplexMap size not 5000";
+
+	int value;
+	for (int i = 0; i < 10000; i++)
+		if (complexMap.TryGetValue(i * 7, &value) != (i % 2 == 1) || (i % 2 == 1 && value != i))
+			throw "Values not equal!";
+
+	for (int i = 0; i < 10000; i += 2)
+		complexMap.AddValueOrReplace(i * 7, -i);
+	for (int i = 0; i < 10000; i++)
+		if (complexMap.GetValue(i * 7) != (i % 2 == 1 ? i : -i))
+			throw "Values not equal!";
+
+	complexMap.RemoveAll();
+	if (complexMap.GetSize() != 0)
+		throw "ComplexMap size not 0";
+}
+
+template <template <typename, typename> class TComplexMap>
+void OwnershipTransfer() {
+	TComplexMap<int, int> complexMap;
+
+	vector<int> vector1 = { 4, 5, 6, 7, 8, 9, 10, 11 };
+	int* vector1Data = vector1.data();
+	complexMap.AddArray(142, move(vector1));
+	int size;
+	if (complexMap.GetArray(142, &size) != vector1Data || size != 8)
+		throw "Vector payload was copied!";
+
+	unique_ptr<int[]> array1(new int[3]{ 74, 73, 72 });
+	int* array1Data = array1.get();
+	complexMap.AddArray(147, move(array1), 3);
+	if (complexMap.GetArray(147, &size) != array1Data || size != 3)
+		throw "Array payload was copied!";
+
+	string line1 = "this line is longer than any small string buffer";
+	const char* line1Data = line1.c_str();
+	complexMap.AddString(993, move(line1));
+	if (complexMap.GetString(993) != line1Data)
+		throw "String payload was copied!";
+
+	complexMap.AddString(995, "321321123", 6);
+	AssertGetString(complexMap, 995, "321321");
+
+	int expectedArray[] = { 1, 2 };
+	if (complexMap.TryAddArray(142, unique_ptr<int[]>(new int[2]{ 1, 2 }), 2))
+		throw "Values must be not added!";
+	complexMap.AddArrayOrReplace(142, unique_ptr<int[]>(new int[2]{ 1, 2 }), 2);
+	AssertGetArray(complexMap, 142, expectedArray, 2);
+	complexMap.AddArrayOrReplace(147, vector<int>{ 1, 2 });
+	AssertGetArray(complexMap, 147, expectedArray, 2);
+	if (complexMap.TryAddString(993, string("qq")))
+		throw "Line must be not added!";
+	complexMap.AddStringOrReplace(993, string("qq"));
+	AssertGetString(complexMap, 993, "qq");
+
+	AssertConstCharException("Check exception on AddArray with vector", [&]() { complexMap.AddArray(142, vector<int>{ 1 }); });
+	AssertConstCharException("Check exception on AddString with length", [&]() { complexMap.AddString(995, "1", 1); });
+}
+
+void ZeroCopyAllocations() {
+	ComplexMap<int, int> complexMap;
+
+	long long allocations = allocationCount;
+	complexMap.AddValue(16, 222);
+	long long valueAllocations = allocationCount - allocations;
+
+	vector<int> vector1(256 * 1024, 7);
+	allocations = allocationCount;
+	complexMap.AddArray(142, move(vector1));
+	if (allocationCount - allocations != valueAllocations)
+		throw "Vector payload allocates!";
+
+	unique_ptr<int[]> array1(new int[256 * 1024]);
+	allocations = allocationCount;
+	complexMap.AddArray(147, move(array1), 256 * 1024);
+	if (allocationCount - allocations != valueAllocations)
+		throw "Array payload allocates!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void LazyAddMethods() {
+	TComplexMap<int, int> complexMap;
+
+	int size;
+	int producerCalls = 0;
+	int array1[] = { 4, 5, 6, 7 };
+	complexMap.AddValue(16, 222);
+	complexMap.AddArray(142, array1, sizeof(array1) / sizeof(int));
+	complexMap.AddString(993, "123123");
+
+	AssertGetOrAddValue(complexMap, 16, 100, 222);
+	if (complexMap.GetOrAddValueWith(16, [&]() { producerCalls++; return 100; }) != 222)
+		throw "Values not equal!";
+	if (complexMap.GetOrAddValueWith(22, [&]() { producerCalls++; return 100; }) != 100)
+		throw "Values not equal!";
+
+	const int* array = complexMap.GetOrAddArrayWith(142, &size, [&]() { producerCalls++; return vector<int>{ 1, 2 }; });
+	if (!ArraysEqual(array, size, array1, sizeof(array1) / sizeof(int)))
+		throw "Arrays not equal!";
+	int array2[] = { 1, 2 };
+	array = complexMap.GetOrAddArrayWith(166, &size, [&]() { producerCalls++; return vector<int>{ 1, 2 }; });
+	if (!ArraysEqual(array, size, array2, sizeof(array2) / sizeof(int)))
+		throw "Arrays not equal!";
+
+	if (strcmp(complexMap.GetOrAddStringWith(993, [&]() { producerCalls++; return string("qq"); }), "123123") != 0)
+		throw "Strings not equal!";
+	if (strcmp(complexMap.GetOrAddStringWith(111, [&]() { producerCalls++; return "qq"; }), "qq") != 0)
+		throw "Strings not equal!";
+
+	if (complexMap.TryAddValueWith(16, [&]() { producerCalls++; return 1; }))
+		throw "Value must be not added!";
+	if (complexMap.TryAddArrayWith(142, [&]() { producerCalls++; return vector<int>{ 1 }; }))
+		throw "Values must be not added!";
+	if (!complexMap.TryAddStringWith(112, [&]() { producerCalls++; return string("ww"); }))
+		throw "Line must be added!";
+
+	if (producerCalls != 4)
+		throw "Producer called for existing key!";
+
+	AssertConstCharException("Check exception on GetOrAddArrayWith instead of GetValue", [&]() { complexMap.GetOrAddArrayWith(16, &size, [&]() { producerCalls++; return vector<int>{ 1 }; }); });
+	AssertConstCharException("Check exception on failed producer", [&]() { complexMap.TryAddArrayWith(200, []() -> vector<int> { throw "Producer failed"; }); });
+	if (complexMap.TryGetArray(200, &array, &size) || complexMap.GetSize() != 7)
+		throw "Failed producer left the key!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void HitPathAllocations() {
+	TComplexMap<int, int> complexMap;
+
+	int size;
+	int array1[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	complexMap.AddValue(16, 222);
+	complexMap.AddArray(142, array1, sizeof(array1) / sizeof(int));
+	complexMap.AddString(993, "this line is longer than the inline buffer");
+
+	long long allocations = allocationCount;
+	complexMap.GetOrAddValue(16, 100);
+	complexMap.GetOrAddArray(142, &size, array1, sizeof(array1) / sizeof(int));
+	complexMap.GetOrAddString(993, "this line is longer than the inline buffer");
+	complexMap.TryAddValue(16, 100);
+	complexMap.TryAddArray(142, array1, sizeof(array1) / sizeof(int));
+	complexMap.TryAddString(993, "this line is longer than the inline buffer");
+	if (allocationCount != allocations)
+		throw "Hit path allocates!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void StringKeyLookup() {
+	TComplexMap<string, int> complexMap;
+
+	string firstKey = "first key that is longer than the small string buffer";
+	string secondKey = "second key that is longer than the small string buffer";
+	string thirdKey = "third key that is longer than the small string buffer";
+	complexMap.AddValue(firstKey, 1);
+
+	long long allocations = allocationCount;
+	complexMap.AddValue(secondKey, 2);
+	long long copiedKeyAllocations = allocationCount - allocations;
+	allocations = allocationCount;
+	complexMap.AddValue(move(thirdKey), 3);
+	if (allocationCount - allocations != copiedKeyAllocations - 1)
+		throw "Added key is not moved into the index!";
+
+	int value;
+	allocations = allocationCount;
+	AssertGetValue(complexMap, "first key that is longer than the small string buffer", 1);
+	if (complexMap.GetValue(string_view(secondKey)) != 2)
+		throw "Values not equal!";
+	if (!complexMap.TryGetValue("third key that is longer than the small string buffer", &value) || value != 3)
+		throw "Values not equal!";
+	if (complexMap.TryGetValue("missing key that is longer than the small string buffer", &value))
+		throw "Missing key found!";
+	if (allocationCount != allocations)
+		throw "Key lookup allocates!";
+
+	complexMap.Remove(string_view(firstKey));
+	if (complexMap.TryRemove("first key that is longer than the small string buffer"))
+		throw "Removed key found!";
+	if (complexMap.GetSize() != 2)
+		throw "ComplexMap size not 2";
+}
+
+template <template <typename, typename> class TComplexMap>
+void SnapshotRoundTrip() {
+	const char* path = "ComplexMapSnapshot.tmp";
+	int array1[] = { 4, 5, 6, 7 };
+	int array2[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	{
+		TComplexMap<int, int> complexMap;
+		complexMap.AddValue(16, 222);
+		complexMap.AddValue(-63, 333);
+		complexMap.AddArray(142, array1, sizeof(array1) / sizeof(int));
+		complexMap.AddArray(147, array2, sizeof(array2) / sizeof(int));
+		complexMap.AddArray(148, array1, 0);
+		complexMap.AddString(993, "123123");
+		complexMap.AddString(995, "this line is longer than the inline buffer");
+		complexMap.AddString(996, "");
+		complexMap.AddString(997, "zero\0inside", 11);
+		for (int i = 0; i < 1000; i++)
+			complexMap.AddValue(10000 + i, i);
+		complexMap.SaveSnapshot(path);
+	}
+	if (ifstream(string(path) + ".tmp"))
+		throw "Snapshot left its temporary file!";
+
+	// Saving the loaded map again checks that loading kept the stored string lengths
+	TComplexMap<int, int> loadedMap;
+	loadedMap.AddValue(1, 1);
+	loadedMap.LoadSnapshot(path);
+	loadedMap.SaveSnapshot(path);
+	if (loadedMap.GetSize() != 1009)
+		throw "ComplexMap size not 1009";
+	AssertTryGetValue(loadedMap, 1, false, 0);
+	AssertGetValue(loadedMap, 16, 222);
+	AssertGetValue(loadedMap, -63, 333);
+	AssertGetValue(loadedMap, 10999, 999);
+	AssertGetArray(loadedMap, 142, array1, sizeof(array1) / sizeof(int));
+	AssertGetArray(loadedMap, 147, array2, sizeof(array2) / sizeof(int));
+	AssertGetArray(loadedMap, 148, array1, 0);
+	AssertGetString(loadedMap, 993, "123123");
+	AssertGetString(loadedMap, 995, "this line is longer than the inline buffer");
+	AssertGetString(loadedMap, 996, "");
+
+	long long allocations = allocationCount;
+	{
+		MappedComplexMap<int, int> mappedMap(path);
+		int size;
+		const int* values;
+		const char* line;
+		int length;
+		if (mappedMap.GetSize() != 1009 || mappedMap.GetValue(10500) != 500 || mappedMap.GetValue(-63) != 333)
+			throw "Mapped values not equal!";
+		values = mappedMap.GetArray(147, &size);
+		if (!ArraysEqual(values, size, array2, sizeof(array2) / sizeof(int)) || (size_t)values % alignof(int) != 0)
+			throw "Mapped arrays not equal!";
+		if (!mappedMap.TryGetString(995, &line) || strcmp(line, "this line is longer than the inline buffer") != 0 || line != mappedMap.GetString(995))
+			throw "Mapped strings not equal!";
+		line = mappedMap.GetString(997, &length);
+		if (length != 11 || memcmp(line, "zero\0inside", 12) != 0)
+			throw "Mapped string lost its length!";
+		if (mappedMap.TryGetArray(16, &values, &size) || mappedMap.TryGetString(17, &line))
+			throw "Mapped map returns invalid entries!";
+		AssertConstCharException("Check exception on mapped GetValue by missing key", [&]() { mappedMap.GetValue(17); });
+		AssertConstCharException("Check exception on mapped GetString instead of GetValue", [&]() { mappedMap.GetString(16); });
+	}
+	if (allocationCount != allocations)
+		throw "Mapped snapshot allocates!";
+
+	{
+		// The last entry is the value of key 10999, loading used to fail on it only after the other entries were added
+		typedef SnapshotEntry<int, int> Entry;
+		fstream file(path, ios::in | ios::out | ios::binary | ios::ate);
+		file.seekp((long long)file.tellp() - (long long)sizeof(Entry) + (long long)offsetof(Entry, Kind));
+		ValueKind brokenKind = (ValueKind)100;
+		file.write((const char*)&brokenKind, sizeof(brokenKind));
+	}
+	AssertConstCharException("Check exception on loading snapshot with a corrupted entry", [&]() { loadedMap.LoadSnapshot(path); });
+	if (loadedMap.GetSize() != 1009)
+		throw "Corrupted snapshot changed the map!";
+	AssertGetArray(loadedMap, 147, array2, sizeof(array2) / sizeof(int));
+	AssertGetString(loadedMap, 993, "123123");
+	AssertGetValue(loadedMap, 10999, 999);
+
+	{
+		fstream file(path, ios::in | ios::out | ios::binary);
+		file.write("BROKEN", 6);
+	}
+	AssertConstCharException("Check exception on loading corrupted snapshot", [&]() { loadedMap.LoadSnapshot(path); });
+	AssertGetValue(loadedMap, 16, 222);
+	remove(path);
+	AssertConstCharException("Check exception on loading missing snapshot", [&]() { MappedComplexMap<int, int> mappedMap(path); });
+}
+
+template <template <typename, typename> class TComplexMap>
+void TypedIteration() {
+	TComplexMap<int, int> complexMap;
+
+	int array1[] = { 4, 5, 6, 7 };
+	for (int i = 0; i < 30; i++)
+		if (i % 3 == 0)
+			complexMap.AddValue(i, i);
+		else if (i % 3 == 1)
+			complexMap.AddArray(i, array1, i % 4);
+		else
+			complexMap.AddString(i, to_string(i).c_str());
+
+	int valueSum = 0;
+	int arraySizes = 0;
+	int stringCount = 0;
+	complexMap.ForEachValue([&](int key, int value) { valueSum += key == value ? value : -1000; });
+	complexMap.ForEachArray([&](int key, const int* values, int size) { arraySizes += size == key % 4 ? size : -1000; });
+	complexMap.ForEachString([&](int key, const char* line) { stringCount += to_string(key) == line ? 1 : -1000; });
+	if (valueSum != 135 || arraySizes != 13 || stringCount != 10)
+		throw "Typed iteration visits wrong entries!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void OrderedCursors() {
+	TComplexMap<int, int> complexMap;
+
+	for (int i = 0; i < 100; i += 2)
+		if (i % 10 == 4)
+			complexMap.AddString(i, "line");
+		else
+			complexMap.AddValue(i, i * 10);
+
+	vector<int> keys;
+	complexMap.ForEachInRange(10, 20, [&](auto& entry) { keys.push_back(entry.GetKey()); });
+	if (keys != vector<int>{ 10, 12, 14, 16, 18 })
+		throw "Range scan returns wrong keys!";
+
+	auto reverseCursor = complexMap.GetReverseCursor(15);
+	if (!reverseCursor.IsValid() || reverseCursor.GetKey() != 14 || reverseCursor.GetKind() != ValueKind::String || strcmp(reverseCursor.GetString(), "line") != 0)
+		throw "Reverse cursor starts at wrong key!";
+	reverseCursor.MoveNext();
+	if (reverseCursor.GetKey() != 12 || reverseCursor.GetValue() != 120)
+		throw "Reverse cursor moves to wrong key!";
+	AssertConstCharException("Check exception on cursor GetArray instead of GetValue", [&]() { int size; reverseCursor.GetArray(&size); });
+	if (complexMap.GetReverseCursorBefore(0).IsValid() || complexMap.GetCursorAfter(98).IsValid() || complexMap.GetReverseCursor().GetKey() != 98)
+		throw "Cursor bounds are wrong!";
+
+	// Page through the map resuming after the last key of each page
+	keys.clear();
+	auto cursor = complexMap.GetCursor();
+	while (cursor.IsValid()) {
+		int lastKey = 0;
+		for (int i = 0; i < 7 && cursor.IsValid(); i++, cursor.MoveNext()) {
+			lastKey = cursor.GetKey();
+			keys.push_back(lastKey);
+		}
+		complexMap.Remove(lastKey);
+		cursor = complexMap.GetCursorAfter(lastKey);
+	}
+	if (keys.size() != 50 || keys[0] != 0 || keys[49] != 98 || complexMap.GetSize() != 42)
+		throw "Cursor paging loses keys!";
+}
+
+template <typename TValue>
+void AssertColumnarAggregates(ColumnarComplexMap<int, TValue>& complexMap, const map<int, TValue>& expected) {
+	typename ValueKernels<TValue>::SumType sum = 0;
+	for (auto& entry : expected) {
+		sum += entry.second;
+		AssertGetValue(complexMap, entry.first, entry.second);
+	}
+	if (complexMap.SumValues() != sum)
+		throw "Columnar sum is wrong!";
+
+	TValue minimum;
+	TValue maximum;
+	if (complexMap.MinMaxValues(&minimum, &maximum) != !expected.empty())
+		throw "Columnar min/max found values in an empty column!";
+	if (!expected.empty() && (minimum != min_element(expected.begin(), expected.end(), [](auto& first, auto& second) { return first.second < second.second; })->second
+		|| maximum != max_element(expected.begin(), expected.end(), [](auto& first, auto& second) { return first.second < second.second; })->second))
+		throw "Columnar min/max is wrong!";
+
+	// The vector kernels must agree with the scalar fallback
+	vector<TValue> expectedValues;
+	for (auto& entry : expected)
+		expectedValues.push_back(entry.second);
+	ValueComparison comparisons[] = { ValueComparison::Less, ValueComparison::LessOrEqual, ValueComparison::Greater, ValueComparison::GreaterOrEqual, ValueComparison::Equal, ValueComparison::NotEqual };
+	TValue operands[] = { (TValue)-1000, (TValue)-3, (TValue)0, (TValue)17, (TValue)1000 };
+	for (ValueComparison comparison : comparisons)
+		for (TValue operand : operands)
+			if (complexMap.CountValuesWhere(comparison, operand) != ScalarCount(expectedValues.data(), expectedValues.size(), comparison, operand))
+				throw "Columnar count is wrong!";
+	if (complexMap.CountValuesWhere([](TValue value) { return value > 0 && value < 100; }) != (size_t)count_if(expected.begin(), expected.end(), [](auto& entry) { return entry.second > 0 && entry.second < 100; }))
+		throw "Columnar predicate count is wrong!";
+}
+
+template <typename TValue>
+void ColumnarAggregates() {
+	ColumnarComplexMap<int, TValue> complexMap;
+	map<int, TValue> expected;
+	AssertColumnarAggregates(complexMap, expected);
+
+	// Every column length from 1 to 40 so the vector loops and the scalar tails both run
+	TValue array1[] = { 1, 2, 3 };
+	for (int i = 0; i < 40; i++) {
+		TValue value = (TValue)((i * 7919) % 2001 - 1000);
+		complexMap.AddValue(i, value);
+		expected[i] = value;
+		complexMap.AddArray(1000 + i, array1, i % 3 + 1);
+		AssertColumnarAggregates(complexMap, expected);
+	}
+
+	// Removing and changing kinds moves the last entry of a column into the hole
+	for (int i = 0; i < 40; i += 3) {
+		complexMap.Remove(i);
+		expected.erase(i);
+	}
+	for (int i = 1; i < 40; i += 5) {
+		complexMap.AddStringOrReplace(i, "line");
+		expected.erase(i);
+	}
+	for (int i = 1000; i < 1040; i += 4) {
+		complexMap.AddValueOrReplace(i, (TValue)i);
+		expected[i] = (TValue)i;
+	}
+	complexMap.AddValueOrReplace(2, (TValue)-2000);
+	expected[2] = (TValue)-2000;
+	AssertColumnarAggregates(complexMap, expected);
+	AssertGetString(complexMap, 6, "line");
+	AssertGetArray(complexMap, 1001, array1, 2);
+
+	complexMap.RemoveAll();
+	expected.clear();
+	AssertColumnarAggregates(complexMap, expected);
+}
+
+void ConcurrentStressTest() {
+	const int threadCount = 8;
+	const int keysPerThread = 2000;
+	const int sharedKeys = 100;
+	ConcurrentComplexMap<int, int> complexMap(16);
+
+	atomic<int> failures(0);
+	vector<thread> threads;
+	for (int t = 0; t < threadCount; t++)
+		threads.emplace_back([&, t]() {
+			for (int i = 0; i < keysPerThread; i++) {
+				int key = t * keysPerThread + i;
+				complexMap.AddValue(key, key);
+				int array[] = { key, key + 1 };
+				complexMap.AddArrayOrReplace(-key - 1, array, 2);
+				complexMap.AddStringOrReplace(1000000 + key, to_string(key).c_str());
+				if (complexMap.GetOrAddValue(2000000 + i % sharedKeys, i % sharedKeys) != i % sharedKeys)
+					failures++;
+
+				int value;
+				vector<int> values;
+				string line;
+				if (!complexMap.TryGetValue(key, &value) || value != key)
+					failures++;
+				if (!complexMap.TryGetArray(-key - 1, &values) || values.size() != 2 || values[1] != key + 1)
+					failures++;
+				if (!complexMap.TryGetString(1000000 + key, &line) || line != to_string(key))
+					failures++;
+				if (complexMap.TryAddValue(key, 0))
+					failures++;
+			}
+
+			for (int i = 0; i < keysPerThread; i += 2)
+				complexMap.Remove(t * keysPerThread + i);
+		});
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	if (failures != 0)
+		throw "Concurrent operations failed!";
+	if (complexMap.GetSize() != threadCount * keysPerThread / 2 + threadCount * keysPerThread * 2 + sharedKeys)
+		throw "ConcurrentComplexMap size is wrong";
+
+	int size = 0;
+	complexMap.VisitArray(-1, [&](const int* values, int valuesSize) { size = valuesSize; });
+	if (size != 2)
+		throw "Arrays not equal!";
+	AssertConstCharException("Check exception on concurrent GetValue by missing key", [&]() { complexMap.GetValue(0); });
+	AssertConstCharException("Check exception on concurrent GetString instead of GetValue", [&]() { complexMap.GetString(1); });
+
+	complexMap.RemoveAll();
+	if (complexMap.GetSize() != 0)
+		throw "ComplexMap size not 0";
+}
+
+void LockFreeReadTest() {
+	const int readerCount = 4;
+	const int keyCount = 64;
+	const int rounds = 2000;
+	LockFreeComplexMap<int, int> complexMap;
+	for (int i = 0; i < keyCount; i++)
+		complexMap.AddString(i, string(40, 'a').c_str());
+
+	atomic<bool> stop(false);
+	atomic<int> failures(0);
+	vector<thread> readers;
+	for (int t = 0; t < readerCount; t++)
+		readers.emplace_back([&, t]() {
+			while (!stop) {
+				LockFreeComplexMap<int, int>::ReadGuard guard(complexMap);
+				for (int i = t; i < keyCount; i += readerCount) {
+					const char* line;
+					if (!complexMap.TryGetString(i, &line)) {
+						failures++;
+						continue;
+					}
+
+					// Pointer stays valid and unchanged while the guard is alive, even if the key is replaced
+					for (int j = 1; j < 40; j++)
+						if (line[j] != line[0])
+							failures++;
+				}
+			}
+		});
+
+	for (int round = 0; round < rounds; round++) {
+		int key = round % keyCount;
+		complexMap.AddStringOrReplace(key, string(40, (char)('a' + round % 26)).c_str());
+		complexMap.AddValueOrReplace(keyCount + key, round);
+		complexMap.TryRemove(keyCount + key);
+	}
+	stop = true;
+	for (size_t i = 0; i < readers.size(); i++)
+		readers[i].join();
+
+	if (failures != 0)
+		throw "Lock-free reads failed!";
+	if (complexMap.GetSize() != keyCount)
+		throw "LockFreeComplexMap size is wrong";
+	AssertGetString(complexMap, (rounds - 1) % keyCount, string(40, (char)('a' + (rounds - 1) % 26)).c_str());
+
+	complexMap.RemoveAll();
+	if (complexMap.GetSize() != 0)
+		throw "ComplexMap size not 0";
+}
+
+void JournalReplay() {
+	const char* snapshotPath = "ComplexMapJournal.snapshot.tmp";
+	const char* journalPath = "ComplexMapJournal.journal.tmp";
+	remove(snapshotPath);
+	remove(journalPath);
+
+	int array1[] = { 4, 5, 6, 7 };
+	int array2[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	JournalOptions options;
+	options.SyncRecords = 16;
+	options.SyncMilliseconds = 60000;
+	{
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+		complexMap.AddValue(16, 222);
+		complexMap.AddArray(142, array1, sizeof(array1) / sizeof(int));
+		complexMap.AddString(993, "123123");
+		complexMap.AddValueOrReplace(16, 223);
+		complexMap.AddArrayOrReplace(147, array2, sizeof(array2) / sizeof(int));
+		complexMap.AddStringOrReplace(993, "this line is longer than the inline buffer");
+		complexMap.GetOrAddValue(17, 1);
+		complexMap.GetOrAddValue(17, 2);
+		complexMap.TryAddValue(18, 18);
+		complexMap.Remove(18);
+		if (complexMap.TryAddString(993, "") || complexMap.TryRemove(18))
+			throw "Journaled map changed on failed mutation!";
+		for (int i = 0; i < 160; i++)
+			complexMap.AddValue(1000 + i, i);
+		if (complexMap.GetSyncCount() != 10)
+			throw "Journal records are not synced in groups!";
+	}
+	{
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+		if (complexMap.GetSize() != 165)
+			throw "ComplexMap size not 165";
+		AssertGetValue(complexMap, 16, 223);
+		AssertGetValue(complexMap, 17, 1);
+		AssertTryGetValue(complexMap, 18, false, 0);
+		AssertGetArray(complexMap, 142, array1, sizeof(array1) / sizeof(int));
+		AssertGetArray(complexMap, 147, array2, sizeof(array2) / sizeof(int));
+		AssertGetString(complexMap, 993, "this line is longer than the inline buffer");
+		complexMap.RemoveAll();
+		complexMap.AddValue(1, 1);
+	}
+	{
+		// A torn record at the tail is dropped and the journal stays appendable
+		ofstream(journalPath, ios::binary | ios::app).write("\x20\x00\x00\x00torn", 8);
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+		if (complexMap.GetSize() != 1)
+			throw "ComplexMap size not 1";
+		complexMap.AddValue(2, 2);
+	}
+
+	options.SyncRecords = 1;
+	options.CompactionSize = 4096;
+	{
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+		if (complexMap.GetSize() != 2)
+			throw "ComplexMap size not 2";
+		for (int i = 0; i < 1000; i++)
+			complexMap.AddValueOrReplace(i % 100, i);
+		if (complexMap.GetJournalSize() >= options.CompactionSize)
+			throw "Journal is not compacted!";
+	}
+	{
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+		if (complexMap.GetSize() != 100)
+			throw "ComplexMap size not 100";
+		AssertGetValue(complexMap, 1, 901);
+		AssertGetValue(complexMap, 99, 999);
+	}
+
+	// A burst shorter than SyncRecords is synced by the sync thread once SyncMilliseconds pass
+	options.SyncRecords = 1000;
+	options.SyncMilliseconds = 10;
+	{
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+		for (int i = 0; i < 5; i++)
+			complexMap.AddValueOrReplace(i, -i);
+		for (int i = 0; i < 200 && complexMap.GetSyncCount() == 0; i++)
+			this_thread::sleep_for(chrono::milliseconds(10));
+		if (complexMap.GetSyncCount() != 1 || complexMap.GetJournalSize() == 0)
+			throw "Buffered records are not synced on time!";
+		if (ifstream(journalPath, ios::binary | ios::ate).tellg() != (streamoff)complexMap.GetJournalSize())
+			throw "Synced records are not in the journal file!";
+	}
+	remove(snapshotPath);
+	remove(journalPath);
+}
+
+void ShortPayloadAllocations() {
+	ComplexMap<int, int> complexMap;
+
+	long long allocations = allocationCount;
+	complexMap.AddValue(16, 222);
+	long long valueAllocations = allocationCount - allocations;
+
+	int array1[] = { 4, 5, 6, 7 };
+	allocations = allocationCount;
+	complexMap.AddArray(142, array1, sizeof(array1) / sizeof(int));
+	if (allocationCount - allocations != valueAllocations)
+		throw "Short array allocates payload!";
+	AssertGetArray(complexMap, 142, array1, sizeof(array1) / sizeof(int));
+
+	allocations = allocationCount;
+	complexMap.AddString(993, "short_identifier");
+	if (allocationCount - allocations != valueAllocations)
+		throw "Short string allocates payload!";
+	AssertGetString(complexMap, 993, "short_identifier");
+
+	int array2[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	allocations = allocationCount;
+	complexMap.AddArray(147, array2, sizeof(array2) / sizeof(int));
+	if (allocationCount - allocations != valueAllocations + 1)
+		throw "Long array must allocate payload!";
+	AssertGetArray(complexMap, 147, array2, sizeof(array2) / sizeof(int));
+
+	allocations = allocationCount;
+	complexMap.AddString(995, "this line is longer than the inline buffer");
+	if (allocationCount - allocations != valueAllocations + 1)
+		throw "Long string must allocate payload!";
+	AssertGetString(complexMap, 995, "this line is longer than the inline buffer");
+
+	const char* line = complexMap.GetString(993);
+	complexMap.AddString(996, "other");
+	if (line != complexMap.GetString(993))
+		throw "String pointer is not stable!";
+}
+
+void ArenaReusesFreedSlots() {
+	ComplexMap<int, int, FlatHashIndex, InlineStorage, ArenaAllocator> complexMap;
+
+	int array1[] = { 4, 5, 6, 7 };
+	for (int i = 0; i < 1000; i++)
+		complexMap.AddArray(i, array1, sizeof(array1) / sizeof(int));
+	for (int i = 0; i < 1000; i++)
+		complexMap.Remove(i);
+
+	long long allocations = allocationCount;
+	for (int i = 0; i < 1000; i++)
+		complexMap.AddArrayOrReplace(i, array1, sizeof(array1) / sizeof(int));
+	if (allocationCount != allocations)
+		throw "Freed arena slots are not reused!";
+	AssertGetArray(complexMap, 999, array1, sizeof(array1) / sizeof(int));
+
+	complexMap.RemoveAll();
+	if (complexMap.GetSize() != 0)
+		throw "ComplexMap size not 0";
+}
+
+template <template <typename, typename> class TComplexMap>
+void BatchMethods() {
+	TComplexMap<int, int> complexMap;
+
+	vector<int> keys;
+	vector<int> values;
+	for (int i = 0; i < 100; i++) {
+		keys.push_back(i * 3);
+		values.push_back(i * 10);
+	}
+	complexMap.AddValues(keys.data(), values.data(), keys.size());
+	int array1[] = { 1, 2, 3 };
+	complexMap.AddArray(1, array1, 3);
+	complexMap.AddString(2, "line");
+	AssertConstCharException("Check exception on AddValues with duplicate key", [&]() { complexMap.AddValues(keys.data() + 50, values.data(), 1); });
+	if (complexMap.GetSize() != 102)
+		throw "ComplexMap size not 102";
+
+	// Every third key holds a value, key 1 an array, key 2 a string, the rest are missing
+	const int lookupCount = 300;
+	vector<int> lookupKeys;
+	for (int i = 0; i < lookupCount; i++)
+		lookupKeys.push_back(i);
+	vector<int> foundValues(lookupCount);
+	vector<const int*> foundArrays(lookupCount);
+	vector<int> foundSizes(lookupCount);
+	vector<const char*> foundLines(lookupCount);
+	unique_ptr<bool[]> found(new bool[lookupCount]);
+
+	if (complexMap.TryGetValues(lookupKeys.data(), foundValues.data(), found.get(), lookupCount) != 100)
+		throw "Batch lookup finds wrong number of values!";
+	for (int i = 0; i < lookupCount; i++)
+		if (found[i] != (i % 3 == 0) || (found[i] && foundValues[i] != i / 3 * 10))
+			throw "Batch lookup returns wrong values!";
+
+	if (complexMap.TryGetArrays(lookupKeys.data(), foundArrays.data(), foundSizes.data(), found.get(), lookupCount) != 1 || !found[1] || found[0] || foundSizes[1] != 3 || foundArrays[1][2] != 3)
+		throw "Batch lookup returns wrong arrays!";
+	if (complexMap.TryGetStrings(lookupKeys.data(), foundLines.data(), found.get(), lookupCount) != 1 || !found[2] || found[3] || strcmp(foundLines[2], "line") != 0)
+		throw "Batch lookup returns wrong strings!";
+
+	TComplexMap<string, int> stringMap;
+	string stringKeys[] = { "first", "second", "third" };
+	int stringValues[] = { 1, 2, 3 };
+	stringMap.AddValues(stringKeys, stringValues, 2);
+	if (stringMap.TryGetValues(stringKeys, foundValues.data(), found.get(), 3) != 2 || foundValues[1] != 2 || found[2])
+		throw "Batch lookup by string keys is wrong!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void GrowableEntries() {
+	TComplexMap<int, int> complexMap;
+
+	// Appending to a missing key starts an empty array, short inline arrays are moved out as they grow
+	vector<int> expected;
+	for (int i = 0; i < 1000; i++) {
+		int chunk[] = { i, -i };
+		complexMap.AppendToArray(1, chunk, 2);
+		expected.push_back(i);
+		expected.push_back(-i);
+	}
+	AssertGetArray(complexMap, 1, expected.data(), expected.size());
+
+	int array1[] = { 4, 5, 6 };
+	complexMap.AddArray(2, array1, 3);
+	int size;
+	const int* values = complexMap.GetArray(2, &size);
+	complexMap.AppendToArray(2, values + 1, 2);
+	int array2[] = { 4, 5, 6, 5, 6 };
+	AssertGetArray(complexMap, 2, array2, 5);
+
+	complexMap.ReserveArray(2, 100);
+	complexMap.ResizeArray(2, 7);
+	int array3[] = { 4, 5, 6, 5, 6, 0, 0 };
+	AssertGetArray(complexMap, 2, array3, 7);
+	complexMap.ResizeArray(2, 2);
+	complexMap.ShrinkToFit(2);
+	AssertGetArray(complexMap, 2, array3, 2);
+	complexMap.AppendToArray(2, array1, 1);
+	int array4[] = { 4, 5, 4 };
+	AssertGetArray(complexMap, 2, array4, 3);
+
+	complexMap.AddString(3, "abc");
+	complexMap.AppendToString(3, "def");
+	complexMap.AppendToString(3, complexMap.GetString(3));
+	complexMap.AppendToString(4, "new");
+	AssertGetString(complexMap, 3, "abcdefabcdef");
+	AssertGetString(complexMap, 4, "new");
+	string longLine;
+	for (int i = 0; i < 100; i++) {
+		complexMap.AppendToString(4, "0123456789");
+		longLine += "0123456789";
+	}
+	complexMap.ShrinkToFit(4);
+	AssertGetString(complexMap, 4, ("new" + longLine).c_str());
+
+	complexMap.AddValue(5, 10);
+	AssertConstCharException("Check exception on AppendToArray to value", [&]() { complexMap.AppendToArray(5, array1, 3); });
+	AssertConstCharException("Check exception on AppendToString to array", [&]() { complexMap.AppendToString(2, "x"); });
+	AssertConstCharException("Check exception on ResizeArray of string", [&]() { complexMap.ResizeArray(3, 5); });
+	AssertConstCharException("Check exception on ShrinkToFit of value", [&]() { complexMap.ShrinkToFit(5); });
+	AssertConstCharException("Check exception on ReserveArray of missing key", [&]() { complexMap.ReserveArray(6, 5); });
+	AssertConstCharException("Check exception on ReserveArray with negative capacity", [&]() { complexMap.ReserveArray(2, -1); });
+	AssertConstCharException("Check exception on ResizeArray with negative size", [&]() { complexMap.ResizeArray(2, -1); });
+	AssertConstCharException("Check exception on ShrinkToFit of missing key", [&]() { complexMap.ShrinkToFit(6); });
+	AssertConstCharException("Check exception on AppendToArray past INT_MAX", [&]() { complexMap.AppendToArray(2, array1, INT_MAX - 1); });
+	AssertConstCharException("Check exception on AppendToString past INT_MAX", [&]() { complexMap.AppendToString(3, "x", INT_MAX - 1); });
+	AssertGetArray(complexMap, 2, array4, 3);
+	AssertGetString(complexMap, 3, "abcdefabcdef");
+	if (complexMap.GetSize() != 5)
+		throw "ComplexMap size not 5";
+
+	complexMap.Remove(1);
+	complexMap.Remove(4);
+}
+
+template <template <typename, typename> class TComplexMap>
+void StatsCounting() {
+	TComplexMap<int, int> complexMap;
+	int value;
+	int array1[] = { 1, 2, 3 };
+
+	complexMap.AddValue(1, 10);
+	complexMap.AddArray(2, array1, 3);
+	complexMap.AddString(3, "line");
+	complexMap.TryAddValue(1, 11);
+	complexMap.AddValueOrReplace(1, 12);
+	complexMap.GetValue(1);
+	complexMap.TryGetValue(4, &value);
+	AssertConstCharException("Check exception on GetValue instead of GetArray", [&]() { complexMap.GetValue(2); });
+	complexMap.GetOrAddValue(1, 0);
+	complexMap.GetOrAddValue(5, 0);
+	complexMap.Remove(3);
+
+	ComplexMapStats stats = complexMap.GetStats();
+#ifdef COMPLEXMAP_STATS
+	if (stats.Hits != 3 || stats.Misses != 2 || stats.TypeMismatches != 1 || stats.DuplicateKeys != 1 || stats.Replaces != 1 || stats.Removes != 1)
+		throw "Stats count wrong operations!";
+	if (stats.Allocations[(int)ValueKind::Value] != 3 || stats.AllocatedBytes[(int)ValueKind::Value] != 3 * sizeof(int) ||
+		stats.Allocations[(int)ValueKind::Array] != 1 || stats.AllocatedBytes[(int)ValueKind::Array] != 3 * sizeof(int) ||
+		stats.Allocations[(int)ValueKind::String] != 1 || stats.AllocatedBytes[(int)ValueKind::String] != 5)
+		throw "Stats count wrong allocations!";
+
+	for (int i = 0; i < 1000; i++)
+		complexMap.TryGetValue(i, &value);
+	if (complexMap.GetStats().GetLatencySamples(StatsOperation::Lookup) == 0)
+		throw "Stats sample no lookup latencies!";
+
+	complexMap.ResetStats();
+	stats = complexMap.GetStats();
+	if (stats.Hits != 0 || stats.Misses != 0 || stats.GetLatencySamples(StatsOperation::Lookup) != 0)
+		throw "Stats not reset!";
+#else
+	if (stats.Hits != 0 || stats.Misses != 0 || stats.Allocations[(int)ValueKind::Value] != 0)
+		throw "Stats counted without COMPLEXMAP_STATS!";
+#endif
+}
+
+class CountingAllocator {
+public:
+	static const bool ReleasesAll = false;
+	static const bool IsThreadSafe = true;
+	static atomic<long long> AllocatedBytes;
+
+	void* Allocate(size_t size) {
+		AllocatedBytes += size;
+		return operator new(size);
+	}
+
+	void Free(void* memory, size_t size) {
+		AllocatedBytes -= size;
+		operator delete(memory);
+	}
+
+	void Release() {
+	}
+};
+
+atomic<long long> CountingAllocator::AllocatedBytes(0);
+
+template <typename TIndex, typename TStorage>
+void MemoryAccounting(bool headersInIndex, bool reservesIndex) {
+	ComplexMap<int, int, TIndex, TStorage, CountingAllocator> complexMap;
+	complexMap.Reserve(1000);
+	MemoryUsage reserved = complexMap.GetMemoryUsage();
+	if (reserved.Index != 0 || reserved.ArrayPayloads != 0 || reserved.StringPayloads != 0)
+		throw "Empty map reports used memory!";
+
+	// Every payload the map copies goes through the allocator, so its count must match headers and payloads exactly
+	vector<int> longArray(100, 7);
+	string longLine(100, 'x');
+	size_t arrayBytes = 0;
+	size_t stringBytes = 0;
+	for (int i = 0; i < 1000; i++) {
+		if (i % 4 == 0)
+			complexMap.AddValue(i, i);
+		else if (i % 4 == 1) {
+			complexMap.AddArray(i, longArray.data(), longArray.size());
+			arrayBytes += longArray.size() * sizeof(int);
+		}
+		else if (i % 4 == 2) {
+			complexMap.AddString(i, longLine.c_str());
+			stringBytes += longLine.size() + 1;
+		}
+		else
+			complexMap.AddString(i, "");
+	}
+	MemoryUsage usage = complexMap.GetMemoryUsage();
+	if (usage.ArrayPayloads != arrayBytes || usage.StringPayloads < stringBytes || usage.StringPayloads > stringBytes + 250)
+		throw "Memory usage reports wrong payloads!";
+	if ((long long)(usage.Headers + usage.ArrayPayloads + usage.StringPayloads) != CountingAllocator::AllocatedBytes)
+		throw "Memory usage differs from allocated bytes!";
+	if ((usage.Headers == 0) != headersInIndex || usage.Index == 0)
+		throw "Memory usage reports wrong headers!";
+	if (reservesIndex && usage.Index + usage.Slack != reserved.Index + reserved.Slack)
+		throw "Reserved index grows while filling!";
+
+	// Grown payloads show their spare capacity as slack until they are compacted
+	complexMap.AppendToArray(1, longArray.data(), 1);
+	if (complexMap.GetMemoryUsage().Slack <= usage.Slack)
+		throw "Memory usage reports no slack of grown array!";
+
+	for (int i = 10; i < 1000; i++)
+		complexMap.Remove(i);
+	complexMap.ShrinkToFit();
+	MemoryUsage shrunk = complexMap.GetMemoryUsage();
+	if (shrunk.GetTotal() >= usage.GetTotal() / 10 || (long long)(shrunk.Headers + shrunk.ArrayPayloads + shrunk.StringPayloads) != CountingAllocator::AllocatedBytes)
+		throw "ShrinkToFit keeps memory!";
+	int array1[101];
+	fill(array1, array1 + 101, 7);
+	AssertGetArray(complexMap, 1, array1, 101);
+
+	complexMap.RemoveAll();
+	complexMap.ShrinkToFit();
+	if (complexMap.GetMemoryUsage().GetTotal() != 0 || CountingAllocator::AllocatedBytes != 0)
+		throw "Empty map keeps memory!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void ArrayElementAccess() {
+	TComplexMap<int, int> complexMap;
+	int array1[] = { 1, 2, 3, 4, 5 };
+	complexMap.AddArray(1, array1, 5);
+	complexMap.AddValue(2, 7);
+	if (complexMap.GetArrayElement(1, 0) != 1 || complexMap.GetArrayElement(1, 4) != 5)
+		throw "Array element is wrong!";
+
+	int buffer[5] = {};
+	if (complexMap.ReadArray(1, 3, buffer, 5) != 2 || buffer[0] != 4 || buffer[1] != 5 || complexMap.ReadArray(1, 5, buffer, 1) != 0)
+		throw "Array read is wrong!";
+	AssertConstCharException("Check exception on GetArrayElement past the end", [&]() { complexMap.GetArrayElement(1, 5); });
+	AssertConstCharException("Check exception on GetArrayElement before the start", [&]() { complexMap.GetArrayElement(1, -1); });
+	AssertConstCharException("Check exception on GetArrayElement of value", [&]() { complexMap.GetArrayElement(2, 0); });
+	AssertConstCharException("Check exception on ReadArray of missing key", [&]() { complexMap.ReadArray(3, 0, buffer, 1); });
+}
+
+template <template <typename, typename> class TComplexMap, typename TValue>
+void CompressedArrays() {
+	TComplexMap<int, TValue> complexMap;
+
+	// Timestamps with small jitter pack into a few bits each, extremes still round-trip at full width
+	vector<TValue> timestamps;
+	TValue timestamp = (TValue)(numeric_limits<TValue>::max() / 2);
+	for (int i = 0; i < 1000; i++) {
+		timestamp = (TValue)(timestamp + 1 + (i * 7) % 5);
+		timestamps.push_back(timestamp);
+	}
+	vector<TValue> extremes;
+	for (int i = 0; i < 300; i++)
+		extremes.push_back(i % 3 == 0 ? numeric_limits<TValue>::min() : i % 3 == 1 ? numeric_limits<TValue>::max() : 0);
+	complexMap.AddCompressedArray(1, timestamps.data(), timestamps.size());
+	complexMap.AddCompressedArray(2, extremes.data(), extremes.size());
+	if (complexMap.GetCompressionRatio() < 3)
+		throw "Increasing arrays do not compress!";
+	TComplexMap<int, TValue> usageMap;
+	usageMap.AddCompressedArray(1, timestamps.data(), timestamps.size());
+	if (usageMap.GetMemoryUsage().ArrayPayloads * 3 > timestamps.size() * sizeof(TValue))
+		throw "Memory usage reports decoded size of compressed array!";
+
+	for (int i = 0; i < (int)timestamps.size(); i++)
+		if (complexMap.GetArrayElement(1, i) != timestamps[i])
+			throw "Compressed array element is wrong!";
+	for (int i = 0; i < (int)extremes.size(); i++)
+		if (complexMap.GetArrayElement(2, i) != extremes[i])
+			throw "Compressed array element at full width is wrong!";
+	AssertGetArray(complexMap, 1, timestamps.data(), timestamps.size());
+	AssertGetArray(complexMap, 2, extremes.data(), extremes.size());
+
+	// Ranges that start and end inside blocks
+	vector<TValue> buffer(500);
+	if (complexMap.ReadArray(1, 100, buffer.data(), 300) != 300 || !equal(buffer.begin(), buffer.begin() + 300, timestamps.begin() + 100))
+		throw "Compressed array range is wrong!";
+	if (complexMap.ReadArray(1, 900, buffer.data(), 500) != 100 || !equal(buffer.begin(), buffer.begin() + 100, timestamps.begin() + 900))
+		throw "Compressed array tail is wrong!";
+	AssertConstCharException("Check exception on GetArrayElement past a compressed array", [&]() { complexMap.GetArrayElement(1, 1000); });
+
+	// Every read decodes the array and leaves it compressed
+	for (int i = 0; i < 20; i++)
+		complexMap.AddCompressedArray(10 + i, timestamps.data() + i, 500);
+	double compressionRatio = complexMap.GetCompressionRatio();
+	size_t arrayPayloads = complexMap.GetMemoryUsage().ArrayPayloads;
+	int size;
+	const TValue* first = complexMap.GetArray(10, &size);
+	if (size != 500 || !equal(first, first + size, timestamps.begin()))
+		throw "Decoded array is wrong!";
+	const TValue* second;
+	if (!complexMap.TryGetArray(11, &second, &size) || size != 500 || !equal(second, second + size, timestamps.begin() + 1))
+		throw "Compressed array is missing!";
+	second = complexMap.GetOrAddArray(12, &size, timestamps.data(), 1);
+	if (size != 500 || !equal(second, second + size, timestamps.begin() + 2))
+		throw "GetOrAdd of a compressed array is wrong!";
+	complexMap.ForEachArray([&](int key, const TValue* values, int size) {
+		if (key >= 10 && !equal(values, values + size, timestamps.begin() + (key - 10)))
+			throw "Decoded array in iteration is wrong!";
+	});
+	if (complexMap.GetCompressionRatio() != compressionRatio || complexMap.GetMemoryUsage().ArrayPayloads != arrayPayloads)
+		throw "Reading compressed arrays turns them plain!";
+
+	// Arrays that would not shrink stay plain, growing a compressed array turns it plain
+	vector<TValue> shortArray(timestamps.begin(), timestamps.begin() + 2);
+	complexMap.AddCompressedArray(3, shortArray.data(), 2);
+	AssertGetArray(complexMap, 3, shortArray.data(), 2);
+	complexMap.AddCompressedArray(4, timestamps.data(), timestamps.size());
+	complexMap.AppendToArray(4, timestamps.data(), 1);
+	timestamps.push_back(timestamps[0]);
+	AssertGetArray(complexMap, 4, timestamps.data(), timestamps.size());
+	complexMap.AddCompressedArrayOrReplace(2, timestamps.data(), timestamps.size());
+	if (complexMap.GetArrayElement(2, 1000) != timestamps[0])
+		throw "Compressed array replace is wrong!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void InterningPayloads() {
+	TComplexMap<int, int> complexMap;
+	complexMap.AddString(100, "line added before interning");
+	complexMap.SetInterning(InterningMode::StringsAndArrays);
+
+	// Equal payloads share one buffer, and memory usage counts it once
+	const char* line = "line shared by several entries";
+	int values[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	complexMap.AddString(1, line);
+	complexMap.AddString(2, string(line).c_str());
+	complexMap.AddString(3, "other line");
+	complexMap.AddArray(4, values, 10);
+	complexMap.AddArray(5, vector<int>(values, values + 10).data(), 10);
+	complexMap.AddArray(6, values, 5);
+	if (complexMap.GetString(1) != complexMap.GetString(2) || complexMap.GetString(1) == complexMap.GetString(3))
+		throw "Equal strings are not interned!";
+	int size;
+	if (complexMap.GetArray(4, &size) != complexMap.GetArray(5, &size) || complexMap.GetArray(4, &size) == complexMap.GetArray(6, &size))
+		throw "Equal arrays are not interned!";
+	AssertGetString(complexMap, 2, line);
+	AssertGetArray(complexMap, 5, values, 10);
+	MemoryUsage usage = complexMap.GetMemoryUsage();
+	size_t expectedStringBytes = strlen(line) + 1 + strlen("other line") + 1;
+	if (usage.StringPayloads != expectedStringBytes + strlen("line added before interning") + 1 || usage.ArrayPayloads != 15 * sizeof(int))
+		throw "Interned payloads are counted per entry!";
+
+	if (!complexMap.AreStringsEqual(1, 2) || complexMap.AreStringsEqual(1, 3) || !complexMap.AreArraysEqual(4, 5) || complexMap.AreArraysEqual(4, 6))
+		throw "Interned equality is wrong!";
+	complexMap.AddString(101, "line added before interning");
+	complexMap.AddArrayOrReplace(102, vector<int>(values, values + 10));
+	if (!complexMap.AreStringsEqual(100, 101) || !complexMap.AreArraysEqual(4, 102) || complexMap.AreStringsEqual(1, 100))
+		throw "Equality of entries that are not interned is wrong!";
+	complexMap.AddValue(103, 1);
+	AssertConstCharException("Check exception on AreStringsEqual of value", [&]() { complexMap.AreStringsEqual(1, 103); });
+	AssertConstCharException("Check exception on AreArraysEqual of missing key", [&]() { complexMap.AreArraysEqual(4, 104); });
+
+	// Removing and appending release the shared buffer without touching the other entries
+	complexMap.Remove(1);
+	AssertGetString(complexMap, 2, line);
+	complexMap.AppendToString(2, "!");
+	AssertGetString(complexMap, 2, (string(line) + "!").c_str());
+	complexMap.AppendToArray(4, values, 1);
+	AssertGetArray(complexMap, 5, values, 10);
+	complexMap.Remove(101);
+	complexMap.Remove(102);
+	usage = complexMap.GetMemoryUsage();
+	if (usage.StringPayloads != strlen("other line") + 1 + strlen(line) + 2 + strlen("line added before interning") + 1)
+		throw "Released interned string is still counted!";
+	complexMap.Remove(5);
+	if (complexMap.GetMemoryUsage().ArrayPayloads != 16 * sizeof(int))
+		throw "Released interned array is still counted!";
+}
+
+void TieredSpilling() {
+	TieredOptions options;
+	options.SpillThreshold = 1024;
+	options.MaxResidentBytes = 64 * 1024;
+	options.CompactionSize = 64 * 1024;
+	{
+		TieredComplexMap<int, int> complexMap("tiered.segment", options);
+		vector<int> longArray(256);
+		for (int i = 0; i < 200; i++) {
+			fill(longArray.begin(), longArray.end(), i);
+			complexMap.AddArray(i, longArray.data(), longArray.size());
+			complexMap.AddString(-i - 1, "short strings stay in memory");
+			complexMap.AddValue(1000 + i, i);
+		}
+		TieredStats stats = complexMap.GetStats();
+		if (stats.Spills == 0 || stats.ResidentBytes > options.MaxResidentBytes || stats.SegmentBytes != stats.SpilledBytes)
+			throw "Tiered map keeps cold payloads in memory!";
+
+		// A hot set that fits stays resident while the rest is read through the segment
+		for (int round = 0; round < 5; round++)
+			for (int i = 0; i < 200; i++) {
+				int key = round % 2 == 0 ? i % 10 : i;
+				int size;
+				const int* values = complexMap.GetArray(key, &size);
+				if (size != 256 || values[0] != key || values[255] != key)
+					throw "Spilled array reads back wrong!";
+			}
+		stats = complexMap.GetStats();
+		if (stats.SpilledHits == 0 || stats.ResidentHits == 0 || stats.ResidentBytes > options.MaxResidentBytes + longArray.size() * sizeof(int))
+			throw "Tiered map counts hits wrong!";
+		AssertGetString(complexMap, -200, "short strings stay in memory");
+		AssertGetValue(complexMap, 1199, 199);
+		int value;
+		if (complexMap.TryGetValue(5000, &value) || complexMap.GetStats().Misses != 1)
+			throw "Tiered map counts misses wrong!";
+
+		// Removed and replaced payloads leave dead space until a compaction copies the live ones out
+		for (int i = 0; i < 200; i += 2)
+			complexMap.Remove(i);
+		for (int i = 1; i < 100; i += 2) {
+			fill(longArray.begin(), longArray.end(), -i);
+			complexMap.AddArrayOrReplace(i, longArray.data(), longArray.size());
+		}
+		complexMap.Compact();
+		stats = complexMap.GetStats();
+		if (stats.Compactions == 0 || stats.DeadBytes != 0 || stats.SegmentBytes > 100 * longArray.size() * sizeof(int))
+			throw "Compaction keeps dead payloads!";
+		for (int i = 1; i < 200; i += 2) {
+			int size;
+			const int* values = complexMap.GetArray(i, &size);
+			if (size != 256 || values[0] != (i < 100 ? -i : i) || values[255] != (i < 100 ? -i : i))
+				throw "Compacted array reads back wrong!";
+		}
+
+		// Reading payloads back leaves their segment copies in use, a changed payload is written again on its next spill
+		int size;
+		size_t spilledBytes = 0;
+		for (int round = 0; round < 3; round++) {
+			// The first rounds spill the replaced arrays that never had a segment copy
+			if (round == 2)
+				spilledBytes = complexMap.GetStats().SpilledBytes;
+			for (int i = 1; i < 200; i += 2)
+				complexMap.GetArray(i, &size);
+		}
+		if (complexMap.GetStats().SpilledBytes != spilledBytes)
+			throw "Tiered map writes unchanged payloads again!";
+		int tail[] = { 7 };
+		complexMap.ResizeArray(101, 300);
+		complexMap.AppendToArray(103, tail, 1);
+		for (int round = 0; round < 2; round++)
+			for (int i = 105; i < 200; i += 2)
+				complexMap.GetArray(i, &size);
+		const int* values = complexMap.GetArray(101, &size);
+		if (size != 300 || values[0] != 101 || values[255] != 101 || values[299] != 0)
+			throw "Resized array is lost on spill!";
+		values = complexMap.GetArray(103, &size);
+		if (size != 257 || values[0] != 103 || values[256] != 7)
+			throw "Appended array is lost on spill!";
+		if (complexMap.GetSize() != 500)
+			throw "Tiered map size is wrong!";
+	}
+
+	FILE* segment = fopen("tiered.segment", "rb");
+	if (segment != nullptr) {
+		fclose(segment);
+		throw "Tiered map leaves its segment behind!";
+	}
+}
+
+template <typename TIndex, typename TStorage>
+void DeferredReclamation(ReclaimMode mode) {
+	{
+		ComplexMap<int, int, TIndex, TStorage, CountingAllocator> complexMap;
+		complexMap.SetReclaimMode(mode);
+		vector<int> longArray(50, 3);
+		for (int i = 0; i < 1000; i++) {
+			if (i % 2 == 0)
+				complexMap.AddArray(i, longArray.data(), longArray.size());
+			else
+				complexMap.AddArray(i, vector<int>(longArray));
+		}
+
+		// Removed and replaced entries are freed a batch at a time, only a partial batch is ever left waiting
+		for (int i = 0; i < 500; i++)
+			complexMap.Remove(i);
+		for (int i = 500; i < 600; i++)
+			complexMap.AddStringOrReplace(i, "replaced");
+		if (complexMap.GetSize() != 500 || complexMap.GetRetiredCount() >= 64)
+			throw "Retired entries pile up!";
+		AssertGetString(complexMap, 599, "replaced");
+
+		complexMap.RemoveAll();
+		if (complexMap.GetSize() != 0)
+			throw "RemoveAll keeps keys!";
+		if (mode == ReclaimMode::Deferred && complexMap.GetRetiredCount() < 500)
+			throw "RemoveAll frees on the caller's thread!";
+		complexMap.AddValue(1, 1);
+		AssertGetValue(complexMap, 1, 1);
+
+		complexMap.Reclaim();
+		MemoryUsage usage = complexMap.GetMemoryUsage();
+		if (complexMap.GetRetiredCount() != 0 || (long long)(usage.Headers + usage.ArrayPayloads + usage.StringPayloads) != CountingAllocator::AllocatedBytes)
+			throw "Reclaim leaves retired entries!";
+	}
+	if (CountingAllocator::AllocatedBytes != 0)
+		throw "Retired entries leak!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void BulkLoadMethods() {
+	typedef BulkRecord<int, int> Record;
+	const int count = 20000;
+	int array1[] = { 1, 2, 3 };
+
+	vector<Record> records;
+	for (int i = 0; i < count; i++)
+		records.push_back(i % 3 == 0 ? Record::ForValue(i, i) : i % 3 == 1 ? Record::ForArray(i, array1, 3) : Record::ForString(i, "line"));
+	TComplexMap<int, int> complexMap;
+	if (complexMap.BulkLoad(records.data(), records.size()) != count || complexMap.GetSize() != count)
+		throw "Bulk load of sorted records adds wrong keys!";
+	AssertGetValue(complexMap, 300, 300);
+	AssertGetArray(complexMap, 301, array1, 3);
+	AssertGetString(complexMap, 19997, "line");
+
+	// Keys spread by a step coprime with count, into a map that already holds keys between them
+	TComplexMap<int, int> shuffledMap;
+	shuffledMap.AddValue(-5, -5);
+	shuffledMap.AddValue(count / 2, -1);
+	vector<Record> shuffled;
+	for (int i = 0; i < count; i++) {
+		int key = (int)((long long)i * 7919 % count);
+		if (key != count / 2)
+			shuffled.push_back(Record::ForValue(key, key * 2));
+	}
+	if (shuffledMap.BulkLoad(shuffled.data(), shuffled.size()) != count - 1 || shuffledMap.GetSize() != count + 1)
+		throw "Bulk load of unsorted records adds wrong keys!";
+	for (int i = 0; i < count; i += 97)
+		AssertGetValue(shuffledMap, i, i == count / 2 ? -1 : i * 2);
+	AssertGetValue(shuffledMap, -5, -5);
+
+	// Throw checks everything first, so a duplicate in the records or in the map leaves the map as it was
+	Record repeated[] = { Record::ForValue(count + 1, 1), Record::ForValue(count + 2, 2), Record::ForValue(count + 1, 3) };
+	AssertConstCharException("Check exception on BulkLoad with repeated key", [&]() { complexMap.BulkLoad(repeated, 3); });
+	Record existing[] = { Record::ForValue(count + 1, 1), Record::ForValue(5, 5) };
+	AssertConstCharException("Check exception on BulkLoad with existing key", [&]() { complexMap.BulkLoad(existing, 2); });
+	if (complexMap.GetSize() != count)
+		throw "Failed bulk load changes the map!";
+
+	if (complexMap.BulkLoad(repeated, 3, DuplicatePolicy::Skip) != 2 || complexMap.BulkLoad(existing, 2, DuplicatePolicy::Skip) != 0)
+		throw "Bulk load with Skip adds wrong keys!";
+	AssertGetValue(complexMap, count + 1, 1);
+	AssertGetArray(complexMap, 4, array1, 3);
+
+	Record replacing[] = { Record::ForString(count + 1, "first"), Record::ForArray(4, array1, 2), Record::ForString(count + 1, "last"), Record::ForValue(count + 3, 3) };
+	if (complexMap.BulkLoad(replacing, 4, DuplicatePolicy::Replace) != 1 || complexMap.GetSize() != count + 3)
+		throw "Bulk load with Replace adds wrong keys!";
+	AssertGetString(complexMap, count + 1, "last");
+	AssertGetArray(complexMap, 4, array1, 2);
+
+	TComplexMap<string, int> stringMap;
+	BulkRecord<string, int> stringRecords[] = { BulkRecord<string, int>::ForValue("b", 2), BulkRecord<string, int>::ForString("c", "three"), BulkRecord<string, int>::ForValue("a", 1) };
+	if (stringMap.BulkLoad(stringRecords, 3) != 3)
+		throw "Bulk load by string keys adds wrong keys!";
+	AssertGetValue(stringMap, "a", 1);
+	AssertGetString(stringMap, "c", "three");
+}
+
+template <template <typename, typename> class TComplexMap>
+void ForkAndSnapshot() {
+	TComplexMap<int, int> complexMap;
+	int array1[] = { 1, 2, 3 };
+	int array2[] = { 4, 5 };
+	for (int i = 0; i < 10000; i++)
+		complexMap.AddValue(i, i);
+	complexMap.AddArray(-1, array1, 3);
+	complexMap.AddString(-2, "line");
+
+	auto snapshot = complexMap.Snapshot();
+	int size;
+	const int* snapshotArray = snapshot.GetArray(-1, &size);
+	const char* snapshotLine = snapshot.GetString(-2);
+
+	// Every kind of change on the live map leaves the snapshot as it was
+	complexMap.AddArrayOrReplace(-1, array2, 2);
+	complexMap.AppendToString(-2, " more");
+	complexMap.Remove(5);
+	complexMap.AddValueOrReplace(6, -6);
+	complexMap.AddValue(10000, 10000);
+	complexMap.ShrinkToFit();
+	if (complexMap.GetSize() != 10002 || snapshot.GetSize() != 10002)
+		throw "Snapshot sees changes of the map!";
+	AssertGetArray(complexMap, -1, array2, 2);
+	AssertGetString(complexMap, -2, "line more");
+	AssertTryGetValue(complexMap, 5, false, 0);
+	AssertGetValue(complexMap, 6, -6);
+	int value;
+	if (snapshot.GetArray(-1, &size) != snapshotArray || size != 3 || snapshotArray[0] != 1 || snapshotArray[2] != 3 ||
+		snapshot.GetString(-2) != snapshotLine || strcmp(snapshotLine, "line") != 0)
+		throw "Snapshot payloads move or change!";
+	if (!snapshot.TryGetValue(5, &value) || value != 5 || snapshot.GetValue(6) != 6 || snapshot.TryGetValue(10000, &value))
+		throw "Snapshot values change!";
+
+	TComplexMap<int, int> fork = complexMap.Fork();
+	fork.AddValue(20000, 1);
+	fork.AppendToArray(-1, array1, 1);
+	complexMap.RemoveAll();
+	if (complexMap.GetSize() != 0 || fork.GetSize() != 10003)
+		throw "Fork shares changes with the map!";
+	int array3[] = { 4, 5, 1 };
+	AssertGetArray(fork, -1, array3, 3);
+	AssertGetValue(fork, 9999, 9999);
+
+	long long sum = 0;
+	snapshot.ForEachValue([&](int key, int value) { sum += value; });
+	if (sum != 9999LL * 10000 / 2)
+		throw "Snapshot iterates wrong values!";
+
+	// Reads copy nothing, a fork, its own fork and its snapshot keep returning the same payloads
+	auto forkSnapshot = fork.Snapshot();
+	TComplexMap<int, int> secondFork = fork.Fork();
+	const int* arrayValues;
+	const char* line;
+	if (!fork.TryGetArray(-1, &arrayValues, &size) || !fork.TryGetString(-2, &line))
+		throw "Fork loses entries!";
+	int iteratedCount = 0;
+	fork.ForEachArray([&](int key, const int* values, int size) { iteratedCount += values == arrayValues ? 1 : -1000; });
+	fork.ForEachString([&](int key, const char* stringValue) { iteratedCount += stringValue == line ? 1 : -1000; });
+	if (iteratedCount != 2 || fork.GetArray(-1, &size) != arrayValues || fork.GetOrAddArray(-1, &size, array1, 3) != arrayValues ||
+		fork.GetString(-2) != line || fork.GetOrAddString(-2, "other") != line || secondFork.GetArray(-1, &size) != arrayValues ||
+		secondFork.GetString(-2) != line || forkSnapshot.GetArray(-1, &size) != arrayValues || forkSnapshot.GetString(-2) != line)
+		throw "Reading a fork copies its entries!";
+
+	// Changing the fork afterwards still copies the entries the others hold
+	fork.AppendToString(-2, "!");
+	fork.ResizeArray(-1, 2);
+	AssertGetArray(fork, -1, array3, 2);
+	AssertGetString(fork, -2, "line more!");
+	AssertGetArray(secondFork, -1, array3, 3);
+	AssertGetString(secondFork, -2, "line more");
+	if (forkSnapshot.GetArray(-1, &size) != arrayValues || size != 3 || strcmp(forkSnapshot.GetString(-2), "line more") != 0)
+		throw "Changes of a fork reach its snapshot!";
+}
+
+template <typename TKey>
+void DenseKeyRange(vector<TKey> keys, bool mustBeSparse) {
+	ComplexMap<TKey, int, DenseIndex> complexMap;
+	DenseIndex::Type<TKey, int> index;
+	for (size_t i = 0; i < keys.size(); i++) {
+		complexMap.AddValue(keys[i], (int)i);
+		index.Insert(keys[i], (int)i);
+	}
+	if (index.IsSparse() != mustBeSparse)
+		throw "Dense index chooses wrong layout!";
+
+	for (size_t i = 0; i < keys.size(); i++)
+		AssertGetValue(complexMap, keys[i], (int)i);
+	int value;
+	TKey missingKey = (TKey)(keys[0] ^ 1);
+	if (complexMap.TryGetValue(missingKey, &value) && find(keys.begin(), keys.end(), missingKey) == keys.end())
+		throw "Missing key found!";
+
+	vector<TKey> visitedKeys;
+	complexMap.ForEachValue([&](TKey key, int value) { visitedKeys.push_back(key); });
+	sort(keys.begin(), keys.end());
+	if (!mustBeSparse && visitedKeys != keys)
+		throw "Dense index visits keys out of order!";
+	if (visitedKeys.size() != keys.size())
+		throw "Dense index loses keys!";
+
+	for (size_t i = 0; i < keys.size(); i += 2)
+		complexMap.Remove(keys[i]);
+	if (complexMap.GetSize() != (int)(keys.size() / 2))
+		throw "Dense index size is wrong after remove!";
+}
+
+void DenseIndexLayouts() {
+	vector<int> fallingKeys;
+	for (int i = 5000; i > -5000; i -= 3)
+		fallingKeys.push_back(i);
+	DenseKeyRange<int>(fallingKeys, false);
+	DenseKeyRange<int>({ 1, 2, 142, 42, 0, -7 }, false);
+	DenseKeyRange<int>({ numeric_limits<int>::min(), 0, numeric_limits<int>::max() }, true);
+	DenseKeyRange<long long>({ numeric_limits<long long>::max(), numeric_limits<long long>::max() - 10, numeric_limits<long long>::min() + 3 }, true);
+	DenseKeyRange<unsigned long long>({ numeric_limits<unsigned long long>::max() - 1, numeric_limits<unsigned long long>::max() - 200 }, false);
+	DenseKeyRange<unsigned char>({ 255, 0, 17 }, false);
+
+	// Keys that turn sparse move to the hash index, clearing starts dense again
+	ComplexMap<int, int, DenseIndex> complexMap;
+	for (int i = 0; i < 100; i++)
+		complexMap.AddValue(i * 1000, i);
+	complexMap.RemoveAll();
+	for (int i = 0; i < 100; i++)
+		complexMap.AddValue(i, i);
+	AssertGetValue(complexMap, 99, 99);
+}
+
+void CacheEviction() {
+	vector<pair<int, EvictionReason>> evicted;
+	CacheOptions entryLimit;
+	entryLimit.MaxEntries = 3;
+	CachedComplexMap<int, int> complexMap(entryLimit);
+	complexMap.SetEvictionCallback([&](int key, EvictionReason reason) { evicted.push_back(pair<int, EvictionReason>(key, reason)); });
+
+	// Key 1 was read since the hand last passed, so the hand skips it once and takes key 2
+	complexMap.AddValue(1, 10);
+	complexMap.AddValue(2, 20);
+	complexMap.AddString(3, "line");
+	AssertGetValue(complexMap, 1, 10);
+	complexMap.AddValue(4, 40);
+	int value;
+	if (complexMap.GetSize() != 3 || complexMap.TryGetValue(2, &value) || evicted.size() != 1 || evicted[0].first != 2 || evicted[0].second != EvictionReason::Capacity)
+		throw "Cache evicts wrong entry!";
+	AssertGetString(complexMap, 3, "line");
+
+	// Removal and replacement do not report evictions
+	complexMap.Remove(1);
+	complexMap.AddValueOrReplace(4, 41);
+	AssertGetValue(complexMap, 4, 41);
+	if (evicted.size() != 1 || complexMap.GetSize() != 2)
+		throw "Cache reports removed entries as evicted!";
+
+	CacheOptions byteLimit;
+	byteLimit.MaxBytes = 64;
+	CachedComplexMap<string, int> byteMap(byteLimit);
+	int array1[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	byteMap.AddArray("first", array1, 10);
+	byteMap.AddString("second", "abc");
+	if (byteMap.GetPayloadBytes() != 44)
+		throw "Cache counts payload bytes wrong!";
+	byteMap.AddArray("third", array1, 10);
+	if (byteMap.GetPayloadBytes() != 44 || byteMap.GetSize() != 2 || byteMap.TryRemove("first"))
+		throw "Cache exceeds its byte limit!";
+
+	// Expired entries read as missing and report their reason
+	complexMap.RemoveAll();
+	evicted.clear();
+	complexMap.AddValue(5, 50, chrono::milliseconds(1));
+	complexMap.AddValue(6, 60, chrono::milliseconds(1));
+	complexMap.AddValue(7, 70);
+	this_thread::sleep_for(chrono::milliseconds(5));
+	if (complexMap.TryGetValue(5, &value) || complexMap.RemoveExpired() != 1 || complexMap.GetSize() != 1)
+		throw "Cache returns expired entries!";
+	if (evicted.size() != 2 || evicted[0].second != EvictionReason::Expired || evicted[1].first != 6)
+		throw "Cache does not report expired entries!";
+
+	// GetOrAdd fills the cache from the producer only on a miss
+	int producerCalls = 0;
+	for (int i = 0; i < 10; i++)
+		if (complexMap.GetOrAddValueWith(9, [&]() { producerCalls++; return 90; }) != 90)
+			throw "Values not equal!";
+	int size;
+	if (producerCalls != 1 || complexMap.GetOrAddArrayWith(8, &size, []() { return vector<int>{ 1, 2 }; })[1] != 2 || size != 2)
+		throw "Cache fill calls producer on hits!";
+}
+
+template <template <typename, typename> class TComplexMap>
+void RunTests() {
+	SimpleTest<TComplexMap>();
+	TryAddMethods<TComplexMap>();
+	TryGetMethods<TComplexMap>();
+	GetOrAddMethods<TComplexMap>();
+	SimpleTestWithOtherTypes<TComplexMap>();
+	ExceptionOnGetMissingKeys<TComplexMap>();
+	ExceptionOnAddingDuplicateValue<TComplexMap>();
+	ReplaceOnAddingDuplicateValue<TComplexMap>();
+	ExceptionOnGetInvalidType<TComplexMap>();
+	RemoveTempMemory<TComplexMap>();
+	ManyKeysTest<TComplexMap>();
+	OwnershipTransfer<TComplexMap>();
+	LazyAddMethods<TComplexMap>();
+	HitPathAllocations<TComplexMap>();
+	StringKeyLookup<TComplexMap>();
+	SnapshotRoundTrip<TComplexMap>();
+	TypedIteration<TComplexMap>();
+	BatchMethods<TComplexMap>();
+	GrowableEntries<TComplexMap>();
+	StatsCounting<TComplexMap>();
+	BulkLoadMethods<TComplexMap>();
+	ArrayElementAccess<TComplexMap>();
+}
+
+template <typename TKey, typename TValue>
+using OrderedComplexMap = ComplexMap<TKey, TValue, OrderedIndex>;
+
+template <typename TKey, typename TValue>
+using FlatHashComplexMap = ComplexMap<TKey, TValue, FlatHashIndex>;
+
+template <typename TKey, typename TValue>
+using OrderedInlineComplexMap = ComplexMap<TKey, TValue, OrderedIndex, InlineStorage>;
+
+template <typename TKey, typename TValue>
+using FlatHashInlineComplexMap = ComplexMap<TKey, TValue, FlatHashIndex, InlineStorage>;
+
+template <typename TKey, typename TValue>
+using ArenaComplexMap = ComplexMap<TKey, TValue, OrderedIndex, HeapStorage, ArenaAllocator>;
+
+template <typename TKey, typename TValue>
+using FlatHashInlineArenaComplexMap = ComplexMap<TKey, TValue, FlatHashIndex, InlineStorage, ArenaAllocator>;
+
+template <typename TKey, typename TValue>
+using DenseComplexMap = ComplexMap<TKey, TValue, DenseIndex>;
+
+template <typename TKey, typename TValue>
+using DenseInlineComplexMap = ComplexMap<TKey, TValue, DenseIndex, InlineStorage>;
+
+template <typename TKey, typename TValue>
+using SharedComplexMap = ComplexMap<TKey, TValue, ChunkedIndex, SharedStorage>;
+
+// Spills every array and string on the next add, so the common tests read them back from the segment
+template <typename TKey, typename TValue>
+class SpillingComplexMap : public TieredComplexMap<TKey, TValue> {
+	static TieredOptions GetOptions() {
+		TieredOptions options;
+		options.SpillThreshold = 1;
+		options.MaxResidentBytes = 0;
+		options.CompactionSize = 256;
+		return options;
+	}
+
+	static string GetSegmentPath() {
+		static atomic<int> segmentCount(0);
+		return "spilling" + to_string(++segmentCount) + ".segment";
+	}
+
+public:
+	SpillingComplexMap()
+		: TieredComplexMap<TKey, TValue>(GetSegmentPath().c_str(), GetOptions()) {
+	}
+};
+
+template <typename TKey, typename TValue>
+using FlatHashCachedComplexMap = CachedComplexMap<TKey, TValue, FlatHashIndex>;
+
+template <typename TKey, typename TValue>
+using FlatHashColumnarComplexMap = ColumnarComplexMap<TKey, TValue, FlatHashIndex>;
+
+class Stopwatch {
+	chrono::steady_clock::time_point start;
+
+public:
+	Stopwatch()
+		: start{ chrono::steady_clock::now() } {
+	}
+
+	double GetNanoseconds() {
+		return (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+};
+
+void PrintBenchmark(const char* name, double nanoseconds, long long operations, long long allocations) {
+	cout << "Benchmark: " << name << ": " << nanoseconds / operations << " ns/op, " << (double)allocations / operations << " allocations/op" << endl;
+}
+
+template <template <typename, typename> class TComplexMap>
+void BenchmarkGetOrAddArray(const char* name) {
+	const int keyCount = 1000;
+	const int operations = 200000;
+	int array1[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	TComplexMap<int, int> complexMap;
+
+	int size;
+	long long allocations = allocationCount;
+	Stopwatch missStopwatch;
+	for (int i = 0; i < operations; i++) {
+		if (i % keyCount == 0)
+			complexMap.RemoveAll();
+		complexMap.GetOrAddArray(i % keyCount, &size, array1, sizeof(array1) / sizeof(int));
+	}
+	cout << name << endl;
+	PrintBenchmark("GetOrAddArray miss", missStopwatch.GetNanoseconds(), operations, allocationCount - allocations);
+
+	allocations = allocationCount;
+	Stopwatch hitStopwatch;
+	for (int i = 0; i < operations; i++)
+		complexMap.GetOrAddArray(i % keyCount, &size, array1, sizeof(array1) / sizeof(int));
+	PrintBenchmark("GetOrAddArray hit", hitStopwatch.GetNanoseconds(), operations, allocationCount - allocations);
+}
+
+template <typename TRead>
+double MeasureReadThroughput(int threadCount, int operationsPerThread, TRead read) {
+	vector<thread> threads;
+	Stopwatch stopwatch;
+	for (int t = 0; t < threadCount; t++)
+		threads.emplace_back([&, t]() {
+			int value = 0;
+			unsigned int key = t * 7919;
+			for (int i = 0; i < operationsPerThread; i++) {
+				key = key * 1103515245 + 12345;
+				read((int)(key % 100000), &value);
+			}
+		});
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	return (double)threadCount * operationsPerThread / stopwatch.GetNanoseconds() * 1000;
+}
+
+void BenchmarkConcurrentReads() {
+	const int operationsPerThread = 200000;
+	ConcurrentComplexMap<int, int> concurrentMap;
+	LockFreeComplexMap<int, int> lockFreeMap;
+	ComplexMap<int, int, FlatHashIndex, InlineStorage> lockedMap;
+	mutex lockedMapMutex;
+	for (int i = 0; i < 100000; i++) {
+		concurrentMap.AddValue(i, i);
+		lockFreeMap.AddValue(i, i);
+		lockedMap.AddValue(i, i);
+	}
+
+	// Scaling is only near-linear while the threads get cores of their own
+	cout << "Benchmark: TryGetValue read scaling on " << thread::hardware_concurrency() << " hardware threads" << endl;
+	double singleThreadThroughput = 0;
+	for (int threadCount = 1; threadCount <= 8; threadCount *= 2) {
+		double lockedThroughput = MeasureReadThroughput(threadCount, operationsPerThread, [&](int key, int* value) {
+			lock_guard<mutex> lock(lockedMapMutex);
+			lockedMap.TryGetValue(key, value);
+		});
+		double shardedThroughput = MeasureReadThroughput(threadCount, operationsPerThread, [&](int key, int* value) {
+			concurrentMap.TryGetValue(key, value);
+		});
+		double lockFreeThroughput = MeasureReadThroughput(threadCount, operationsPerThread, [&](int key, int* value) {
+			lockFreeMap.TryGetValue(key, value);
+		});
+		if (threadCount == 1)
+			singleThreadThroughput = lockFreeThroughput;
+		cout << "Benchmark: TryGetValue with " << threadCount << " threads: global mutex " << lockedThroughput << " Mops/s, sharded " << shardedThroughput << " Mops/s, lock-free " << lockFreeThroughput << " Mops/s, lock-free scaling " << lockFreeThroughput / singleThreadThroughput << "x" << endl;
+	}
+}
+
+void BenchmarkStringKeys() {
+	const int keyCount = 1000;
+	const int operations = 200000;
+	ComplexMap<string, int, FlatHashIndex, InlineStorage> complexMap;
+	vector<string> keys;
+	for (int i = 0; i < keyCount; i++) {
+		keys.push_back("benchmark key that does not fit the small string buffer " + to_string(i));
+		complexMap.AddValue(keys[i], i);
+	}
+
+	long long allocations = allocationCount;
+	Stopwatch temporaryStopwatch;
+	for (int i = 0; i < operations; i++)
+		complexMap.GetValue(string(keys[i % keyCount].c_str()));
+	cout << "ComplexMap<string, int>" << endl;
+	PrintBenchmark("GetValue by temporary string", temporaryStopwatch.GetNanoseconds(), operations, allocationCount - allocations);
+
+	allocations = allocationCount;
+	Stopwatch pointerStopwatch;
+	for (int i = 0; i < operations; i++)
+		complexMap.GetValue(keys[i % keyCount].c_str());
+	PrintBenchmark("GetValue by const char*", pointerStopwatch.GetNanoseconds(), operations, allocationCount - allocations);
+}
+
+void BenchmarkJournal() {
+	const char* snapshotPath = "ComplexMapJournal.snapshot.tmp";
+	const char* journalPath = "ComplexMapJournal.journal.tmp";
+	const int operations = 500;
+
+	for (int syncRecords = 1; syncRecords <= 64; syncRecords *= 64) {
+		remove(snapshotPath);
+		remove(journalPath);
+		JournalOptions options;
+		options.SyncRecords = syncRecords;
+		JournaledComplexMap<int, int> complexMap(snapshotPath, journalPath, options);
+
+		Stopwatch stopwatch;
+		for (int i = 0; i < operations; i++)
+			complexMap.AddValueOrReplace(i % 100, i);
+		complexMap.Sync();
+		cout << "Benchmark: journaled AddValueOrReplace with sync every " << syncRecords << " records: " << stopwatch.GetNanoseconds() / operations << " ns/op, " << complexMap.GetSyncCount() << " syncs" << endl;
+	}
+	remove(snapshotPath);
+	remove(journalPath);
+}
+
+void BenchmarkColumnarScan() {
+	const int valueCount = 1000000;
+	ComplexMap<int, int, FlatHashIndex, InlineStorage> complexMap;
+	ColumnarComplexMap<int, int> columnarMap;
+	for (int i = 0; i < valueCount; i++) {
+		complexMap.AddValue(i, i % 1000);
+		columnarMap.AddValue(i, i % 1000);
+	}
+
+	long long sum = 0;
+	Stopwatch indexStopwatch;
+	complexMap.ForEachValue([&](int key, int value) { sum += value; });
+	double indexNanoseconds = indexStopwatch.GetNanoseconds();
+
+	Stopwatch columnarStopwatch;
+	long long columnarSum = columnarMap.SumValues();
+	double columnarNanoseconds = columnarStopwatch.GetNanoseconds();
+
+	Stopwatch countStopwatch;
+	size_t count = columnarMap.CountValuesWhere(ValueComparison::Less, 500);
+	double countNanoseconds = countStopwatch.GetNanoseconds();
+	if (sum != columnarSum || count != (size_t)valueCount / 2)
+		throw "Columnar benchmark results differ!";
+
+	cout << "Benchmark: sum of " << valueCount << " values: ForEachValue over index " << indexNanoseconds / valueCount << " ns/value, columnar SumValues "
+		<< columnarNanoseconds / valueCount << " ns/value, CountValuesWhere " << countNanoseconds / valueCount << " ns/value" << endl;
+}
+
+// Batches below BatchGroupSize, and indexes without PrefetchesBatches, run the single-key loop
+template <template <typename, typename> class TComplexMap>
+void BenchmarkBatchLookups(const char* name) {
+	const int keyCount = 1000000;
+	const int lookupCount = 1 << 20;
+	TComplexMap<int, int> complexMap;
+	vector<int> keys(lookupCount);
+	unsigned int key = 1;
+	for (int i = 0; i < keyCount; i++)
+		complexMap.AddValue(i, i);
+	for (int i = 0; i < lookupCount; i++) {
+		key = key * 1103515245 + 12345;
+		keys[i] = (int)(key % keyCount);
+	}
+
+	vector<int> values(lookupCount);
+	unique_ptr<bool[]> found(new bool[lookupCount]);
+	Stopwatch singleStopwatch;
+	for (int i = 0; i < lookupCount; i++)
+		found[i] = complexMap.TryGetValue(keys[i], &values[i]);
+	cout << "Benchmark: TryGetValue over " << keyCount << " keys, " << name << ": " << singleStopwatch.GetNanoseconds() / lookupCount << " ns/key" << endl;
+
+	for (int batchSize = 1; batchSize <= 512; batchSize *= 8) {
+		Stopwatch batchStopwatch;
+		for (int i = 0; i < lookupCount; i += batchSize)
+			complexMap.TryGetValues(keys.data() + i, values.data() + i, found.get() + i, batchSize);
+		cout << "Benchmark: TryGetValues in batches of " << batchSize << ", " << name << ": " << batchStopwatch.GetNanoseconds() / lookupCount << " ns/key" << endl;
+	}
+}
+
+template <template <typename, typename> class TComplexMap>
+void BenchmarkIntegerLookups(const char* name) {
+	const int keyCount = 100000;
+	const int operations = 1000000;
+	TComplexMap<int, int> complexMap;
+	for (int i = 0; i < keyCount; i++)
+		complexMap.AddValue(i, i);
+
+	long long sum = 0;
+	unsigned int key = 1;
+	long long allocations = allocationCount;
+	Stopwatch stopwatch;
+	for (int i = 0; i < operations; i++) {
+		key = key * 1103515245 + 12345;
+		sum += complexMap.GetValue((int)(key % keyCount));
+	}
+	double nanoseconds = stopwatch.GetNanoseconds();
+	if (sum <= 0)
+		throw "Integer lookups return wrong values!";
+	PrintBenchmark(name, nanoseconds, operations, allocationCount - allocations);
+}
+
+void BenchmarkBulkLoad() {
+	const int recordCount = 200000;
+	int array1[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+	vector<BulkRecord<int, int>> records;
+	unsigned int key = 1;
+	for (int i = 0; i < recordCount; i++) {
+		key = key * 1103515245 + 12345;
+		records.push_back(BulkRecord<int, int>::ForArray((int)(key >> 1), array1, 12));
+	}
+
+	OrderedComplexMap<int, int> addedMap;
+	Stopwatch addStopwatch;
+	for (int i = 0; i < recordCount; i++)
+		addedMap.TryAddArray(records[i].Key, array1, 12);
+	cout << "Benchmark: TryAddArray of " << recordCount << " unsorted keys, OrderedIndex: " << addStopwatch.GetNanoseconds() / recordCount << " ns/key" << endl;
+
+	OrderedComplexMap<int, int> loadedMap;
+	Stopwatch loadStopwatch;
+	loadedMap.BulkLoad(records.data(), records.size(), DuplicatePolicy::Skip);
+	cout << "Benchmark: BulkLoad of " << recordCount << " unsorted keys, OrderedIndex: " << loadStopwatch.GetNanoseconds() / recordCount << " ns/key" << endl;
+	if (loadedMap.GetSize() != addedMap.GetSize())
+		throw "Bulk load adds wrong keys!";
+}
+
+void RunBenchmarks() {
+	BenchmarkGetOrAddArray<OrderedComplexMap>("OrderedIndex, HeapStorage");
+	BenchmarkGetOrAddArray<FlatHashInlineComplexMap>("FlatHashIndex, InlineStorage");
+	BenchmarkIntegerLookups<OrderedInlineComplexMap>("GetValue by int key, OrderedIndex");
+	BenchmarkIntegerLookups<FlatHashInlineComplexMap>("GetValue by int key, FlatHashIndex");
+	BenchmarkIntegerLookups<DenseInlineComplexMap>("GetValue by int key, DenseIndex");
+	BenchmarkStringKeys();
+	BenchmarkBatchLookups<FlatHashComplexMap>("FlatHashIndex");
+	BenchmarkBatchLookups<SharedComplexMap>("ChunkedIndex");
+	BenchmarkConcurrentReads();
+	BenchmarkJournal();
+	BenchmarkColumnarScan();
+	BenchmarkBulkLoad();
+}
+
 void main() {
-	SimpleTest();
-	TryAddMethods();
-	TryGetMethods();
-	GetOrAddMethods();
-	SimpleTestWithOtherTypes();
-	ExceptionOnGetMissingKeys();
-	ExceptionOnAddingDuplicateValue();
-	ExceptionOnGetInvalidType();
-	RemoveTempMemory();
+	RunTests<OrderedComplexMap>();
+	RunTests<FlatHashComplexMap>();
+	RunTests<OrderedInlineComplexMap>();
+	RunTests<FlatHashInlineComplexMap>();
+	RunTests<ArenaComplexMap>();
+	RunTests<FlatHashInlineArenaComplexMap>();
+	RunTests<DenseComplexMap>();
+	RunTests<DenseInlineComplexMap>();
+	RunTests<SharedComplexMap>();
+	ForkAndSnapshot<SharedComplexMap>();
+	CompressedArrays<OrderedComplexMap, int>();
+	CompressedArrays<FlatHashComplexMap, long long>();
+	CompressedArrays<ArenaComplexMap, short>();
+	CompressedArrays<OrderedComplexMap, unsigned int>();
+	InterningPayloads<OrderedComplexMap>();
+	InterningPayloads<FlatHashComplexMap>();
+	DenseIndexLayouts();
+	OrderedCursors<OrderedComplexMap>();
+	OrderedCursors<OrderedInlineComplexMap>();
+	OrderedCursors<ArenaComplexMap>();
+	ShortPayloadAllocations();
+	ArenaReusesFreedSlots();
+	ZeroCopyAllocations();
+	ConcurrentStressTest();
+	SimpleTest<LockFreeComplexMap>();
+	TryAddMethods<LockFreeComplexMap>();
+	TryGetMethods<LockFreeComplexMap>();
+	GetOrAddMethods<LockFreeComplexMap>();
+	SimpleTestWithOtherTypes<LockFreeComplexMap>();
+	ExceptionOnGetMissingKeys<LockFreeComplexMap>();
+	ExceptionOnAddingDuplicateValue<LockFreeComplexMap>();
+	ReplaceOnAddingDuplicateValue<LockFreeComplexMap>();
+	ExceptionOnGetInvalidType<LockFreeComplexMap>();
+	ManyKeysTest<LockFreeComplexMap>();
+	LockFreeReadTest();
+	JournalReplay();
+	SimpleTest<FlatHashColumnarComplexMap>();
+	TryAddMethods<FlatHashColumnarComplexMap>();
+	TryGetMethods<FlatHashColumnarComplexMap>();
+	GetOrAddMethods<FlatHashColumnarComplexMap>();
+	SimpleTestWithOtherTypes<FlatHashColumnarComplexMap>();
+	ExceptionOnGetMissingKeys<FlatHashColumnarComplexMap>();
+	ExceptionOnAddingDuplicateValue<FlatHashColumnarComplexMap>();
+	ReplaceOnAddingDuplicateValue<FlatHashColumnarComplexMap>();
+	ExceptionOnGetInvalidType<FlatHashColumnarComplexMap>();
+	ManyKeysTest<FlatHashColumnarComplexMap>();
+	StringKeyLookup<FlatHashColumnarComplexMap>();
+	TypedIteration<FlatHashColumnarComplexMap>();
+	ColumnarAggregates<int>();
+	ColumnarAggregates<double>();
+	ColumnarAggregates<float>();
+	ColumnarAggregates<short>();
+	SimpleTest<FlatHashCachedComplexMap>();
+	TryAddMethods<FlatHashCachedComplexMap>();
+	TryGetMethods<FlatHashCachedComplexMap>();
+	GetOrAddMethods<FlatHashCachedComplexMap>();
+	SimpleTestWithOtherTypes<FlatHashCachedComplexMap>();
+	ExceptionOnGetMissingKeys<FlatHashCachedComplexMap>();
+	ExceptionOnAddingDuplicateValue<FlatHashCachedComplexMap>();
+	ReplaceOnAddingDuplicateValue<FlatHashCachedComplexMap>();
+	ExceptionOnGetInvalidType<FlatHashCachedComplexMap>();
+	ManyKeysTest<FlatHashCachedComplexMap>();
+	StringKeyLookup<FlatHashCachedComplexMap>();
+	CacheEviction();
+	SimpleTest<SpillingComplexMap>();
+	TryAddMethods<SpillingComplexMap>();
+	TryGetMethods<SpillingComplexMap>();
+	GetOrAddMethods<SpillingComplexMap>();
+	SimpleTestWithOtherTypes<SpillingComplexMap>();
+	ExceptionOnGetMissingKeys<SpillingComplexMap>();
+	ExceptionOnAddingDuplicateValue<SpillingComplexMap>();
+	ReplaceOnAddingDuplicateValue<SpillingComplexMap>();
+	ExceptionOnGetInvalidType<SpillingComplexMap>();
+	RemoveTempMemory<SpillingComplexMap>();
+	ManyKeysTest<SpillingComplexMap>();
+	StringKeyLookup<SpillingComplexMap>();
+	GrowableEntries<SpillingComplexMap>();
+	ArrayElementAccess<SpillingComplexMap>();
+	TieredSpilling();
+	MemoryAccounting<OrderedIndex, HeapStorage>(false, false);
+	MemoryAccounting<FlatHashIndex, HeapStorage>(false, true);
+	MemoryAccounting<FlatHashIndex, InlineStorage>(true, true);
+	MemoryAccounting<DenseIndex, InlineStorage>(true, false);
+	DeferredReclamation<FlatHashIndex, HeapStorage>(ReclaimMode::Immediate);
+	DeferredReclamation<FlatHashIndex, HeapStorage>(ReclaimMode::Deferred);
+	DeferredReclamation<OrderedIndex, HeapStorage>(ReclaimMode::Background);
+	DeferredReclamation<FlatHashIndex, InlineStorage>(ReclaimMode::Background);
+	AssertConstCharException("Check exception on background reclamation with an arena", [&]() { ArenaComplexMap<int, int>().SetReclaimMode(ReclaimMode::Background); });
+	RunBenchmarks();
 
 	cout << "All test success!" << endl;
 	system("pause>>void");